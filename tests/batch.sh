@@ -0,0 +1,36 @@
+#! /bin/bash
+
+#
+# This file benchmarks adding work in batches against adding
+# it one job at a time
+#
+
+. funcs.sh
+
+
+# ---------------------------- Tests -----------------------------------
+
+
+function test_batch_submit { #jobs #threads #batchsize
+	echo "Submitting $1 jobs to $2 threads one by one and in batches of $3"
+	compile src/batch.c
+	output=$(./test $1 $2 $3)
+	if [[ $? != 0 ]]; then
+		err "$output" "$output"
+		exit 1
+	fi
+	echo "$output"
+	single=$(echo "$output" | awk '/^single:/ {print $2}')
+	batch=$(echo "$output" | awk '/^batch:/ {print $2}')
+	if (( "$batch" < "$single" )); then
+		err "Batches were slower than single jobs" "$output"
+		exit 1
+	fi
+}
+
+
+# Run tests
+test_batch_submit 1000000 4 1000
+test_batch_submit 1000000 16 64
+
+echo "No batch errors"
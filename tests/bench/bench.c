@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "thpool.h"
+
+/*
+ * Benchmarks the hot paths of the threadpool.
+ *
+ * Arguments: benchmark (or "all"), number of jobs, thread counts
+ *
+ * Only uses the API of the original threadpool, so the same file builds
+ * against older versions of thpool.c to compare with. Prints one CSV line
+ * per result:
+ *
+ *   benchmark,threads,metric,value
+ *
+ * Metrics ending in _per_sec are better higher, _ns ones lower.
+ *
+ * Benchmarks:
+ *   throughput   empty jobs added from one thread, until all ran
+ *   submit       time spent in thpool_add_work() per call
+ *   wake         idle pool, time from adding a job until it starts
+ *   fanout       jobs each adding jobs, a tree of empty jobs
+ *   mixed        mostly empty jobs between some 50us ones, latency of
+ *                the empty ones from adding until they finish
+ *   contention   empty jobs added from 4 threads at once
+ * */
+
+#define PRODUCERS 4
+#define FANOUT    8
+
+
+typedef struct bench {
+	const char* name;
+	void (*run)(int num_threads, long num_jobs);
+} bench;
+
+
+threadpool thpool;
+volatile long counter;
+
+
+double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+int compare(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+
+void report(const char* name, int num_threads, const char* metric, double value) {
+	printf("%s,%d,%s,%.1f\n", name, num_threads, metric, value);
+	fflush(stdout);
+}
+
+
+/* Report the median and 99th percentile of n samples */
+void report_percentiles(const char* name, int num_threads, double* samples, long n) {
+	qsort(samples, n, sizeof(double), compare);
+	report(name, num_threads, "p50_ns", samples[n / 2]);
+	report(name, num_threads, "p99_ns", samples[n * 99 / 100]);
+}
+
+
+void nop(void* arg) {
+}
+
+
+void count(void* arg) {
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+
+void spin(long ns) {
+	double until = now_ns() + ns;
+	while (now_ns() < until);
+}
+
+
+/* ---------------------------------------------------------------------- */
+
+
+void bench_throughput(int num_threads, long num_jobs) {
+	long n;
+	double start = now_ns();
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, nop, NULL);
+	}
+	thpool_wait(thpool);
+	report("throughput", num_threads, "jobs_per_sec", num_jobs / ((now_ns() - start) / 1e9));
+}
+
+
+void bench_submit(int num_threads, long num_jobs) {
+	double* samples = malloc(num_jobs * sizeof(double));
+	long n;
+	for (n=0; n<num_jobs; n++) {
+		double start = now_ns();
+		thpool_add_work(thpool, nop, NULL);
+		samples[n] = now_ns() - start;
+	}
+	thpool_wait(thpool);
+	report_percentiles("submit", num_threads, samples, num_jobs);
+	free(samples);
+}
+
+
+void record_start(void* arg) {
+	*(double*)arg = now_ns();
+}
+
+
+void bench_wake(int num_threads, long num_jobs) {
+	long rounds = num_jobs / 1000 < 100 ? 100 : num_jobs / 1000;
+	double* samples = malloc(rounds * sizeof(double));
+	double started;
+	long r;
+	for (r=0; r<rounds; r++) {
+		usleep(1000); /* let every thread go idle */
+		double added = now_ns();
+		thpool_add_work(thpool, record_start, &started);
+		thpool_wait(thpool);
+		samples[r] = started - added;
+	}
+	report_percentiles("wake", num_threads, samples, rounds);
+	free(samples);
+}
+
+
+void fan(void* depth) {
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+	if ((long)depth > 0) {
+		int n;
+		for (n=0; n<FANOUT; n++) {
+			thpool_add_work(thpool, fan, (void*)((long)depth - 1));
+		}
+	}
+}
+
+
+void bench_fanout(int num_threads, long num_jobs) {
+	/* Deepest full tree with at most num_jobs jobs */
+	long depth = 0, jobs = 1, level = 1;
+	while (jobs + level * FANOUT <= num_jobs) {
+		level *= FANOUT;
+		jobs += level;
+		depth++;
+	}
+	counter = 0;
+	double start = now_ns();
+	thpool_add_work(thpool, fan, (void*)depth);
+	thpool_wait(thpool);
+	double elapsed = now_ns() - start;
+	if (counter != jobs) {
+		fprintf(stderr, "fanout ran %ld of %ld jobs\n", counter, jobs);
+		exit(1);
+	}
+	report("fanout", num_threads, "jobs_per_sec", jobs / (elapsed / 1e9));
+}
+
+
+typedef struct mixed_job {
+	double added;
+	double finished;
+	long   spin_ns;
+} mixed_job;
+
+
+void mixed(void* arg) {
+	mixed_job* job = arg;
+	if (job->spin_ns) spin(job->spin_ns);
+	job->finished = now_ns();
+}
+
+
+void bench_mixed(int num_threads, long num_jobs) {
+	long total = num_jobs / 10;
+	mixed_job* jobs = calloc(total, sizeof(mixed_job));
+	double* samples = malloc(total * sizeof(double));
+	long n, short_jobs = 0;
+
+	double start = now_ns();
+	for (n=0; n<total; n++) {
+		jobs[n].spin_ns = n % 10 == 0 ? 50000 : 0;
+		jobs[n].added = now_ns();
+		thpool_add_work(thpool, mixed, &jobs[n]);
+	}
+	thpool_wait(thpool);
+	double elapsed = now_ns() - start;
+
+	for (n=0; n<total; n++) {
+		if (jobs[n].spin_ns == 0) {
+			samples[short_jobs++] = jobs[n].finished - jobs[n].added;
+		}
+	}
+	report("mixed", num_threads, "jobs_per_sec", total / (elapsed / 1e9));
+	report_percentiles("mixed", num_threads, samples, short_jobs);
+	free(jobs);
+	free(samples);
+}
+
+
+void* produce(void* num_jobs) {
+	long n;
+	for (n=0; n<(long)num_jobs; n++) {
+		thpool_add_work(thpool, count, NULL);
+	}
+	return NULL;
+}
+
+
+void bench_contention(int num_threads, long num_jobs) {
+	pthread_t producers[PRODUCERS];
+	int n;
+	counter = 0;
+	double start = now_ns();
+	for (n=0; n<PRODUCERS; n++) {
+		pthread_create(&producers[n], NULL, produce, (void*)(num_jobs / PRODUCERS));
+	}
+	for (n=0; n<PRODUCERS; n++) {
+		pthread_join(producers[n], NULL);
+	}
+	thpool_wait(thpool);
+	double elapsed = now_ns() - start;
+	if (counter != num_jobs / PRODUCERS * PRODUCERS) {
+		fprintf(stderr, "contention ran %ld of %ld jobs\n", counter, num_jobs / PRODUCERS * PRODUCERS);
+		exit(1);
+	}
+	report("contention", num_threads, "jobs_per_sec", counter / (elapsed / 1e9));
+}
+
+
+/* ---------------------------------------------------------------------- */
+
+
+bench benches[] = {
+	{"throughput", bench_throughput},
+	{"submit",     bench_submit},
+	{"wake",       bench_wake},
+	{"fanout",     bench_fanout},
+	{"mixed",      bench_mixed},
+	{"contention", bench_contention},
+};
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc < 4){
+		puts("Usage: bench <benchmark|all> <jobs> <threads> [threads ..]");
+		exit(1);
+	}
+	const char* name = argv[1];
+	long num_jobs    = strtol(argv[2], &p, 10);
+
+	int found = 0;
+	size_t b;
+	for (b=0; b<sizeof(benches) / sizeof(benches[0]); b++) {
+		if (strcmp(name, "all") != 0 && strcmp(name, benches[b].name) != 0) continue;
+		found = 1;
+
+		int a;
+		for (a=3; a<argc; a++) {
+			int num_threads = strtol(argv[a], &p, 10);
+			thpool = thpool_init(num_threads);
+
+			/* Warm up the job allocator and the threads */
+			long n;
+			for (n=0; n<num_jobs / 10; n++) {
+				thpool_add_work(thpool, nop, NULL);
+			}
+			thpool_wait(thpool);
+
+			benches[b].run(num_threads, num_jobs);
+			thpool_destroy(thpool);
+		}
+	}
+	if (!found) {
+		printf("Unknown benchmark %s\n", name);
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+#! /bin/bash
+
+#
+# Compares two result files of run.sh
+#
+# Usage: ./compare.sh baseline.csv results.csv
+#
+# Prints every metric of both with the change in percent, positive when
+# the second file is better.
+#
+
+if [[ $# != 2 ]]; then
+	echo "Usage: $0 baseline.csv results.csv"
+	exit 1
+fi
+
+awk -F, '
+	FNR == 1 { next }
+	NR == FNR { base[$1 "," $2 "," $3] = $4; next }
+	{
+		key = $1 "," $2 "," $3
+		if (!(key in base) || base[key] == 0) next
+		change = ($4 - base[key]) / base[key] * 100
+		if ($3 ~ /_ns$/) change = -change
+		printf "%-12s %3d %-14s %14.1f %14.1f %+8.1f%%\n", $1, $2, $3, base[key], $4, change
+	}
+' "$1" "$2"
@@ -0,0 +1,66 @@
+#! /bin/bash
+
+#
+# Builds and runs the benchmarks, optionally against a baseline
+#
+# Usage: ./run.sh [-b git-ref] [-j jobs] [-t "threads .."] [-o file] [benchmark]
+#
+#   -b   also benchmark thpool.c as of git-ref and compare
+#   -j   jobs per benchmark (default 1000000)
+#   -t   thread counts (default "1 2 4 8")
+#   -o   CSV file for the results (default results.csv, the baseline
+#        goes to baseline.csv)
+#
+# Extra compiler flags can be exported in COMPILATION_FLAGS.
+#
+
+cd "$(dirname "$0")"
+
+baseline=""
+jobs=1000000
+threads="1 2 4 8"
+output=results.csv
+while getopts "b:j:t:o:" opt; do
+	case $opt in
+		b) baseline=$OPTARG ;;
+		j) jobs=$OPTARG ;;
+		t) threads=$OPTARG ;;
+		o) output=$OPTARG ;;
+		*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+name=${1:-all}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+
+function build { #srcdir #binary
+	gcc -O2 $COMPILATION_FLAGS -I "$1" bench.c "$1/thpool.c" -pthread -o "$2" || exit 1
+}
+
+
+function run { #binary #csv
+	echo "benchmark,threads,metric,value" > "$2"
+	"$1" "$name" "$jobs" $threads | tee -a "$2" || exit 1
+}
+
+
+if [[ -n $baseline ]]; then
+	mkdir "$tmp/baseline"
+	git show "$baseline:thpool.c" > "$tmp/baseline/thpool.c" &&
+	git show "$baseline:thpool.h" > "$tmp/baseline/thpool.h" || exit 1
+	build "$tmp/baseline" "$tmp/bench_baseline"
+	echo "Baseline $baseline"
+	run "$tmp/bench_baseline" baseline.csv
+fi
+
+build ../.. "$tmp/bench"
+echo "Working tree"
+run "$tmp/bench" "$output"
+
+if [[ -n $baseline ]]; then
+	echo
+	./compare.sh baseline.csv "$output"
+fi
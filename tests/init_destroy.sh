@@ -0,0 +1,30 @@
+#! /bin/bash
+
+#
+# This file checks that creating and destroying idle
+# threadpools is fast
+#
+
+. funcs.sh
+
+
+# ---------------------------- Tests -----------------------------------
+
+
+function test_init_destroy { #threads #rounds #maxmillisecs
+	echo "Creating and destroying $2 pools of $1 threads"
+	compile src/init_destroy.c
+	output=$(./test $1 $2 $3)
+	if [[ $? != 0 ]]; then
+		err "$output" "$output"
+		exit 1
+	fi
+	echo "$output"
+}
+
+
+# Run tests
+test_init_destroy 1 100 10
+test_init_destroy 32 100 10
+
+echo "No init/destroy errors"
@@ -45,6 +45,21 @@ function _test_thread_free_multi { #threads
 }
 
 
+function test_copy_free { #jobs #threads
+	echo "Testing destruction with $1 copied arguments queued on $2 threads"
+	compile src/copy_destroy.c
+	output=$(valgrind --leak-check=full --track-origins=yes ./test "$1" "$2" 2>&1 > /dev/null)
+	heap_usage=$(echo "$output" | grep "total heap usage")
+	allocs=$(extract_num "[0-9]* allocs" "$heap_usage")
+	frees=$(extract_num "[0-9]* frees" "$heap_usage")
+	if (( "$allocs" == "$frees" )); then
+		return
+	fi
+	err "Allocated $allocs times but freed only $frees" "$output"
+	exit 1
+}
+
+
 # This is the same with test_many_thread_allocs but multiplied
 function test_thread_free_multi { #threads #times #nparallel
 	echo "Testing multiple threads creation and destruction in pool(threads=$1 times=$2)"
@@ -84,6 +99,7 @@ test_thread_free 4
 test_thread_free 8
 test_thread_free 1
 test_thread_free 20
+test_copy_free 100 4
 test_thread_free_multi 4 20
 
 # test_thread_free_multi 3 1000  # Takes way too long
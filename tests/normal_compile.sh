@@ -14,5 +14,9 @@
 . heap_stack_garbage.sh
 . memleaks.sh
 . wait.sh
+. batch.sh
+. parallel_for.sh
+. wake_latency.sh
+. init_destroy.sh
 
 echo "No errors"
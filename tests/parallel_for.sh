@@ -0,0 +1,31 @@
+#! /bin/bash
+
+#
+# This file checks parallel loops and benchmarks them against adding
+# a job per element
+#
+
+. funcs.sh
+
+
+# ---------------------------- Tests -----------------------------------
+
+
+function test_parallel_for { #elements #threads
+	echo "Running parallel loops over $1 elements on $2 threads"
+	compile src/parallel_for.c
+	output=$(timeout 120 ./test $1 $2)
+	if [[ $? != 0 ]]; then
+		err "$output" "$output"
+		exit 1
+	fi
+	echo "$output"
+}
+
+
+# Run tests
+test_parallel_for 1000000 4
+test_parallel_for 1000 16
+test_parallel_for 3 1
+
+echo "No parallel loop errors"
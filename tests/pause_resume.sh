@@ -28,8 +28,23 @@ function test_pause_resume_est7secs { #threads
 
 
 
+function test_pause_pools { #threads
+	echo "Pause, drain and resume one of two pools with $1 threads each"
+	compile src/pause_pools.c
+	output=$(./test "$1")
+	if [[ $? != 0 ]]; then
+		err "$output" "$output"
+		exit 1
+	fi
+	echo "$output"
+}
+
+
+
 # Run tests
 test_pause_resume_est7secs 4
+test_pause_pools 1
+test_pause_pools 4
 
 
 
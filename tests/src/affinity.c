@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../../thpool.h"
+
+/*
+ * Checks the CPUs threads get pinned to.
+ *
+ * Arguments: none
+ *
+ * A fake topology of 2 packages with 2 cores of 2 SMT siblings each is
+ * written to a temporary directory, numbered like Linux does (cpu0-3 are
+ * the first siblings, cpu4-7 the second). Every policy must order the CPUs
+ * as expected. Then threads are pinned for real and jobs check that they
+ * run on the CPU they were given.
+ * */
+
+char root[] = "/tmp/thpool_sysfs_XXXXXX";
+
+
+void write_file(const char* path, int value) {
+	char file[256];
+	snprintf(file, sizeof(file), "%s/%s", root, path);
+	FILE* fp = fopen(file, "w");
+	fprintf(fp, "%d\n", value);
+	fclose(fp);
+}
+
+
+void fake_topology(void) {
+	char dir[256];
+	int cpu;
+	if (mkdtemp(root) == NULL) {
+		puts("Could not create temporary directory");
+		exit(1);
+	}
+	snprintf(dir, sizeof(dir), "%s/cpu", root);
+	mkdir(dir, 0755);
+	snprintf(dir, sizeof(dir), "%s/cpu/online", root);
+	FILE* fp = fopen(dir, "w");
+	fputs("0-7\n", fp);
+	fclose(fp);
+	for (cpu=0; cpu<8; cpu++) {
+		snprintf(dir, sizeof(dir), "%s/cpu/cpu%d", root, cpu);
+		mkdir(dir, 0755);
+		snprintf(dir, sizeof(dir), "%s/cpu/cpu%d/topology", root, cpu);
+		mkdir(dir, 0755);
+		snprintf(dir, sizeof(dir), "cpu/cpu%d/topology/physical_package_id", cpu);
+		write_file(dir, (cpu % 4) / 2);
+		snprintf(dir, sizeof(dir), "cpu/cpu%d/topology/core_id", cpu);
+		write_file(dir, cpu % 2);
+	}
+}
+
+
+void check_policy(thpool_affinity affinity, const char* name, const int* expected) {
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = 8;
+	config.affinity    = affinity;
+	config.sysfs_root  = root;
+	threadpool thpool = thpool_init_config(&config);
+
+	int n;
+	for (n=0; n<8; n++) {
+		if (thpool_thread_cpu(thpool, n) != expected[n]) {
+			printf("%s: thread %d got CPU %d instead of %d\n", name, n, thpool_thread_cpu(thpool, n), expected[n]);
+			exit(1);
+		}
+	}
+	thpool_destroy(thpool);
+}
+
+
+threadpool thpool;
+int wrong = 0;
+
+
+void where(void* arg) {
+	int cpu = thpool_current_cpu(thpool);
+	if (cpu != thpool_thread_cpu(thpool, 0) && cpu != thpool_thread_cpu(thpool, 1)) {
+		__atomic_add_fetch(&wrong, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+int main(){
+
+	fake_topology();
+
+	int compact[] = {0, 4, 1, 5, 2, 6, 3, 7};
+	int scatter[] = {0, 2, 1, 3, 4, 6, 5, 7};
+	int cores[]   = {0, 1, 2, 3, 0, 1, 2, 3};
+	check_policy(THPOOL_AFFINITY_COMPACT, "compact", compact);
+	check_policy(THPOOL_AFFINITY_SCATTER, "scatter", scatter);
+	check_policy(THPOOL_AFFINITY_CORES,   "cores",   cores);
+
+	char cmd[300];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+	if (system(cmd) != 0) {
+		puts("Could not remove temporary directory");
+	}
+
+	/* Pin for real */
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = 2;
+	config.affinity    = THPOOL_AFFINITY_COMPACT;
+	thpool = thpool_init_config(&config);
+	if (thpool_thread_cpu(thpool, 0) < 0) {
+		puts("Thread was not given a CPU");
+		exit(1);
+	}
+	int n;
+	for (n=0; n<100; n++) {
+		thpool_add_work(thpool, where, NULL);
+	}
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+	if (wrong) {
+		printf("%d jobs ran on a CPU they were not pinned to\n", wrong);
+		exit(1);
+	}
+
+	return 0;
+}
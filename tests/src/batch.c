@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../thpool.h"
+
+/*
+ * Compares adding work one job at a time with adding it in batches.
+ *
+ * Arguments: number of jobs, number of threads, batch size
+ *
+ * Prints the submit throughput of both and fails if any job got lost.
+ * Every other batch is added with per-job functions.
+ * */
+
+int sum = 0;
+
+
+void increment(void* arg) {
+	__atomic_add_fetch(&sum, 1, __ATOMIC_RELAXED);
+}
+
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 4){
+		puts("This testfile needs exactly three arguments");
+		exit(1);
+	}
+	int num_jobs    = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+	int batch_size  = strtol(argv[3], &p, 10);
+
+	threadpool thpool = thpool_init(num_threads);
+
+	void** args = calloc(batch_size, sizeof(void*));
+	void (**fns)(void*) = malloc(batch_size * sizeof(*fns));
+	int n;
+	for (n=0; n<batch_size; n++){
+		fns[n] = increment;
+	}
+
+	/* Warm up job allocator */
+	for (n=0; n<num_jobs; n++){
+		thpool_add_work(thpool, increment, NULL);
+	}
+	thpool_wait(thpool);
+
+	double start = now();
+	for (n=0; n<num_jobs; n++){
+		thpool_add_work(thpool, increment, NULL);
+	}
+	double single = now() - start;
+	thpool_wait(thpool);
+
+	start = now();
+	int added, batches = 0;
+	for (added=0; added<num_jobs; added+=batch_size){
+		int size = num_jobs - added < batch_size ? num_jobs - added : batch_size;
+		if (batches++ % 2)
+			thpool_add_work_batch_fns(thpool, fns, args, size);
+		else
+			thpool_add_work_batch(thpool, increment, args, size);
+	}
+	double batch = now() - start;
+	thpool_wait(thpool);
+
+	printf("single: %.0f jobs/s\n", num_jobs / single);
+	printf("batch:  %.0f jobs/s\n", num_jobs / batch);
+
+	thpool_destroy(thpool);
+	free(args);
+	free(fns);
+
+	if (sum != 3 * num_jobs){
+		printf("Expected %d jobs to run, got %d\n", 3 * num_jobs, sum);
+		return -1;
+	}
+	return 0;
+}
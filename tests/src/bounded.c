@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../../thpool.h"
+
+/*
+ * Checks the policies of a bounded job queue.
+ *
+ * Arguments: number of jobs, number of threads, queue capacity
+ *
+ * A paused pool keeps its queue full to check what adding one more job
+ * does with every policy. Then jobs are added as fast as possible to a
+ * running pool; no more than the capacity may be waiting at any time
+ * (plus one per thread that took a job but didn't call it yet). Jobs
+ * adding jobs from inside the pool never wait, even on a full queue.
+ * */
+
+int capacity;
+int num_threads;
+volatile long started = 0;
+volatile int producer_done = 0;
+volatile int nested_done = 0;
+pthread_t caller;
+volatile int ran_by_caller = 0;
+
+
+void count(void* arg) {
+	__atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void check_caller(void* arg) {
+	ran_by_caller = pthread_equal(pthread_self(), caller);
+}
+
+
+void nested(void* thpool) {
+	int n;
+	for (n=0; n<capacity * 2; n++) {
+		thpool_add_work(thpool, count, NULL);
+	}
+	nested_done = 1;
+}
+
+
+void* produce(void* thpool) {
+	thpool_add_work(thpool, count, NULL);
+	producer_done = 1;
+	return NULL;
+}
+
+
+threadpool init(int policy) {
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads    = num_threads;
+	config.queue_capacity = capacity;
+	config.full_policy    = policy;
+	return thpool_init_config(&config);
+}
+
+
+/* Pause the pool and fill its queue */
+void fill(threadpool thpool) {
+	int n;
+	thpool_pause(thpool);
+	usleep(10000);
+	for (n=0; n<capacity; n++) {
+		if (thpool_try_add_work(thpool, count, NULL) != 0) {
+			printf("Could not fill the queue, %d of %d slots\n", n, capacity);
+			exit(1);
+		}
+	}
+	errno = 0;
+	if (thpool_try_add_work(thpool, count, NULL) != -1 || errno != EAGAIN) {
+		puts("Adding to a full queue didn't fail with EAGAIN");
+		exit(1);
+	}
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 4){
+		puts("This testfile needs exactly three arguments");
+		exit(1);
+	}
+	int num_jobs = strtol(argv[1], &p, 10);
+	num_threads  = strtol(argv[2], &p, 10);
+	capacity     = strtol(argv[3], &p, 10);
+
+	/* Blocking waits for a slot */
+	threadpool thpool = init(THPOOL_FULL_BLOCK);
+	fill(thpool);
+	pthread_t producer;
+	pthread_create(&producer, NULL, produce, thpool);
+	usleep(50000);
+	if (producer_done) {
+		puts("Adding to a full queue didn't block");
+		exit(1);
+	}
+	thpool_resume(thpool);
+	pthread_join(producer, NULL);
+	thpool_wait(thpool);
+	if (started != capacity + 1) {
+		printf("Ran %ld jobs instead of %d\n", started, capacity + 1);
+		exit(1);
+	}
+
+	/* Producers never get more than capacity ahead */
+	started = 0;
+	long n;
+	for (n=1; n<=num_jobs; n++) {
+		thpool_add_work(thpool, count, NULL);
+		long waiting = n - __atomic_load_n(&started, __ATOMIC_SEQ_CST);
+		if (waiting > capacity + num_threads) {
+			printf("%ld jobs waiting with a capacity of %d\n", waiting, capacity);
+			exit(1);
+		}
+	}
+	thpool_wait(thpool);
+
+	/* Threads add jobs past the capacity */
+	started = 0;
+	thpool_add_work(thpool, nested, thpool);
+	thpool_wait(thpool);
+	if (!nested_done || started != capacity * 2) {
+		puts("Jobs adding jobs got stuck on a full queue");
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	/* Failing fast, for single jobs and batches as a whole */
+	thpool = init(THPOOL_FULL_FAIL);
+	fill(thpool);
+	errno = 0;
+	if (thpool_add_work(thpool, count, NULL) != -1 || errno != EAGAIN) {
+		puts("Adding to a full queue didn't fail");
+		exit(1);
+	}
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	void* args[2] = {NULL, NULL};
+	started = 0;
+	thpool_pause(thpool);
+	usleep(10000);
+	for (n=0; n<capacity - 1; n++) {
+		thpool_add_work(thpool, count, NULL);
+	}
+	if (thpool_add_work_batch(thpool, count, args, 2) != -1) {
+		puts("Adding a batch that doesn't fit didn't fail");
+		exit(1);
+	}
+	if (thpool_add_work_batch(thpool, count, args, 1) != 0) {
+		puts("Adding a batch that fits failed");
+		exit(1);
+	}
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	if (started != capacity) {
+		printf("Ran %ld jobs instead of %d\n", started, capacity);
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	/* The caller runs what doesn't fit */
+	thpool = init(THPOOL_FULL_CALLER_RUNS);
+	fill(thpool);
+	caller = pthread_self();
+	if (thpool_add_work(thpool, check_caller, NULL) != 0 || !ran_by_caller) {
+		puts("A job that didn't fit wasn't run by the caller");
+		exit(1);
+	}
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	return 0;
+}
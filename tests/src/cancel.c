@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../thpool.h"
+
+/*
+ * Checks cancelling jobs and clearing the queue.
+ *
+ * Arguments: number of jobs, number of threads
+ *
+ * Jobs are added to a paused pool, so none of them has started when they
+ * are cancelled or cleared. Dropped jobs must never run and their
+ * arguments must reach the destructor exactly once, cancelled ones
+ * included, while jobs of task graphs survive a clear. A running job must
+ * see its cancellation through thpool_cancelled(), but only when asking
+ * its own pool.
+ * */
+
+#define BIG 100
+
+threadpool thpool;
+volatile int ran = 0;
+volatile int destructed = 0;
+volatile int started = 0;
+volatile int proceed = 0;
+
+
+void count(void* arg) {
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+	free(arg);
+}
+
+
+void* count_future(void* arg) {
+	count(arg);
+	return (void*)1;
+}
+
+
+void count_copy(void* arg) {
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void destruct(void* arg) {
+	__atomic_add_fetch(&destructed, 1, __ATOMIC_SEQ_CST);
+	free(arg);
+}
+
+
+void* until_cancelled(void* arg) {
+	int waited = 0;
+	started = 1;
+	while (!thpool_cancelled(thpool) && waited++ < 10000) {
+		usleep(1000);
+	}
+	return (void*)(long)thpool_cancelled(thpool);
+}
+
+
+void* other_cancelled(void* arg) {
+	started = 1;
+	while (!thpool_cancelled(thpool)) usleep(1000);
+	return (void*)(long)thpool_cancelled((threadpool)arg);
+}
+
+
+void add_deque_jobs(void* arg) {
+	int n;
+	for (n=0; n<(long)arg; n++) {
+		thpool_add_work(thpool, count, malloc(1));
+	}
+	started = 1;
+	while (!proceed) usleep(1000);
+}
+
+
+void pause_pool() {
+	thpool_pause(thpool);
+	usleep(10000);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int num_jobs    = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	thpool = thpool_init(num_threads);
+	thpool_future* futures = malloc(num_jobs * sizeof(thpool_future));
+	void** args = malloc(num_jobs * sizeof(void*));
+	int n;
+
+	/* Cancelled futures don't run, the others do */
+	pause_pool();
+	for (n=0; n<num_jobs; n++) {
+		args[n] = malloc(1);
+		futures[n] = thpool_submit(thpool, count_future, args[n]);
+	}
+	for (n=0; n<num_jobs; n+=2) {
+		if (thpool_cancel(futures[n]) != 0 || thpool_future_wait(futures[n]) != NULL) {
+			puts("Could not cancel a queued job");
+			exit(1);
+		}
+	}
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	if (ran != num_jobs / 2) {
+		printf("%d jobs ran instead of %d\n", ran, num_jobs / 2);
+		exit(1);
+	}
+	for (n=0; n<num_jobs; n++) {
+		if (n % 2 && (thpool_cancel(futures[n]) != -1 || thpool_future_wait(futures[n]) != (void*)1)) {
+			puts("Cancelled a job that ran");
+			exit(1);
+		}
+		if (n % 2 == 0) free(args[n]);
+		thpool_future_release(futures[n]);
+	}
+
+	/* Running jobs get to know */
+	started = 0;
+	thpool_future f = thpool_submit(thpool, until_cancelled, NULL);
+	while (!started) usleep(1000);
+	if (thpool_cancel(f) != -1 || thpool_future_wait(f) != (void*)1) {
+		puts("A running job didn't see its cancellation");
+		exit(1);
+	}
+	thpool_future_release(f);
+
+	/* Not in other pools */
+	threadpool other = thpool_init(1);
+	started = 0;
+	f = thpool_submit(thpool, other_cancelled, other);
+	while (!started) usleep(1000);
+	thpool_cancel(f);
+	if (thpool_future_wait(f) != NULL) {
+		puts("A job cancelled in one pool was cancelled in another");
+		exit(1);
+	}
+	thpool_future_release(f);
+	thpool_destroy(other);
+
+	/* Clear drops every kind of job */
+	ran = 0;
+	pause_pool();
+	char data[BIG] = {0};
+	int added = 0;
+	for (n=0; n<num_jobs; n++, added++) {
+		switch (n % 4) {
+		case 0: thpool_add_work(thpool, count, NULL); break;
+		case 1: thpool_add_work_copy(thpool, count_copy, data, n % 8 ? 8 : BIG); break;
+		case 2: thpool_future_release(thpool_submit(thpool, count_future, NULL)); break;
+		case 3: thpool_add_work_prio(thpool, count, NULL, THPOOL_PRIO_HIGH); break;
+		}
+	}
+	int dropped = thpool_clear(thpool, NULL);
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	if (dropped != added || ran != 0) {
+		printf("Cleared %d of %d jobs, %d ran\n", dropped, added, ran);
+		exit(1);
+	}
+
+	pause_pool();
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, count, malloc(1));
+	}
+	dropped = thpool_clear(thpool, destruct);
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	if (dropped != num_jobs || destructed != num_jobs || ran != 0) {
+		printf("Cleared %d of %d jobs, %d destructed, %d ran\n", dropped, num_jobs, destructed, ran);
+		exit(1);
+	}
+
+	/* Clear hands the arguments of cancelled jobs to the destructor */
+	destructed = 0;
+	pause_pool();
+	for (n=0; n<num_jobs; n++) {
+		futures[n] = thpool_submit(thpool, count_future, malloc(1));
+		thpool_cancel(futures[n]);
+	}
+	dropped = thpool_clear(thpool, destruct);
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	if (dropped != num_jobs || destructed != num_jobs || ran != 0) {
+		printf("Cleared %d of %d cancelled jobs, %d destructed, %d ran\n", dropped, num_jobs, destructed, ran);
+		exit(1);
+	}
+	for (n=0; n<num_jobs; n++) {
+		thpool_future_release(futures[n]);
+	}
+
+	/* Graphs survive a clear */
+	thpool_graph graph = thpool_graph_init(thpool);
+	int prev = -1;
+	for (n=0; n<10; n++) {
+		int node = thpool_graph_add_node(graph, count_copy, NULL);
+		if (prev >= 0) thpool_graph_add_edge(graph, prev, node);
+		prev = node;
+	}
+	pause_pool();
+	thpool_graph_run(graph);
+	thpool_clear(thpool, NULL);
+	thpool_resume(thpool);
+	thpool_graph_wait(graph);
+	thpool_graph_destroy(graph);
+	if (ran != 10) {
+		printf("%d of 10 graph nodes ran after a clear\n", ran);
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	/* Jobs on a thread's own deque are dropped too */
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads   = 1;
+	config.work_stealing = 1;
+	thpool = thpool_init_config(&config);
+	ran = 0;
+	started = 0;
+	thpool_add_work(thpool, add_deque_jobs, (void*)(long)num_jobs);
+	while (!started) usleep(1000);
+	dropped = thpool_clear(thpool, free);
+	proceed = 1;
+	thpool_wait(thpool);
+	if (dropped != num_jobs || ran != 0) {
+		printf("Cleared %d of %d jobs on a deque, %d ran\n", dropped, num_jobs, ran);
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	free(futures);
+	free(args);
+	return 0;
+}
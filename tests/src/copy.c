@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../thpool.h"
+
+/*
+ * Adds jobs with copied arguments of many sizes.
+ *
+ * Arguments: number of jobs, number of threads
+ *
+ * Arguments live on the stack and get overwritten right after being added.
+ * Every job checks that it got the bytes that were added and that the copy
+ * is aligned, for sizes stored in the job and sizes that go to the heap.
+ * */
+
+#define MAX_LEN 256
+
+int errors = 0;
+long sum = 0;
+
+
+void check(void* arg) {
+	unsigned char* bytes = arg;
+	size_t len = bytes[0] | (bytes[1] << 8);
+	size_t i;
+	if ((size_t)arg % sizeof(long long) != 0) {
+		__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+	}
+	for (i=2; i<len; i++) {
+		if (bytes[i] != (unsigned char)(i * len)) {
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	__atomic_add_fetch(&sum, len, __ATOMIC_RELAXED);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int num_jobs    = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	threadpool thpool = thpool_init(num_threads);
+
+	unsigned char data[MAX_LEN];
+	long expected = 0;
+	int n;
+	for (n=0; n<num_jobs; n++) {
+		size_t len = 2 + n % (MAX_LEN - 1);
+		size_t i;
+		data[0] = len & 0xff;
+		data[1] = len >> 8;
+		for (i=2; i<len; i++) {
+			data[i] = (unsigned char)(i * len);
+		}
+		thpool_add_work_copy(thpool, check, data, len);
+		memset(data, 0xee, sizeof(data));
+		expected += len;
+	}
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	if (errors) {
+		printf("%d jobs got a wrong argument\n", errors);
+		exit(1);
+	}
+	if (sum != expected) {
+		printf("Jobs got %ld bytes instead of %ld\n", sum, expected);
+		exit(1);
+	}
+	return 0;
+}
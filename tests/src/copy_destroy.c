@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../thpool.h"
+
+/*
+ * Destroys a pool with jobs whose copied arguments are still queued.
+ *
+ * Arguments: number of jobs, number of threads
+ *
+ * The pool is paused so none of the jobs runs. Their arguments are too big
+ * for the job itself and must be freed by thpool_destroy().
+ * */
+
+#define LEN 256
+
+
+void never(void* arg) {
+	puts("A job ran on a paused pool");
+	exit(1);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int num_jobs    = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	unsigned char data[LEN];
+	memset(data, 0, sizeof(data));
+
+	threadpool thpool = thpool_init(num_threads);
+	thpool_pause(thpool);
+	int n;
+	for (n=0; n<num_jobs; n++){
+		thpool_add_work_copy(thpool, never, data, sizeof(data));
+	}
+	thpool_destroy(thpool);
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../thpool.h"
+
+/*
+ * Grows and shrinks pools.
+ *
+ * Arguments: max threads, work stealing (0/1)
+ *
+ * An elastic pool of one thread gets a burst of jobs held back by a latch
+ * and must grow but stay within max threads, then shrink back once idle. A fixed pool
+ * is resized up, down, to zero and back and must run all jobs with as many
+ * threads at once as it was resized to.
+ * */
+
+int running = 0;
+int peak    = 0;
+int done    = 0;
+volatile int latch = 0;
+
+
+void slow(void* arg) {
+	int now = __atomic_add_fetch(&running, 1, __ATOMIC_SEQ_CST);
+	int seen = __atomic_load_n(&peak, __ATOMIC_SEQ_CST);
+	while (now > seen && !__atomic_compare_exchange_n(&peak, &seen, now, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	usleep(2000);
+	__atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&done, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Wait for the latch to open */
+void gated(void* arg) {
+	while (!latch) usleep(1000);
+	slow(arg);
+}
+
+
+/* Wait for n jobs to run at the same time */
+void meet(void* n) {
+	__atomic_add_fetch(&running, 1, __ATOMIC_SEQ_CST);
+	int tries = 0;
+	while (__atomic_load_n(&running, __ATOMIC_SEQ_CST) < (int)(long)n && tries++ < 5000) {
+		usleep(1000);
+	}
+	if (tries >= 5000) {
+		printf("Only %d of %ld jobs ran at once\n", running, (long)n);
+		exit(1);
+	}
+	__atomic_add_fetch(&done, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void check_done(int expected) {
+	if (done != expected) {
+		printf("Ran %d jobs instead of %d\n", done, expected);
+		exit(1);
+	}
+	done = 0;
+	running = 0;
+	peak = 0;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int max_threads   = strtol(argv[1], &p, 10);
+	int work_stealing = strtol(argv[2], &p, 10);
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads     = 1;
+	config.min_threads     = 1;
+	config.max_threads     = max_threads;
+	config.spawn_threshold = 4;
+	config.idle_timeout_ms = 50;
+	config.work_stealing   = work_stealing;
+	threadpool thpool = thpool_init_config(&config);
+
+	/* Burst, growing while every thread is held up */
+	int n;
+	for (n=0; n<200; n++){
+		thpool_add_work(thpool, gated, NULL);
+	}
+	int grown = thpool_num_threads(thpool);
+	if (grown < 2 || grown > max_threads){
+		printf("Grew to %d threads, expected 2 to %d\n", grown, max_threads);
+		exit(1);
+	}
+	latch = 1;
+	thpool_wait(thpool);
+	if (peak > max_threads){
+		printf("Peak of %d threads running, expected at most %d\n", peak, max_threads);
+		exit(1);
+	}
+	check_done(200);
+
+	/* Idle */
+	for (n=0; n<100 && thpool_num_threads(thpool) > 1; n++){
+		usleep(10000);
+	}
+	if (thpool_num_threads(thpool) != 1){
+		printf("%d threads left after idling\n", thpool_num_threads(thpool));
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	/* Explicit resizing */
+	thpool_config_defaults(&config);
+	config.num_threads   = 1;
+	config.work_stealing = work_stealing;
+	thpool = thpool_init_config(&config);
+
+	int sizes[] = {max_threads, 1, 0, max_threads / 2, max_threads};
+	for (n=0; n<5; n++){
+		int size = sizes[n];
+		thpool_resize(thpool, size);
+		if (thpool_num_threads(thpool) != size){
+			printf("%d threads after resizing to %d\n", thpool_num_threads(thpool), size);
+			exit(1);
+		}
+		int m;
+		for (m=0; m<size; m++){
+			thpool_add_work(thpool, meet, (void*)(long)size);
+		}
+		thpool_wait(thpool);
+		check_done(size);
+	}
+
+	/* Jobs queued while there are no threads */
+	thpool_resize(thpool, 0);
+	for (n=0; n<10; n++){
+		thpool_add_work(thpool, slow, NULL);
+	}
+	thpool_resize(thpool, 2);
+	thpool_wait(thpool);
+	check_done(10);
+
+	thpool_destroy(thpool);
+
+	return 0;
+}
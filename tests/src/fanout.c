@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../../thpool.h"
+
+/*
+ * Recursive fan-out with work stealing. Every job of depth > 0 adds two
+ * jobs of depth - 1 from inside the pool, the leaves count themselves.
+ *
+ * Arguments: depth, number of threads
+ *
+ * Prints the number of leaves, which should be 2^depth.
+ * */
+
+threadpool thpool;
+int leaves = 0;
+
+
+void walk(void* arg) {
+	intptr_t depth = (intptr_t)arg;
+	if (depth == 0){
+		__atomic_add_fetch(&leaves, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	thpool_add_work(thpool, walk, (void*)(depth - 1));
+	thpool_add_work(thpool, walk, (void*)(depth - 1));
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int depth       = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads    = num_threads;
+	config.work_stealing  = 1;
+	config.deque_capacity = 16;
+	thpool = thpool_init_config(&config);
+
+	thpool_add_work(thpool, walk, (void*)(intptr_t)depth);
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	printf("%d\n", leaves);
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../thpool.h"
+
+/*
+ * Waits for single jobs through futures while the pool never goes idle.
+ *
+ * Arguments: number of jobs, number of threads
+ *
+ * A job keeps adding itself so thpool_wait() would never return. Every
+ * other job is submitted with a future and waited for on its own. Prints
+ * the sum of the results, which should be the sum of 1..jobs.
+ * */
+
+volatile int feeding = 1;
+volatile int gate    = 0;
+
+
+void feed(void* thpool) {
+	usleep(100);
+	if (__atomic_load_n(&feeding, __ATOMIC_RELAXED)) {
+		thpool_add_work((threadpool)thpool, feed, thpool);
+	}
+}
+
+
+void* identity(void* arg) {
+	return arg;
+}
+
+
+void* blocked(void* arg) {
+	while (!__atomic_load_n(&gate, __ATOMIC_ACQUIRE)) {
+		usleep(1000);
+	}
+	return arg;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	long num_jobs    = strtol(argv[1], &p, 10);
+	int  num_threads = strtol(argv[2], &p, 10);
+
+	threadpool thpool = thpool_init(num_threads);
+	thpool_add_work(thpool, feed, thpool);
+
+	/* A future doesn't become ready before its job has run */
+	thpool_future f = thpool_submit(thpool, blocked, (void*)42L);
+	void* result = NULL;
+	if (thpool_future_wait_timeout(f, 10000000ULL, &result) != -1 || thpool_future_ready(f)){
+		puts("Future became ready before its job finished");
+		exit(1);
+	}
+	__atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+	if (thpool_future_wait_timeout(f, 10000000000ULL, &result) != 0 || (long)result != 42){
+		puts("Future didn't return its job's result");
+		exit(1);
+	}
+	thpool_future_release(f);
+
+	/* Submit in rounds so futures get recycled */
+	thpool_future futures[64];
+	long sum = 0;
+	long n = 1;
+	while (n <= num_jobs){
+		int i, m = 0;
+		for (; m < 64 && n <= num_jobs; m++, n++){
+			futures[m] = thpool_submit(thpool, identity, (void*)n);
+		}
+		for (i=0; i<m; i++){
+			sum += (long)thpool_future_wait(futures[i]);
+			if (!thpool_future_ready(futures[i])){
+				puts("Future not ready after waiting for it");
+				exit(1);
+			}
+			thpool_future_release(futures[i]);
+		}
+	}
+
+	/* Released before the job runs */
+	thpool_future_release(thpool_submit(thpool, identity, NULL));
+
+	__atomic_store_n(&feeding, 0, __ATOMIC_RELAXED);
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	printf("%ld\n", sum);
+
+	return 0;
+}
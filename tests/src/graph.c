@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../thpool.h"
+
+/*
+ * Runs a task graph many times.
+ *
+ * Arguments: number of runs, number of threads, number of transforms
+ *
+ * The graph is decode -> transform x N -> merge, plus a chain that runs
+ * next to it. Every job checks that the jobs it depends on have finished
+ * in the same run. Then a cycle must be refused and a graph waited for
+ * from inside a job must finish.
+ * */
+
+#define CHAIN 8
+
+thpool_graph graph;
+int run = 0;
+int decoded, merged, transformed;
+int chain[CHAIN];
+int errors = 0;
+
+
+void fail() {
+	__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+}
+
+
+void decode(void* arg) {
+	if (decoded != run - 1 || merged != run - 1) fail();
+	__atomic_store_n(&decoded, run, __ATOMIC_RELAXED);
+}
+
+
+void transform(void* arg) {
+	if (__atomic_load_n(&decoded, __ATOMIC_RELAXED) != run) fail();
+	__atomic_add_fetch(&transformed, 1, __ATOMIC_RELAXED);
+}
+
+
+void merge(void* arg) {
+	if (__atomic_load_n(&transformed, __ATOMIC_RELAXED) != run * (long)arg) fail();
+	merged = run;
+}
+
+
+void step(void* arg) {
+	long i = (long)arg;
+	if (i > 0 && chain[i - 1] != run) fail();
+	chain[i] = run;
+}
+
+
+void nop(void* arg) {
+}
+
+
+/* Runs a graph of its own and waits for it */
+void nested(void* thpool) {
+	thpool_graph inner = thpool_graph_init(thpool);
+	int a = thpool_graph_add_node(inner, nop, NULL);
+	int b = thpool_graph_add_node(inner, nop, NULL);
+	thpool_graph_add_edge(inner, a, b);
+	thpool_graph_run(inner);
+	thpool_graph_wait(inner);
+	thpool_graph_destroy(inner);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 4){
+		puts("This testfile needs exactly three arguments");
+		exit(1);
+	}
+	int num_runs       = strtol(argv[1], &p, 10);
+	int num_threads    = strtol(argv[2], &p, 10);
+	long num_transform = strtol(argv[3], &p, 10);
+
+	threadpool thpool = thpool_init(num_threads);
+	graph = thpool_graph_init(thpool);
+
+	int d = thpool_graph_add_node(graph, decode, NULL);
+	int m = thpool_graph_add_node(graph, merge, (void*)num_transform);
+	long n;
+	for (n=0; n<num_transform; n++) {
+		int t = thpool_graph_add_node(graph, transform, NULL);
+		thpool_graph_add_edge(graph, d, t);
+		thpool_graph_add_edge(graph, t, m);
+	}
+	int prev = -1;
+	for (n=0; n<CHAIN; n++) {
+		int l = thpool_graph_add_node(graph, step, (void*)n);
+		if (prev != -1) thpool_graph_add_edge(graph, prev, l);
+		prev = l;
+	}
+
+	for (run=1; run<=num_runs; run++) {
+		if (thpool_graph_run(graph) != 0) {
+			puts("Could not run graph");
+			exit(1);
+		}
+		thpool_graph_wait(graph);
+		if (merged != run || chain[CHAIN - 1] != run) {
+			printf("Run %d did not finish\n", run);
+			exit(1);
+		}
+	}
+	run--;
+	if (errors) {
+		printf("%d jobs ran before a job they depend on\n", errors);
+		exit(1);
+	}
+
+	/* A cycle can never run */
+	thpool_graph_add_edge(graph, m, d);
+	if (thpool_graph_run(graph) != -1) {
+		puts("Ran a graph with a cycle");
+		exit(1);
+	}
+	thpool_graph_destroy(graph);
+
+	for (n=0; n<4 * num_threads; n++) {
+		thpool_add_work(thpool, nested, thpool);
+	}
+	thpool_wait(thpool);
+
+	thpool_destroy(thpool);
+	return 0;
+}
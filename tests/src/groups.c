@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../thpool.h"
+
+/*
+ * Nested fork-join with task groups.
+ *
+ * Arguments: depth, number of threads, work stealing (0/1)
+ *
+ * Every job below the given depth splits in two jobs of a new group and
+ * waits for them, which would run out of threads if waiting blocked. Meanwhile
+ * a job keeps adding itself so the pool never goes idle. Prints the number
+ * of leaves, which should be 2^depth.
+ * */
+
+threadpool thpool;
+volatile int feeding = 1;
+int leaves = 0;
+
+
+void feed(void* arg) {
+	usleep(100);
+	if (__atomic_load_n(&feeding, __ATOMIC_RELAXED)) {
+		thpool_add_work(thpool, feed, NULL);
+	}
+}
+
+
+void split(void* arg) {
+	long depth = (long)arg;
+	if (depth == 0) {
+		__atomic_add_fetch(&leaves, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	thpool_group group = thpool_group_init(thpool);
+	thpool_group_add_work(group, split, (void*)(depth - 1));
+	thpool_group_add_work(group, split, (void*)(depth - 1));
+	thpool_group_wait(group);
+	thpool_group_destroy(group);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 4){
+		puts("This testfile needs exactly three arguments");
+		exit(1);
+	}
+	long depth         = strtol(argv[1], &p, 10);
+	int  num_threads   = strtol(argv[2], &p, 10);
+	int  work_stealing = strtol(argv[3], &p, 10);
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads   = num_threads;
+	config.work_stealing = work_stealing;
+	thpool = thpool_init_config(&config);
+	thpool_add_work(thpool, feed, NULL);
+
+	/* Wait on a group from outside the pool */
+	thpool_group group = thpool_group_init(thpool);
+	thpool_group_add_work(group, split, (void*)depth);
+	thpool_group_wait(group);
+	thpool_group_destroy(group);
+
+	__atomic_store_n(&feeding, 0, __ATOMIC_RELAXED);
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	printf("%d\n", leaves);
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../thpool.h"
+
+/*
+ * Times creating and destroying an idle threadpool.
+ *
+ * Arguments: number of threads, number of rounds, allowed milliseconds
+ *
+ * Prints the average time of thpool_init() + thpool_destroy() and fails
+ * if it is above the allowed milliseconds.
+ * */
+
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 4){
+		puts("This testfile needs exactly three arguments");
+		exit(1);
+	}
+	int num_threads = strtol(argv[1], &p, 10);
+	int num_rounds  = strtol(argv[2], &p, 10);
+	double allowed  = strtod(argv[3], &p);
+
+	double start = now();
+	int n;
+	for (n=0; n<num_rounds; n++){
+		threadpool thpool = thpool_init(num_threads);
+		thpool_destroy(thpool);
+	}
+	double average = (now() - start) / num_rounds;
+
+	printf("init+destroy of %d threads: %.3f ms\n", num_threads, average);
+	if (average > allowed){
+		printf("Expected at most %.3f ms\n", allowed);
+		return -1;
+	}
+	return 0;
+}
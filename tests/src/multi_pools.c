@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../../thpool.h"
+
+/*
+ * Runs several threadpools side by side while other threadpools are being
+ * created, used and destroyed from other threads.
+ *
+ * Arguments: number of jobs, number of churning threads, rounds per churner
+ *
+ * Fails if any job of any pool got lost.
+ * */
+
+int bulk_done = 0;
+int latency_done = 0;
+int num_rounds;
+int churn_failed = 0;
+
+
+void increment(void* counter) {
+	__atomic_add_fetch((int*)counter, 1, __ATOMIC_RELAXED);
+}
+
+
+void* churn(void* arg) {
+	int r, n;
+	for (r=0; r<num_rounds; r++){
+		int done = 0;
+		threadpool thpool = thpool_init(3);
+		for (n=0; n<200; n++){
+			thpool_add_work(thpool, increment, &done);
+		}
+		thpool_wait(thpool);
+		thpool_destroy(thpool);
+		if (done != 200){
+			__atomic_store_n(&churn_failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 4){
+		puts("This testfile needs exactly three arguments");
+		exit(1);
+	}
+	int num_jobs     = strtol(argv[1], &p, 10);
+	int num_churners = strtol(argv[2], &p, 10);
+	num_rounds       = strtol(argv[3], &p, 10);
+
+	threadpool bulk    = thpool_init(2);
+	threadpool latency = thpool_init(1);
+
+	pthread_t* churners = malloc(num_churners * sizeof(pthread_t));
+	int n;
+	for (n=0; n<num_churners; n++){
+		pthread_create(&churners[n], NULL, churn, NULL);
+	}
+
+	for (n=0; n<num_jobs; n++){
+		thpool_add_work(bulk, increment, &bulk_done);
+		if (n % 100 == 0)
+			thpool_add_work(latency, increment, &latency_done);
+	}
+
+	for (n=0; n<num_churners; n++){
+		pthread_join(churners[n], NULL);
+	}
+	free(churners);
+
+	thpool_wait(bulk);
+	thpool_wait(latency);
+	thpool_destroy(bulk);
+	thpool_destroy(latency);
+
+	int latency_jobs = (num_jobs + 99) / 100;
+	if (bulk_done != num_jobs || latency_done != latency_jobs || churn_failed){
+		printf("Lost jobs: bulk %d/%d, latency %d/%d, churn %s\n",
+		       bulk_done, num_jobs, latency_done, latency_jobs, churn_failed ? "failed" : "ok");
+		return -1;
+	}
+	puts("All pools done");
+	return 0;
+}
@@ -17,7 +17,5 @@ int main(int argc, char *argv[]){
 	threadpool thpool = thpool_init(num_threads);
 	thpool_destroy(thpool);
 
-	sleep(1); // Sometimes main exits before thpool_destroy finished 100%
-
 	return 0;
 }
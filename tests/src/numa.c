@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../../thpool.h"
+
+/*
+ * Checks the job queues of NUMA nodes.
+ *
+ * Arguments: none
+ *
+ * A fake topology of 2 nodes is written to a temporary directory. Jobs
+ * added to a node while it has idle threads must run on them, and so must
+ * jobs added from inside them. Once the threads of node 1 are all busy, jobs added to it
+ * must be taken by the idle threads of node 0.
+ * */
+
+char root[] = "/tmp/thpool_numa_XXXXXX";
+
+
+void write_file(const char* path, const char* value) {
+	char file[256];
+	snprintf(file, sizeof(file), "%s/%s", root, path);
+	FILE* fp = fopen(file, "w");
+	fprintf(fp, "%s\n", value);
+	fclose(fp);
+}
+
+
+void make_dir(const char* path) {
+	char dir[256];
+	snprintf(dir, sizeof(dir), "%s/%s", root, path);
+	mkdir(dir, 0755);
+}
+
+
+void fake_topology(void) {
+	if (mkdtemp(root) == NULL) {
+		puts("Could not create temporary directory");
+		exit(1);
+	}
+	make_dir("node");
+	make_dir("node/node0");
+	make_dir("node/node1");
+	write_file("node/online", "0-1");
+	write_file("node/node0/cpulist", "0");
+	write_file("node/node1/cpulist", "1");
+}
+
+
+threadpool thpool;
+int ran_on[2];
+int wrong = 0;
+volatile int gates_open = 0;
+int gates_running = 0;
+
+
+void count(void* node) {
+	if (thpool_current_node(thpool) != (int)(long)node) {
+		__atomic_add_fetch(&wrong, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+void spawn(void* node) {
+	count(node);
+	thpool_add_work(thpool, count, node);
+}
+
+
+void gate(void* arg) {
+	if (thpool_current_node(thpool) != 1) {
+		__atomic_add_fetch(&wrong, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&gates_running, 1, __ATOMIC_SEQ_CST);
+	while (!gates_open) {
+		usleep(100);
+	}
+}
+
+
+void record(void* arg) {
+	__atomic_add_fetch(&ran_on[thpool_current_node(thpool)], 1, __ATOMIC_SEQ_CST);
+}
+
+
+int main(){
+
+	fake_topology();
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = 4;
+	config.numa        = 1;
+	config.sysfs_root  = root;
+	thpool = thpool_init_config(&config);
+
+	char cmd[300];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+	if (system(cmd) != 0) {
+		puts("Could not remove temporary directory");
+	}
+
+	if (thpool_num_nodes(thpool) != 2) {
+		printf("Found %d nodes instead of 2\n", thpool_num_nodes(thpool));
+		exit(1);
+	}
+	if (thpool_add_work_node(thpool, count, NULL, 2) != -1) {
+		puts("Added work to a node that does not exist");
+		exit(1);
+	}
+
+	/* Locality, one job at a time so that no node is ever busy */
+	int n;
+	for (n=0; n<200; n++) {
+		thpool_add_work_node(thpool, spawn, (void*)(long)(n % 2), n % 2);
+		thpool_wait(thpool);
+		usleep(100);
+	}
+	if (wrong) {
+		printf("%d jobs ran on the wrong node\n", wrong);
+		exit(1);
+	}
+
+	/* Stealing once node 1 is busy */
+	thpool_add_work_node(thpool, gate, NULL, 1);
+	while (__atomic_load_n(&gates_running, __ATOMIC_SEQ_CST) < 1) usleep(100);
+	thpool_add_work_node(thpool, gate, NULL, 1);
+	while (__atomic_load_n(&gates_running, __ATOMIC_SEQ_CST) < 2) usleep(100);
+	for (n=0; n<10; n++) {
+		thpool_add_work_node(thpool, record, NULL, 1);
+	}
+	for (n=0; n<10000 && __atomic_load_n(&ran_on[0], __ATOMIC_SEQ_CST) < 10; n++) {
+		usleep(1000);
+	}
+	gates_open = 1;
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	if (wrong) {
+		puts("Gate job ran on the wrong node");
+		exit(1);
+	}
+	if (ran_on[0] != 10) {
+		printf("Idle node ran %d of 10 jobs of a busy node\n", ran_on[0]);
+		exit(1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../thpool.h"
+
+/*
+ * Compares parallel loops with adding a job per element.
+ *
+ * Arguments: number of elements, number of threads
+ *
+ * Every schedule must touch each element exactly once, also for empty and
+ * tiny ranges and when called from inside a job, and a sum reduction must
+ * come out right. Prints the throughput of each schedule next to one
+ * thpool_add_work() per element.
+ * */
+
+threadpool thpool;
+int* hits;
+long num_elems;
+long num_nested;
+int failed = 0;
+
+
+void touch(long begin, long end, void* ctx) {
+	long i;
+	for (i=begin; i<end; i++) {
+		__atomic_add_fetch(&hits[i], 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+void touch_one(void* arg) {
+	__atomic_add_fetch(&hits[(long)arg], 1, __ATOMIC_RELAXED);
+}
+
+
+void sum(long begin, long end, void* ctx, void* partial) {
+	long i;
+	for (i=begin; i<end; i++) {
+		*(long*)partial += i;
+	}
+}
+
+
+void add(void* result, const void* partial, void* ctx) {
+	*(long*)result += *(const long*)partial;
+}
+
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void check(const char* name, long n, int expected) {
+	long i;
+	for (i=0; i<n; i++) {
+		if (hits[i] != expected) {
+			printf("%s: element %ld ran %d times instead of %d\n", name, i, hits[i], expected);
+			exit(1);
+		}
+	}
+}
+
+
+/* A parallel loop from inside a job */
+void nested(void* arg) {
+	if (thpool_parallel_for(thpool, 0, num_nested, 7, (int)(long)arg, touch, NULL) != 0) {
+		__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	num_elems       = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	thpool = thpool_init(num_threads);
+	hits = calloc(num_elems, sizeof(int));
+	num_nested = num_elems < 1000 ? num_elems : 1000;
+
+	const char* names[] = {"static", "dynamic", "guided"};
+	long grains[] = {0, 1, 1000};
+	int expected = 0;
+	int schedule, g;
+
+	/* Every schedule covers the range exactly once */
+	for (schedule=0; schedule<3; schedule++) {
+		for (g=0; g<3; g++) {
+			thpool_parallel_for(thpool, 0, num_elems, grains[g], schedule, touch, NULL);
+			expected++;
+			check(names[schedule], num_elems, expected);
+		}
+		thpool_parallel_for(thpool, 5, 5, 0, schedule, touch, NULL);
+		thpool_parallel_for(thpool, 0, 1, 0, schedule, touch, NULL);
+		if (hits[0] != expected + 1) {
+			printf("%s: a one element range ran %d times\n", names[schedule], hits[0] - expected);
+			exit(1);
+		}
+		hits[0]--;
+
+		long total = 0, expected_total = num_elems * (num_elems - 1) / 2;
+		thpool_parallel_reduce(thpool, 0, num_elems, 0, schedule, sum, add, NULL, &total, sizeof(total));
+		if (total != expected_total) {
+			printf("%s: sum is %ld instead of %ld\n", names[schedule], total, expected_total);
+			exit(1);
+		}
+	}
+
+	/* Nested in jobs, on more loops than threads */
+	int n;
+	for (n=0; n<3 * num_threads; n++) {
+		thpool_add_work(thpool, nested, (void*)(long)(n % 3));
+	}
+	thpool_wait(thpool);
+	check("nested", num_nested, expected + 3 * num_threads);
+	for (n=0; n<num_nested; n++) {
+		hits[n] -= 3 * num_threads;
+	}
+	if (failed) {
+		puts("A nested loop failed");
+		exit(1);
+	}
+
+	/* Throughput */
+	double start = now();
+	long i;
+	for (i=0; i<num_elems; i++) {
+		thpool_add_work(thpool, touch_one, (void*)i);
+	}
+	thpool_wait(thpool);
+	printf("per element: %.0f elements/s\n", num_elems / (now() - start));
+	expected++;
+
+	for (schedule=0; schedule<3; schedule++) {
+		start = now();
+		thpool_parallel_for(thpool, 0, num_elems, 0, schedule, touch, NULL);
+		printf("%-12s %.0f elements/s\n", names[schedule], num_elems / (now() - start));
+		expected++;
+	}
+	check("throughput", num_elems, expected);
+
+	thpool_destroy(thpool);
+	free(hits);
+	return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "../../thpool.h"
+
+/*
+ * Checks that pausing only holds back the paused threadpool, that resuming
+ * is fast and that draining runs the queued jobs before pausing.
+ *
+ * Arguments: number of threads per pool
+ *
+ * Prints the resume latency in microseconds.
+ * */
+
+volatile double started = 0;
+int done = 0;
+
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+void record(void* arg) {
+	started = now();
+}
+
+
+void count(void* arg) {
+	usleep(1000);
+	__atomic_add_fetch(&done, 1, __ATOMIC_SEQ_CST);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 2){
+		puts("This testfile needs exactly one arguments");
+		exit(1);
+	}
+	int num_threads = strtol(argv[1], &p, 10);
+
+	threadpool paused  = thpool_init(num_threads);
+	threadpool running = thpool_init(num_threads);
+
+	/* Other pool keeps running */
+	thpool_pause(paused);
+	thpool_add_work(paused, record, NULL);
+	thpool_add_work(running, count, NULL);
+	thpool_wait(running);
+	usleep(100000);
+	if (done != 1 || started != 0){
+		printf("Expected only the running pool to work (done=%d, started=%.0f)\n", done, started);
+		return -1;
+	}
+
+	/* Resume is fast */
+	double resumed = now();
+	thpool_resume(paused);
+	thpool_wait(paused);
+	double latency = started - resumed;
+	printf("resume latency: %.1f us\n", latency);
+	if (latency > 50000){
+		puts("Resuming took too long");
+		return -1;
+	}
+
+	/* Draining runs queued jobs */
+	done = 0;
+	int n;
+	for (n=0; n<20; n++){
+		thpool_add_work(paused, count, NULL);
+	}
+	thpool_pause_drain(paused);
+	thpool_wait(paused);
+	if (done != 20){
+		printf("Expected 20 drained jobs, got %d\n", done);
+		return -1;
+	}
+	thpool_add_work(paused, count, NULL);
+	usleep(100000);
+	if (done != 20){
+		puts("Job ran after the pool was drained and paused");
+		return -1;
+	}
+	thpool_resume(paused);
+	thpool_wait(paused);
+	if (done != 21){
+		printf("Expected 21 jobs after resuming, got %d\n", done);
+		return -1;
+	}
+
+	thpool_destroy(paused);
+	thpool_destroy(running);
+	return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../thpool.h"
+
+/*
+ * Checks the order jobs of different priorities run in.
+ *
+ * Arguments: jobs per priority, aging (0 for strict priorities)
+ *
+ * Jobs of all priorities are added in turns to a paused pool of one
+ * thread, which then runs them. With strict priorities every job must run
+ * after all jobs of higher priority. With aging the first low priority job
+ * must run within the first aging jobs.
+ * */
+
+int order[4096];
+int ran = 0;
+
+
+void record(void* prio) {
+	order[ran++] = (int)(long)prio;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int num_jobs = strtol(argv[1], &p, 10);
+	int aging    = strtol(argv[2], &p, 10);
+
+	if (num_jobs * THPOOL_PRIORITIES > 4096){
+		puts("Too many jobs");
+		exit(1);
+	}
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = 1;
+	config.prio_aging  = aging;
+	threadpool thpool = thpool_init_config(&config);
+
+	thpool_pause(thpool);
+	int n, prio;
+	for (n=0; n<num_jobs; n++){
+		for (prio=0; prio<THPOOL_PRIORITIES; prio++){
+			if (prio == THPOOL_PRIO_NORMAL && n % 2){
+				thpool_add_work(thpool, record, (void*)(long)prio);
+			}
+			else {
+				thpool_add_work_prio(thpool, record, (void*)(long)prio, prio);
+			}
+		}
+	}
+	if (thpool_add_work_prio(thpool, record, NULL, THPOOL_PRIORITIES) != -1){
+		puts("Invalid priority was accepted");
+		exit(1);
+	}
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	if (ran != num_jobs * THPOOL_PRIORITIES){
+		printf("Ran %d jobs instead of %d\n", ran, num_jobs * THPOOL_PRIORITIES);
+		exit(1);
+	}
+
+	if (aging == 0){
+		for (n=1; n<ran; n++){
+			if (order[n] > order[n-1]){
+				printf("Job of priority %d ran after one of priority %d\n", order[n], order[n-1]);
+				exit(1);
+			}
+		}
+	}
+	else {
+		for (n=0; n<ran && order[n] != THPOOL_PRIO_LOW; n++);
+		if (n >= aging){
+			printf("First low priority job ran after %d others\n", n);
+			exit(1);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "../../thpool.h"
+
+/*
+ * Same as conc_increment but with the lock-free ring as job queue and
+ * several producer threads adding work at the same time.
+ *
+ * Arguments: number of jobs, number of threads, ring capacity, producers
+ *
+ * A small ring capacity makes jobs spill over to the linked list. Jobs
+ * added while some wait in the list must run after them, which a single
+ * thread checks first.
+ * */
+
+#define FIFO_RING 4
+#define FIFO_JOBS (2 * FIFO_RING)
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+int sum=0;
+int jobs_per_producer;
+threadpool thpool;
+int order[FIFO_JOBS + 1];
+int ran=0;
+
+
+void increment() {
+	pthread_mutex_lock(&mutex);
+	sum ++;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void record(void* arg) {
+	int n = (int)(long)arg;
+	order[ran++] = n;
+	/* The ring has room again, but the spilled jobs are older */
+	if (n == 0){
+		thpool_add_work(thpool, record, (void*)(long)FIFO_JOBS);
+	}
+}
+
+
+void* produce(void* arg) {
+	int n;
+	for (n=0; n<jobs_per_producer; n++){
+		thpool_add_work(thpool, (void*)increment, NULL);
+	}
+	return NULL;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 5){
+		puts("This testfile needs exactly four arguments");
+		exit(1);
+	}
+	int num_jobs      = strtol(argv[1], &p, 10);
+	int num_threads   = strtol(argv[2], &p, 10);
+	int ring_capacity = strtol(argv[3], &p, 10);
+	int num_producers = strtol(argv[4], &p, 10);
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads   = 1;
+	config.queue_type    = THPOOL_QUEUE_RING;
+	config.ring_capacity = FIFO_RING;
+	thpool = thpool_init_config(&config);
+	thpool_pause(thpool);
+	int n;
+	for (n=0; n<FIFO_JOBS; n++){
+		thpool_add_work(thpool, record, (void*)(long)n);
+	}
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+	for (n=0; n<=FIFO_JOBS; n++){
+		if (order[n] != n){
+			printf("Job %d ran as number %d\n", order[n], n);
+			exit(1);
+		}
+	}
+
+	config.num_threads   = num_threads;
+	config.queue_type    = THPOOL_QUEUE_RING;
+	config.ring_capacity = ring_capacity;
+	thpool = thpool_init_config(&config);
+
+	jobs_per_producer = num_jobs / num_producers;
+	pthread_t* producers = malloc(num_producers * sizeof(pthread_t));
+	for (n=0; n<num_producers; n++){
+		pthread_create(&producers[n], NULL, produce, NULL);
+	}
+	for (n=0; n<num_producers; n++){
+		pthread_join(producers[n], NULL);
+	}
+	free(producers);
+
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	printf("%d\n", sum);
+
+	return 0;
+}
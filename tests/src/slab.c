@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../thpool.h"
+
+/*
+ * Checks that job nodes get recycled instead of allocated for every job.
+ *
+ * Arguments: number of rounds, jobs per round, number of threads
+ *
+ * Every round adds the jobs and waits for them. Prints the number of job
+ * nodes the pool needed, which should stay close to the jobs per round.
+ * */
+
+int sum = 0;
+
+
+void increment(void* arg) {
+	__atomic_add_fetch(&sum, 1, __ATOMIC_RELAXED);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 4){
+		puts("This testfile needs exactly three arguments");
+		exit(1);
+	}
+	int num_rounds  = strtol(argv[1], &p, 10);
+	int num_jobs    = strtol(argv[2], &p, 10);
+	int num_threads = strtol(argv[3], &p, 10);
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads  = num_threads;
+	config.job_prealloc = num_jobs;
+	threadpool thpool = thpool_init_config(&config);
+
+	int n, m;
+	for (n=0; n<num_rounds; n++){
+		for (m=0; m<num_jobs; m++){
+			thpool_add_work(thpool, increment, NULL);
+		}
+		thpool_wait(thpool);
+	}
+
+	if (sum != num_rounds * num_jobs){
+		printf("Expected %d jobs to run, got %d\n", num_rounds * num_jobs, sum);
+		return -1;
+	}
+
+	printf("%zu\n", thpool_slab_high_water(thpool));
+	thpool_destroy(thpool);
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../thpool.h"
+
+/*
+ * Checks the statistics of a pool.
+ *
+ * Arguments: number of jobs, number of threads
+ *
+ * Jobs are added to a paused pool so they all queue up, then run. Once the
+ * pool is idle, every job must be counted as added and completed, once in
+ * each histogram and on one thread, and the queue must have peaked at all
+ * of them. Jobs that a waiting thread runs itself must be counted as
+ * completed too. A thread retiring on a shrink while jobs are queued must
+ * not leave a token behind that wakes another one for nothing, and jobs
+ * fanning out through the deques must wake few threads for nothing. Unless
+ * statistics are compiled in (THPOOL_ENABLE_STATS) thpool_get_stats() must
+ * say so.
+ * */
+
+threadpool thpool;
+int num_jobs;
+volatile int napped = 0;
+volatile int latch = 0;
+
+
+void nap(void* arg) {
+	usleep(10);
+	__atomic_add_fetch(&napped, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Keep a thread busy until all naps are done, which the waiter then does */
+void block(void* arg) {
+	int waited = 0;
+	while (__atomic_load_n(&napped, __ATOMIC_SEQ_CST) < num_jobs && waited++ < 5000) {
+		usleep(1000);
+	}
+}
+
+
+void walk(void* arg) {
+	intptr_t depth = (intptr_t)arg;
+	if (depth > 0){
+		thpool_add_work(thpool, walk, (void*)(depth - 1));
+		thpool_add_work(thpool, walk, (void*)(depth - 1));
+	}
+}
+
+
+void gated(void* arg) {
+	while (!__atomic_load_n(&latch, __ATOMIC_SEQ_CST)) {
+		usleep(1000);
+	}
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	num_jobs        = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	thpool = thpool_init(num_threads);
+	thpool_thread_stats threads[64];
+	thpool_stats stats;
+	stats.threads     = threads;
+	stats.max_threads = 64;
+
+	thpool_pause(thpool);
+	int n;
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, nap, NULL);
+	}
+	if (thpool_get_stats(thpool, &stats) == -1) {
+#ifndef THPOOL_ENABLE_STATS
+		thpool_resume(thpool);
+		thpool_destroy(thpool);
+		return 0;
+#else
+		puts("No statistics");
+		exit(1);
+#endif
+	}
+	if (stats.queue_len != num_jobs) {
+		printf("Queue holds %d jobs instead of %d\n", stats.queue_len, num_jobs);
+		exit(1);
+	}
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	thpool_get_stats(thpool, &stats);
+	thpool_destroy(thpool);
+
+	unsigned long long waits = 0, runs = 0, jobs = 0, busy = 0;
+	for (n=0; n<THPOOL_STATS_BUCKETS; n++) {
+		waits += stats.wait_hist[n];
+		runs  += stats.run_hist[n];
+	}
+	for (n=0; n<stats.num_threads; n++) {
+		jobs += stats.threads[n].jobs;
+		busy += stats.threads[n].busy_ns;
+	}
+
+	if (stats.submitted != num_jobs || stats.completed != num_jobs) {
+		printf("Counted %llu added and %llu completed of %d jobs\n", stats.submitted, stats.completed, num_jobs);
+		exit(1);
+	}
+	if (waits != num_jobs || runs != num_jobs || jobs != num_jobs) {
+		printf("Histograms hold %llu and %llu, threads %llu of %d jobs\n", waits, runs, jobs, num_jobs);
+		exit(1);
+	}
+	if (stats.queue_peak != num_jobs || stats.queue_len != 0) {
+		printf("Queue peaked at %d and holds %d\n", stats.queue_peak, stats.queue_len);
+		exit(1);
+	}
+	if (stats.num_threads != num_threads || busy < 10000ULL * num_jobs / num_threads) {
+		printf("%d threads were busy for %llu ns\n", stats.num_threads, busy);
+		exit(1);
+	}
+
+	/* Jobs run by the waiting thread */
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = num_threads;
+	config.wait_helps  = 1;
+	thpool = thpool_init_config(&config);
+	napped = 0;
+	for (n=0; n<num_threads; n++) {
+		thpool_add_work(thpool, block, NULL);
+	}
+	while (thpool_num_threads_working(thpool) < num_threads) usleep(1000);
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, nap, NULL);
+	}
+	thpool_wait(thpool);
+	thpool_get_stats(thpool, &stats);
+	thpool_destroy(thpool);
+
+	waits = 0;
+	for (n=0; n<THPOOL_STATS_BUCKETS; n++) {
+		waits += stats.wait_hist[n];
+	}
+	if (stats.completed != stats.submitted || waits != stats.submitted) {
+		printf("Counted %llu added, %llu completed and %llu waits with a helping waiter\n",
+		       stats.submitted, stats.completed, waits);
+		exit(1);
+	}
+
+	/* Shrinking a busy pool posts just the tokens the retiring threads take */
+	thpool = thpool_init(2);
+	for (n=0; n<2; n++) {
+		thpool_add_work(thpool, gated, NULL);
+	}
+	while (thpool_num_threads_working(thpool) < 2) usleep(1000);
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, nap, NULL);
+	}
+	thpool_resize(thpool, 1);
+	__atomic_store_n(&latch, 1, __ATOMIC_SEQ_CST);
+	thpool_wait(thpool);
+	usleep(100000);
+	thpool_get_stats(thpool, &stats);
+	thpool_destroy(thpool);
+	if (stats.empty_wakeups != 0) {
+		printf("%llu empty wakeups after shrinking a busy pool\n", stats.empty_wakeups);
+		exit(1);
+	}
+
+	/* Jobs pushed on a deque that holds jobs already wake no one */
+	config.wait_helps     = 0;
+	config.work_stealing  = 1;
+	config.deque_capacity = 16;
+	thpool = thpool_init_config(&config);
+	thpool_add_work(thpool, walk, (void*)(intptr_t)12);
+	thpool_wait(thpool);
+	thpool_get_stats(thpool, &stats);
+	thpool_destroy(thpool);
+	if (stats.empty_wakeups > stats.completed / 8) {
+		printf("%llu empty wakeups for %llu jobs fanning out\n", stats.empty_wakeups, stats.completed);
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "../../thpool.h"
+
+/*
+ * Checks delayed and periodic jobs.
+ *
+ * Arguments: number of timers, number of threads
+ *
+ * Timers with random delays up to 2s (so that they go through every level
+ * of the timing wheel that is reached that soon) must each run once and
+ * never early. Half of another batch is cancelled and must not run. A
+ * periodic job must run about as often as its period says and stop once
+ * cancelled. A timer too far off to count in ticks must not fire. The job of a timer fired by the only thread of a work
+ * stealing pool must still run.
+ * */
+
+#define MAX_DELAY  2000000000ULL
+#define LATE       200000000ULL  /* generous, threads share one CPU in CI */
+#define PERIOD     10000000ULL
+
+
+typedef struct delayed {
+	unsigned long long added;
+	unsigned long long delay;
+	volatile unsigned long long ran;
+	volatile int runs;
+} delayed;
+
+volatile int periodic_runs = 0;
+
+
+unsigned long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void run(void* arg) {
+	delayed* d = arg;
+	d->ran = now_ns();
+	__atomic_add_fetch(&d->runs, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void tick(void* arg) {
+	__atomic_add_fetch(&periodic_runs, 1, __ATOMIC_SEQ_CST);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int num_timers  = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	threadpool thpool = thpool_init(num_threads);
+	delayed* timers = calloc(num_timers, sizeof(delayed));
+	thpool_timer* ids = calloc(num_timers, sizeof(thpool_timer));
+	int n;
+
+	/* Every timer runs once, not early and not much late */
+	srand(42);
+	for (n=0; n<num_timers; n++) {
+		timers[n].delay = (unsigned long long)rand() % MAX_DELAY;
+		if (n % 100 == 0) timers[n].delay = 0;
+		timers[n].added = now_ns();
+		ids[n] = thpool_add_work_after(thpool, timers[n].delay, run, &timers[n]);
+		if (ids[n] == 0) {
+			puts("Could not add a timer");
+			exit(1);
+		}
+	}
+	usleep((MAX_DELAY + LATE) / 1000);
+	thpool_wait(thpool);
+	for (n=0; n<num_timers; n++) {
+		if (timers[n].runs != 1) {
+			printf("Timer of %llums ran %d times\n", timers[n].delay / 1000000, timers[n].runs);
+			exit(1);
+		}
+		if (timers[n].ran < timers[n].added + timers[n].delay) {
+			printf("Timer of %lluns ran %lluns early\n", timers[n].delay,
+			       timers[n].added + timers[n].delay - timers[n].ran);
+			exit(1);
+		}
+		if (timers[n].ran > timers[n].added + timers[n].delay + LATE) {
+			printf("Timer of %llums ran %llums late\n", timers[n].delay / 1000000,
+			       (timers[n].ran - timers[n].added - timers[n].delay) / 1000000);
+			exit(1);
+		}
+		if (thpool_timer_cancel(thpool, ids[n]) != -1) {
+			puts("Cancelled a timer that fired");
+			exit(1);
+		}
+	}
+
+	/* Cancelled timers don't run */
+	for (n=0; n<num_timers; n++) {
+		timers[n].runs = 0;
+		timers[n].delay = 50000000ULL + (unsigned long long)rand() % 50000000ULL;
+		ids[n] = thpool_add_work_after(thpool, timers[n].delay, run, &timers[n]);
+	}
+	for (n=0; n<num_timers; n+=2) {
+		if (thpool_timer_cancel(thpool, ids[n]) != 0) {
+			puts("Could not cancel a pending timer");
+			exit(1);
+		}
+		if (thpool_timer_cancel(thpool, ids[n]) != -1) {
+			puts("Cancelled a timer twice");
+			exit(1);
+		}
+	}
+	usleep(200000);
+	thpool_wait(thpool);
+	for (n=0; n<num_timers; n++) {
+		if (timers[n].runs != n % 2) {
+			printf("Timer %d ran %d times\n", n, timers[n].runs);
+			exit(1);
+		}
+	}
+
+	/* Delays near the limit don't wrap around and fire right away */
+	timers[0].runs = 0;
+	ids[0] = thpool_add_work_after(thpool, ~0ULL - 1000, run, &timers[0]);
+	usleep(PERIOD * 5 / 1000);
+	if (timers[0].runs != 0) {
+		puts("A timer of the longest delay fired");
+		exit(1);
+	}
+	if (thpool_timer_cancel(thpool, ids[0]) != 0) {
+		puts("Could not cancel a far timer");
+		exit(1);
+	}
+
+	/* Periodic jobs keep coming until cancelled */
+	thpool_timer every = thpool_add_work_every(thpool, PERIOD, tick, NULL);
+	usleep(PERIOD * 20 / 1000);
+	if (thpool_timer_cancel(thpool, every) != 0) {
+		puts("Could not cancel a periodic timer");
+		exit(1);
+	}
+	thpool_wait(thpool);
+	int runs = periodic_runs;
+	if (runs < 10 || runs > 20) {
+		printf("Periodic timer ran %d times in 20 periods\n", runs);
+		exit(1);
+	}
+	usleep(PERIOD * 5 / 1000);
+	if (periodic_runs != runs) {
+		puts("Periodic timer ran after being cancelled");
+		exit(1);
+	}
+
+	thpool_destroy(thpool);
+
+	/* Jobs of timers don't get stuck on the deque of the thread firing them */
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads   = 1;
+	config.work_stealing = 1;
+	thpool = thpool_init_config(&config);
+	timers[0].runs = 0;
+	thpool_add_work_after(thpool, 1000000ULL, run, &timers[0]);
+	usleep(LATE / 1000);
+	if (timers[0].runs != 1) {
+		puts("A timer fired by a work stealing thread didn't run");
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	free(timers);
+	free(ids);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../thpool.h"
+
+/*
+ * Records traces of a pool.
+ *
+ * Arguments: number of jobs, number of threads
+ *
+ * Jobs run while tracing must all show up in the dump written by
+ * thpool_destroy(), jobs run while it was stopped must not. Then a pool
+ * with small rings must keep only the newest events of every thread.
+ * */
+
+char path[] = "/tmp/thpool_trace_XXXXXX";
+
+
+void nop(void* arg) {
+}
+
+
+/* Count the job events in a trace */
+int count_jobs(void) {
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		puts("No trace written");
+		exit(1);
+	}
+	char line[512];
+	int jobs = 0;
+	if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, "{", 1) != 0) {
+		puts("Trace is not JSON");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strstr(line, "\"name\":\"job\"") != NULL) {
+			jobs++;
+		}
+	}
+	fclose(fp);
+	return jobs;
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int num_jobs    = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		puts("Could not create temporary file");
+		exit(1);
+	}
+	close(fd);
+
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = num_threads;
+	config.trace       = 1;
+	config.trace_path  = path;
+	threadpool thpool = thpool_init_config(&config);
+
+	int n;
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, nop, NULL);
+	}
+	thpool_wait(thpool);
+	thpool_trace_stop(thpool);
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, nop, NULL);
+	}
+	thpool_wait(thpool);
+	thpool_destroy(thpool);
+
+	int jobs = count_jobs();
+	if (jobs != num_jobs) {
+		printf("Trace holds %d of %d jobs\n", jobs, num_jobs);
+		exit(1);
+	}
+
+	/* Small rings */
+	config.trace        = 0;
+	config.trace_events = 16;
+	thpool = thpool_init_config(&config);
+	thpool_trace_start(thpool);
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, nop, NULL);
+	}
+	thpool_wait(thpool);
+	thpool_trace_stop(thpool);
+	if (thpool_trace_dump(thpool, path) != 0) {
+		puts("Could not dump trace");
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	jobs = count_jobs();
+	if (jobs == 0 || jobs > 16 * num_threads) {
+		printf("Trace holds %d jobs with room for %d\n", jobs, 16 * num_threads);
+		exit(1);
+	}
+
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "../../thpool.h"
+
+/*
+ * Checks waiting with a timeout and waiters that run jobs themselves.
+ *
+ * Arguments: number of jobs, number of threads
+ *
+ * A timeout shorter than the jobs must pass, a longer one must see the
+ * pool drained. Then every thread is kept busy by a job that only returns
+ * once all other jobs ran, which can only happen if the waiting main
+ * thread runs them.
+ * */
+
+#define SLOW_MS 200
+
+volatile int ran = 0;
+volatile int ran_by_main = 0;
+volatile int blockers_done = 0;
+int num_jobs;
+pthread_t main_thread;
+
+
+unsigned long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+
+void slow(void* arg) {
+	usleep(SLOW_MS * 1000);
+}
+
+
+void count(void* arg) {
+	__atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST);
+	if (pthread_equal(pthread_self(), main_thread)) {
+		__atomic_add_fetch(&ran_by_main, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+void block(void* arg) {
+	int waited = 0;
+	while (__atomic_load_n(&ran, __ATOMIC_SEQ_CST) < num_jobs && waited++ < 5000) {
+		usleep(1000);
+	}
+	__atomic_add_fetch(&blockers_done, 1, __ATOMIC_SEQ_CST);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	num_jobs        = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+	int n;
+
+	/* Timeouts pass while jobs run, not once they are done */
+	threadpool thpool = thpool_init(num_threads);
+	if (thpool_wait_timeout(thpool, 0) != 0) {
+		puts("Timed out on an idle pool");
+		exit(1);
+	}
+	thpool_add_work(thpool, slow, NULL);
+	unsigned long long start = now_ms();
+	if (thpool_wait_timeout(thpool, SLOW_MS / 4 * 1000000ULL) != -1) {
+		puts("Didn't time out while a job was running");
+		exit(1);
+	}
+	if (now_ms() - start > SLOW_MS) {
+		printf("Timeout of %dms took %llums\n", SLOW_MS / 4, now_ms() - start);
+		exit(1);
+	}
+	if (thpool_wait_timeout(thpool, 10 * SLOW_MS * 1000000ULL) != 0) {
+		puts("Timed out although the job was done");
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	/* The waiting thread runs what the busy threads can't */
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = num_threads;
+	config.wait_helps  = 1;
+	thpool = thpool_init_config(&config);
+	main_thread = pthread_self();
+	for (n=0; n<num_threads; n++) {
+		thpool_add_work(thpool, block, NULL);
+	}
+	while (thpool_num_threads_working(thpool) < num_threads) usleep(1000);
+	for (n=0; n<num_jobs; n++) {
+		thpool_add_work(thpool, count, NULL);
+	}
+	thpool_wait(thpool);
+	if (ran != num_jobs || blockers_done != num_threads) {
+		printf("Returned with %d of %d jobs done\n", ran, num_jobs);
+		exit(1);
+	}
+	if (ran_by_main != num_jobs) {
+		printf("The waiting thread ran %d of %d jobs\n", ran_by_main, num_jobs);
+		exit(1);
+	}
+	thpool_destroy(thpool);
+
+	return 0;
+}
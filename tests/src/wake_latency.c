@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "../../thpool.h"
+
+/*
+ * Measures how long it takes from adding a burst of jobs to an idle pool
+ * until each job starts running (wake-to-run latency).
+ *
+ * Arguments: number of rounds, number of threads
+ *
+ * Every round adds one job per thread in a single batch. Prints the median
+ * and 99th percentile over all jobs and the median time until the last job
+ * of a burst started, in microseconds.
+ * */
+
+double* started;
+
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+void record(void* arg) {
+	*(double*)arg = now();
+}
+
+
+int compare(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+
+int main(int argc, char *argv[]){
+
+	char* p;
+	if (argc != 3){
+		puts("This testfile needs exactly two arguments");
+		exit(1);
+	}
+	int num_rounds  = strtol(argv[1], &p, 10);
+	int num_threads = strtol(argv[2], &p, 10);
+
+	threadpool thpool = thpool_init(num_threads);
+
+	double* latencies = malloc(num_rounds * num_threads * sizeof(double));
+	double* lasts     = malloc(num_rounds * sizeof(double));
+	started           = malloc(num_threads * sizeof(double));
+	void** args       = malloc(num_threads * sizeof(void*));
+
+	int r, n;
+	for (n=0; n<num_threads; n++){
+		args[n] = &started[n];
+	}
+
+	for (r=0; r<num_rounds; r++){
+		usleep(2000); /* let every thread go idle */
+		double submitted = now();
+		thpool_add_work_batch(thpool, record, args, num_threads);
+		thpool_wait(thpool);
+
+		lasts[r] = 0;
+		for (n=0; n<num_threads; n++){
+			latencies[r * num_threads + n] = started[n] - submitted;
+			if (started[n] - submitted > lasts[r])
+				lasts[r] = started[n] - submitted;
+		}
+	}
+
+	int total = num_rounds * num_threads;
+	qsort(latencies, total, sizeof(double), compare);
+	qsort(lasts, num_rounds, sizeof(double), compare);
+	printf("wake-to-run p50: %.1f us\n", latencies[total / 2]);
+	printf("wake-to-run p99: %.1f us\n", latencies[total * 99 / 100]);
+	printf("whole burst p50: %.1f us\n", lasts[num_rounds / 2]);
+
+	thpool_destroy(thpool);
+	free(latencies);
+	free(lasts);
+	free(started);
+	free(args);
+
+	return 0;
+}
@@ -8,16 +8,145 @@
 . funcs.sh
 
 
+function run_test { #source #args ..
+	compile "src/$1.c"
+	shift
+	output=$(timeout 60 ./test "$@" 2>/dev/null)
+	if [[ $? != 0 ]]; then
+		err "$output" "$output"
+	fi
+}
+
+
+function expect_last { #expected
+	num=$(echo $output | awk '{print $(NF)}')
+	if [ "$num" != "$1" ]; then
+		err "Expected $1 but got $output" "$output"
+	fi
+}
+
+
 function test_mass_addition { #endsum #threads
 	echo "Adding up to $1 with $2 threads"
-	compile src/conc_increment.c
-	output=$(./test $1 $2)
+	run_test conc_increment $1 $2
+	expect_last $1
+}
+
+
+function test_ring_addition { #endsum #threads #capacity #producers
+	echo "Adding up to $1 with $2 threads, ring of $3 slots and $4 producers"
+	run_test ring $1 $2 $3 $4
+	expect_last $1
+}
+
+
+function test_fanout { #depth #threads
+	echo "Fanning out to depth $1 with $2 work stealing threads"
+	run_test fanout $1 $2
+	expect_last $((1 << $1))
+}
+
+
+function test_job_recycling { #rounds #jobs #threads #maxnodes
+	echo "Recycling job nodes over $1 rounds of $2 jobs with $3 threads"
+	run_test slab $1 $2 $3
 	num=$(echo $output | awk '{print $(NF)}')
-	if [ "$num" == "$1" ]; then
-		return
+	if (( "$num" > "$4" )); then
+		err "Needed $num job nodes, expected at most $4" "$output"
 	fi
-	err "Expected $1 but got $output" "$output"
-	exit 1
+}
+
+
+function test_multiple_pools { #jobs #churners #rounds
+	echo "Running pools side by side with $2 threads creating and destroying $3 pools each"
+	run_test multi_pools $1 $2 $3
+}
+
+
+function test_futures { #jobs #threads
+	echo "Waiting on $1 futures with $2 threads while the pool stays busy"
+	run_test futures $1 $2
+	expect_last $(($1 * ($1 + 1) / 2))
+}
+
+
+function test_nested_groups { #depth #threads #stealing
+	echo "Nesting task groups to depth $1 with $2 threads (work stealing: $3)"
+	run_test groups $1 $2 $3
+	expect_last $((1 << $1))
+}
+
+
+function test_priorities { #jobs #aging
+	echo "Running $1 jobs per priority with aging $2"
+	run_test priorities $1 $2
+}
+
+
+function test_elastic { #maxthreads #stealing
+	echo "Growing and shrinking pools up to $1 threads (work stealing: $2)"
+	run_test elastic $1 $2
+}
+
+
+function test_affinity {
+	echo "Pinning threads to CPUs"
+	run_test affinity
+}
+
+
+function test_numa {
+	echo "Job queues per NUMA node"
+	run_test numa
+}
+
+
+function test_graph { #runs #threads #transforms
+	echo "Running a task graph with $3 transforms $1 times on $2 threads"
+	run_test graph $1 $2 $3
+}
+
+
+function test_copy { #jobs #threads
+	echo "Adding $1 jobs with copied arguments to $2 threads"
+	run_test copy $1 $2
+}
+
+
+function test_stats { #jobs #threads
+	echo "Reading statistics of $1 jobs on $2 threads"
+	COMPILATION_FLAGS="$COMPILATION_FLAGS -DTHPOOL_ENABLE_STATS" run_test stats $1 $2
+	run_test stats $1 $2
+}
+
+
+function test_wait_timeout { #jobs #threads
+	echo "Waiting with a timeout for $1 jobs on $2 threads"
+	run_test wait_timeout $1 $2
+}
+
+
+function test_cancel { #jobs #threads
+	echo "Cancelling and clearing $1 jobs on $2 threads"
+	run_test cancel $1 $2
+}
+
+
+function test_timers { #timers #threads
+	echo "Firing $1 timers on $2 threads"
+	run_test timers $1 $2
+}
+
+
+function test_bounded { #jobs #threads #capacity
+	echo "Adding $1 jobs to $2 threads through a queue of $3"
+	run_test bounded $1 $2 $3
+}
+
+
+function test_trace { #jobs #threads
+	echo "Tracing $1 jobs on $2 threads"
+	run_test trace $1 $2
 }
 
 
@@ -25,5 +154,39 @@ function test_mass_addition { #endsum #threads
 test_mass_addition 100 4
 test_mass_addition 100 1000
 test_mass_addition 100000 1000
+test_ring_addition 100000 4 4096 4
+test_ring_addition 100000 8 4 8
+test_fanout 16 1
+test_fanout 16 8
+test_job_recycling 1000 100 4 1000
+test_multiple_pools 100000 4 20
+test_futures 10000 1
+test_futures 10000 8
+test_nested_groups 12 1 0
+test_nested_groups 12 4 0
+test_nested_groups 12 4 1
+test_priorities 1000 0
+test_priorities 1000 10
+test_elastic 8 0
+test_elastic 40 1
+test_affinity
+test_numa
+test_graph 1000 1 3
+test_graph 1000 4 8
+test_graph 100 16 100
+test_copy 100000 1
+test_copy 100000 8
+test_stats 1000 1
+test_stats 1000 8
+test_trace 1000 1
+test_trace 1000 8
+test_bounded 100000 1 1
+test_bounded 100000 4 64
+test_timers 10000 1
+test_timers 10000 8
+test_cancel 1000 1
+test_cancel 1000 4
+test_wait_timeout 1000 1
+test_wait_timeout 1000 4
 
 echo "No errors"
@@ -0,0 +1,30 @@
+#! /bin/bash
+
+#
+# This file measures how fast idle threads start running
+# a burst of newly added jobs
+#
+
+. funcs.sh
+
+
+# ---------------------------- Tests -----------------------------------
+
+
+function test_wake_latency { #rounds #threads
+	echo "Measuring wake-to-run latency over $1 bursts of $2 jobs"
+	compile src/wake_latency.c
+	output=$(./test $1 $2)
+	if [[ $? != 0 ]]; then
+		err "$output" "$output"
+		exit 1
+	fi
+	echo "$output"
+}
+
+
+# Run tests
+test_wake_latency 300 4
+test_wake_latency 300 16
+
+echo "No wake latency errors"
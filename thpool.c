@@ -11,6 +11,9 @@
 #if defined(__APPLE__)
 #include <AvailabilityMacros.h>
 #else
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #endif
@@ -19,14 +22,19 @@
 #endif
 #endif
 #include <unistd.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <inttypes.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
 #include <pthread_np.h>
@@ -50,59 +58,456 @@
 #define THPOOL_THREAD_NAME thpool
 #endif
 
+#ifndef THPOOL_CACHE_LINE
+#define THPOOL_CACHE_LINE 64
+#endif
+
+#ifndef THPOOL_JOB_LINES
+#define THPOOL_JOB_LINES 2
+#endif
+
+#define THPOOL_JOB_INLINE (THPOOL_JOB_LINES * THPOOL_CACHE_LINE - 48) /* rest of the lines */
+
+#define THPOOL_TRACE_EVENTS  65536
+#define THPOOL_RING_CAPACITY 4096
+#define THPOOL_DEQUE_CAPACITY 1024
+#define THPOOL_SLAB_CHUNK     256
+#define THPOOL_SLAB_CACHE     64
+#define THPOOL_IDLE_TIMEOUT   10000 /* ms */
+#define THPOOL_MAX_CPUS       1024
+#define THPOOL_SYSFS_ROOT     "/sys/devices/system"
+#define THPOOL_TIMER_TICK     100000 /* ns */
+#define THPOOL_TIMER_LEVELS   6
+#define THPOOL_TIMER_BITS     6
+#define THPOOL_TIMER_SLOTS    (1 << THPOOL_TIMER_BITS)
+
+/* Future states */
+#define FUTURE_QUEUED    0
+#define FUTURE_RUNNING   1
+#define FUTURE_CANCELLED 2
+
+/* Pause states */
+#define THREADS_RUNNING  0
+#define THREADS_PAUSED   1
+#define THREADS_DRAINING 2
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
-static volatile int threads_keepalive;
-static volatile int threads_on_hold;
+static pthread_key_t  thread_key;          /* thread running the caller */
+static pthread_key_t  future_key;          /* future of the running job */
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
 
 
 
 /* ========================== STRUCTURES ============================ */
 
 
-/* Binary semaphore */
-typedef struct bsem {
+/* Counting semaphore
+ *
+ * Holds a token for every job posted. Idle threads sleep until they can
+ * take a token. Posting wakes one sleeper, which wakes the next if tokens
+ * are left once it took its own, so a batch doesn't wake every idle
+ * thread at once. On Linux
+ * sleepers wait on a futex on seq, elsewhere on the condition variable.
+ */
+typedef struct csem {
 	pthread_mutex_t mutex;
 	pthread_cond_t   cond;
-	int v;
-} bsem;
+	volatile int tokens;                 /* tokens left to take       */
+	volatile int sleepers;               /* threads waiting for one   */
+	volatile int seq;                    /* bumped on every wakeup    */
+	volatile int closed;                 /* wait returns right away   */
+	volatile int kicked;                 /* woken without a token     */
+} csem;
 
 
-/* Job */
+/* Job
+ *
+ * Nodes take THPOOL_JOB_LINES whole cache lines and the slab aligns them,
+ * so no two jobs share a line. What the header leaves of them holds the
+ * argument of thpool_add_work_copy().
+ */
 typedef struct job{
 	struct job*  prev;                   /* pointer to previous job   */
 	void   (*function)(void* arg);       /* function pointer          */
 	void*  arg;                          /* function's argument       */
-} job;
+	struct thpool_group_* group;         /* group of the job or NULL  */
+	unsigned long long queued_ns;        /* when added, 0 if unknown  */
+	int    slot;                         /* holds a bounded queue slot*/
+	union {                              /* thpool_add_work_copy()    */
+		unsigned char bytes[THPOOL_JOB_INLINE];
+		long long     align_ll;
+		double        align_d;
+		void*         align_p;
+	} data;
+} __attribute__((aligned(THPOOL_CACHE_LINE))) job;
+
+_Static_assert(sizeof(job) == THPOOL_JOB_LINES * THPOOL_CACHE_LINE, "job nodes must fill whole cache lines");
+
+
+/* Argument of thpool_add_work_copy() too big for the job */
+typedef struct jobcopy{
+	void   (*function)(void* arg);       /* the job's function        */
+	union {
+		long long     align_ll;
+		double        align_d;
+		void*         align_p;
+	} data[];                            /* the copied argument       */
+} jobcopy;
+
+
+/* Chunk of job nodes */
+typedef struct jobchunk{
+	struct jobchunk* next;               /* older chunk               */
+	size_t size;                         /* number of jobs in chunk   */
+	struct job jobs[];                   /* the job nodes             */
+} jobchunk;
+
+
+/* Job allocator
+ *
+ * Jobs are carved out of chunks and recycled, never given back to the
+ * system before the pool is destroyed. Threads of the pool keep freed jobs
+ * in a small local cache and hand the surplus back over the lock-free
+ * returned list, which allocations take over as a whole.
+ */
+typedef struct jobslab{
+	pthread_mutex_t lock;                /* used for free and chunks  */
+	job*      free;                      /* recycled jobs             */
+	job*      returned;                  /* jobs given back lock-free */
+	jobchunk* chunks;                    /* all chunks, newest first  */
+	size_t    chunk_used;                /* jobs used of newest chunk */
+	size_t    high_water;                /* jobs ever carved out      */
+} jobslab;
 
 
-/* Job queue */
+/* Ring slot */
+typedef struct ringslot{
+	size_t seq;                          /* sequence number of slot   */
+	struct job* job;                     /* job stored in the slot    */
+} ringslot;
+
+
+/* Bounded lock-free MPMC ring
+ *
+ * Every slot carries a sequence number telling whether it is free for the
+ * producer at a given position or holds a job for the consumer at a given
+ * position (D. Vyukov's bounded MPMC queue). The two positions live on
+ * their own cache lines so producers and consumers don't false share.
+ */
+typedef struct jobring{
+	char      pad0[THPOOL_CACHE_LINE];
+	size_t    enqueue_pos;               /* next position to push to  */
+	char      pad1[THPOOL_CACHE_LINE - sizeof(size_t)];
+	size_t    dequeue_pos;               /* next position to pull from*/
+	char      pad2[THPOOL_CACHE_LINE - sizeof(size_t)];
+	ringslot* slots;                     /* array of slots            */
+	size_t    mask;                      /* number of slots - 1       */
+} jobring;
+
+
+/* Priority level of the job queue */
+typedef struct joblevel{
+	pthread_mutex_t mutex;               /* used for level r/w access */
+	job  *front;                         /* pointer to front of level */
+	job  *rear;                          /* pointer to rear  of level */
+	volatile int len;                    /* number of jobs in level   */
+} joblevel;
+
+
+/* Job queue
+ *
+ * Jobs of the default priority go to the ring and the list. Jobs of other
+ * priorities go to their own level and are only looked at while levels_len
+ * says there are some. len counts the jobs of all priorities.
+ */
 typedef struct jobqueue{
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
 	job  *front;                         /* pointer to front of queue */
 	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	jobring *ring;                       /* lock-free ring or NULL    */
+	csem *has_jobs;                      /* a token per queued job    */
+	volatile int len;                    /* number of jobs in queue   */
+	joblevel levels[THPOOL_PRIORITIES];  /* other priorities' jobs    */
+	volatile int levels_len;             /* number of jobs in levels  */
+	unsigned int aging;                  /* pulls per low first pull  */
+	volatile unsigned int pulls;         /* pulls while levels in use */
 } jobqueue;
 
 
+/* NUMA node
+ *
+ * Threads of a node pull from the node's job queue. A pool that isn't NUMA
+ * aware has a single node holding the one job queue.
+ */
+typedef struct numanode{
+	int       id;                        /* node id in sysfs          */
+	int*      cpus;                      /* CPUs of the node or NULL  */
+	int       num_cpus;                  /* number of CPUs in cpus    */
+	jobqueue  jobqueue;                  /* jobs for the node         */
+	int       num_threads;               /* threads started on it     */
+	int       threads_retire;            /* of them asked to retire   */
+} numanode;
+
+
+/* Work-stealing deque
+ *
+ * Chase-Lev deque of fixed size. Only the owning thread pushes and pops at
+ * the bottom, any thread may steal from the top.
+ */
+typedef struct jobdeque{
+	char      pad0[THPOOL_CACHE_LINE];
+	long      top;                       /* next position to steal    */
+	char      pad1[THPOOL_CACHE_LINE - sizeof(long)];
+	long      bottom;                    /* next position to push to  */
+	char      pad2[THPOOL_CACHE_LINE - sizeof(long)];
+	struct job** slots;                  /* array of slots            */
+	long      mask;                      /* number of slots - 1       */
+} jobdeque;
+
+
+/* Timer of thpool_add_work_after() and thpool_add_work_every() */
+typedef struct timer{
+	void   (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	unsigned long long expiry;           /* tick to run at            */
+	unsigned long long period;           /* ticks between runs or 0   */
+	unsigned int gen;                    /* bumped when freed         */
+	int    list;                         /* wheel slot, -1 if free    */
+	int    prev;                         /* previous timer in slot    */
+	int    next;                         /* next in slot or free list */
+} timer;
+
+
+/* Hierarchical timing wheel
+ *
+ * Level l has a slot per 64^l ticks. A timer goes to the lowest level
+ * whose slots reach its expiry, and when a slot of a higher level comes
+ * round its timers are spread over the levels below (cascaded). A bitmap
+ * per level tells the non-empty slots, so the next tick with something
+ * to do is found without walking empty ones. Timers are kept in an array
+ * and linked by index, handles are index and generation.
+ */
+typedef struct timerwheel{
+	pthread_mutex_t lock;                /* used for everything else  */
+	timer* timers;                       /* all timers by index       */
+	int    cap;                          /* size of timers            */
+	int    free;                         /* first free timer or -1    */
+	int    heads[THPOOL_TIMER_LEVELS * THPOOL_TIMER_SLOTS];
+	unsigned long long busy[THPOOL_TIMER_LEVELS]; /* non-empty slots  */
+	unsigned long long tick;             /* ticks done                */
+	unsigned long long epoch;            /* time of tick 0            */
+	volatile int count;                  /* timers pending            */
+	volatile unsigned long long due;     /* time of next tick to do   */
+	volatile int keeper;                 /* id + 1 of thread sleeping
+	                                        until due, 0 if none      */
+} timerwheel;
+
+
+/* Future
+ *
+ * Completion handle of a job added with thpool_submit(). Referenced by the
+ * job and by the user, it goes back to the pool's free list once both let
+ * go of it and is reused by the next submit.
+ */
+typedef struct thpool_future_{
+	struct thpool_future_* next;         /* next free future          */
+	struct thpool_future_* all;          /* next of all futures       */
+	struct thpool_* thpool_p;            /* pool the future belongs to*/
+	void*  (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	void*  result;                       /* function's return value   */
+	volatile int done;                   /* result is set             */
+	volatile int state;                  /* queued, running, cancelled*/
+	volatile int cancel;                 /* thpool_cancel() was called*/
+	volatile int waiters;                /* threads blocked on cond   */
+	volatile int refs;                   /* job and user references   */
+	pthread_mutex_t mutex;               /* used for waiting          */
+	pthread_cond_t  cond;                /* signal to waiters         */
+} thpool_future_;
+
+
+/* Task group
+ *
+ * Counts the jobs added to the group that haven't finished yet. The last
+ * job to finish decrements the count under the mutex, so a waiter that saw
+ * it reach zero can free the group right away.
+ */
+typedef struct thpool_group_{
+	struct thpool_* thpool_p;            /* pool the group belongs to */
+	volatile int pending;                /* jobs not finished yet     */
+	pthread_mutex_t mutex;               /* used for the last job     */
+	pthread_cond_t  cond;                /* signal to waiters         */
+} thpool_group_;
+
+
+/* Node of a task graph */
+typedef struct graphnode{
+	void   (*function)(void* arg);       /* function pointer          */
+	void*    arg;                        /* function's argument       */
+	struct thpool_graph_* graph_p;       /* graph of the node         */
+	int*     succs;                      /* nodes that wait for it    */
+	int      num_succs;
+	int      cap_succs;
+	int      preds;                      /* nodes it waits for        */
+	volatile int pending;                /* of those, not done yet    */
+} graphnode;
+
+
+/* Task graph
+ *
+ * Nodes and edges are kept between runs. A run resets the pending count of
+ * every node and queues those without predecessors; a node whose last
+ * predecessor finishes is queued by it. The group counts unfinished nodes.
+ */
+typedef struct thpool_graph_{
+	struct thpool_* thpool_p;            /* pool the graph runs on    */
+	graphnode* nodes;
+	int*     order;                      /* scratch for the cycle check */
+	int      num_nodes;
+	int      cap_nodes;
+	int      checked;                    /* no edges since last check */
+	thpool_group_ group;                 /* nodes not finished yet    */
+} thpool_graph_;
+
+
+/* Parallel loop
+ *
+ * Lives on the stack of the caller of thpool_parallel_for(). Every
+ * participant takes an id and claims chunks of the range until none are
+ * left, reducing into its own slot of partials.
+ */
+typedef struct parallel_loop{
+	long      begin;                     /* range to run              */
+	long      end;
+	long      grain;                     /* smallest chunk            */
+	int       schedule;                  /* thpool_schedule           */
+	int       parts;                     /* participants, 0 for any   */
+	volatile int  ids;                   /* ids handed out            */
+	volatile long next;                  /* first unclaimed index     */
+	void    (*function_p)(long, long, void*, void*);
+	void    (*for_p)(long, long, void*); /* used instead if not NULL  */
+	void*     ctx;
+	char*     partials;                  /* size bytes per id or NULL */
+	size_t    size;
+} parallel_loop;
+
+
+/* Statistics of a thread
+ *
+ * Only written by the thread itself, with relaxed stores so that
+ * thpool_get_stats() can read them at any time.
+ */
+typedef struct threadstats{
+	unsigned long long submitted;        /* jobs added by the thread  */
+	unsigned long long jobs;             /* jobs run                  */
+	unsigned long long busy_ns;          /* time running jobs         */
+	unsigned long long idle_ns;          /* time waiting for jobs     */
+	unsigned long long empty_wakeups;    /* woke up to find no job    */
+	unsigned long long wait_hist[THPOOL_STATS_BUCKETS];
+	unsigned long long run_hist[THPOOL_STATS_BUCKETS];
+} threadstats;
+
+
+/* Trace event, a job or idle interval of a thread */
+typedef struct traceevent{
+	unsigned long long start_ns;         /* when it started           */
+	unsigned long long end_ns;           /* when it ended             */
+	unsigned long long queued_ns;        /* job: when added, or 0     */
+	void   (*function)(void* arg);       /* job function, NULL = idle */
+} traceevent;
+
+
 /* Thread */
 typedef struct thread{
 	int       id;                        /* friendly id               */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
+	numanode* node;                      /* node the thread runs on   */
+	jobdeque* deque;                     /* local jobs or NULL        */
+	unsigned int seed;                   /* picks victims to steal    */
+	job*      cache;                     /* freed jobs kept for reuse */
+	job*      cache_last;                /* last job in cache         */
+	int       cache_len;                 /* number of jobs in cache   */
+	volatile int active;                 /* runs, slot not free       */
+	int       joinable;                  /* pthread not joined yet    */
+	int       cpu;                       /* CPU to pin to or -1       */
+	int       pinned;                    /* pinned to cpu             */
+	traceevent* trace;                   /* trace ring or NULL        */
+	volatile unsigned long long trace_head; /* events ever recorded   */
+#ifdef THPOOL_ENABLE_STATS
+	char      pad0[THPOOL_CACHE_LINE];   /* keep stealers off stats   */
+	threadstats stats;                   /* counters of the thread    */
+#endif
 } thread;
 
 
+/* Table of threads
+ *
+ * Grows by copying into a bigger table. Stealers may still be reading an
+ * old table, so old tables are kept until the pool is destroyed. Threads
+ * that retire keep their slot (and struct) for the next thread spawned.
+ */
+typedef struct threadtab{
+	struct threadtab* old;               /* previous, smaller table   */
+	int       size;                      /* number of slots           */
+	struct thread* slots[];              /* threads or NULL           */
+} threadtab;
+
+
 /* Threadpool */
 typedef struct thpool_{
-	thread**   threads;                  /* pointer to threads        */
-	volatile int num_threads_alive;      /* threads currently alive   */
+	threadtab* threads;                  /* pointer to threads        */
+	volatile int threads_keepalive;      /* threads keep running      */
+	volatile int num_threads;            /* threads started, staying  */
+	volatile int threads_min;            /* fewest threads to keep    */
+	volatile int threads_max;            /* most threads to spawn     */
+	volatile int threads_retire;         /* threads asked to retire   */
+	int        spawn_threshold;          /* queued jobs to spawn at   */
+	unsigned int idle_timeout;           /* ms idle before retiring   */
+	pthread_mutex_t  grow_lock;          /* used for spawning threads */
+	int        work_stealing;            /* threads have deques       */
+	unsigned int deque_capacity;         /* slots per deque           */
+	int       wait_helps;                /* waiters run queued jobs   */
+	char      pad2[THPOOL_CACHE_LINE];   /* counted twice every job   */
 	volatile int num_threads_working;    /* threads currently working */
+	char      pad3[THPOOL_CACHE_LINE - sizeof(int)];
+	volatile int num_threads_alive;      /* threads currently alive   */
+	volatile int num_callers_working;    /* waiters running jobs      */
+	volatile int num_waiters;            /* threads in thpool_wait    */
+	char      pad4[THPOOL_CACHE_LINE - 3 * sizeof(int)];
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
-	jobqueue  jobqueue;                  /* job queue                 */
+	pthread_cond_t  threads_all_alive;   /* signal to thpool_init     */
+	volatile int on_hold;                /* pause state of threads    */
+	pthread_mutex_t  hold_lock;          /* used for pausing threads  */
+	pthread_cond_t  threads_resumed;     /* signal to paused threads  */
+	numanode* nodes;                     /* nodes with their queues   */
+	int       num_nodes;                 /* number of nodes           */
+	int*      cpu_nodes;                 /* node index by CPU or NULL */
+	unsigned int capacity;               /* bounded: most jobs queued */
+	int       full_policy;               /* bounded: when it is full  */
+	csem      space;                     /* bounded: a token per slot */
+	jobslab   jobslab;                   /* job allocator             */
+	int*      cpus;                      /* CPUs in pinning order     */
+	int       num_cpus;                  /* number of CPUs in cpus    */
+	pthread_mutex_t  future_lock;        /* used for the future lists */
+	thpool_future_*  futures_free;       /* futures ready for reuse   */
+	thpool_future_*  futures_all;        /* all futures, for destroy  */
+	timerwheel timers;                   /* delayed & periodic jobs   */
+	volatile int tracing;                /* record trace events       */
+	unsigned int trace_events;           /* events kept per thread    */
+	unsigned long long trace_epoch;      /* time 0 of the trace       */
+	char*     trace_path;                /* dump at destroy or NULL   */
+	pthread_mutex_t  caller_lock;        /* used for the caller track */
+	thread    caller;                    /* jobs waiters ran, id -1   */
+#ifdef THPOOL_ENABLE_STATS
+	char      pad0[THPOOL_CACHE_LINE];   /* keep threads off stats    */
+	volatile unsigned long long submitted; /* jobs added from outside */
+	volatile int queue_peak;             /* most jobs queued at once  */
+	char      pad1[THPOOL_CACHE_LINE];
+#endif
 } thpool_;
 
 
@@ -113,21 +518,135 @@ typedef struct thpool_{
 
 
 static int  thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
+static int   thread_start(struct thread* thread_p);
+static int   thread_spawn(thpool_* thpool_p);
+static struct numanode* thpool_retire_node(thpool_* thpool_p);
+static int   thread_retire(struct thread* thread_p, int idle, int token);
+static threadtab* threadtab_grow(thpool_* thpool_p);
 static void* thread_do(struct thread* thread_p);
-static void  thread_hold(int sig_id);
+static void  thread_hold(struct thread* thread_p, int drain);
+static int   thread_drained(struct thread* thread_p);
 static void  thread_destroy(struct thread* thread_p);
+static void  thread_key_init(void);
+static struct thread* thread_self(thpool_* thpool_p);
+static struct job* thread_pull(struct thread* thread_p);
+static struct job* thread_steal(struct thread* thread_p);
+static struct job* thread_pull_remote(struct thread* thread_p);
+static int   thread_remote_work(struct thread* thread_p);
+static struct job* thread_help(struct thread* thread_p);
+static void  thread_pin(struct thread* thread_p);
+static void  thread_run(struct thread* thread_p, struct job* job_p);
+
+static int   thpool_add_job(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, thpool_group_* group_p);
+static int   thpool_queue_job(thpool_* thpool_p, struct thread* thread_p, struct job* newjob, int policy);
+static void  thpool_push_job(thpool_* thpool_p, struct thread* thread_p, struct job* newjob);
+static int   thpool_admit(thpool_* thpool_p, struct thread* thread_p, struct job* job_p, int policy);
+static void  thpool_run_inline(thpool_* thpool_p, struct job* job_p);
+static void  thpool_run_copy(void* arg);
+static void  thpool_discard_copy(struct job* job_p);
+static void  thpool_grow(thpool_* thpool_p);
+static void  thpool_requeue(jobqueue* jobqueue_p, struct job* keep);
+static int   thpool_drop(thpool_* thpool_p, struct job* job_p, void (*destructor_p)(void*));
+static numanode* thpool_node(thpool_* thpool_p, struct thread* thread_p);
+static void  thpool_wake_remote(thpool_* thpool_p, numanode* node_p);
+static int   thpool_queued(thpool_* thpool_p);
+static int   thpool_busy(thpool_* thpool_p);
+static void  thpool_idle(thpool_* thpool_p);
+static int   thpool_help(thpool_* thpool_p);
+static void  thpool_run_caller(thpool_* thpool_p, struct job* job_p);
+static int   thpool_wait_until(thpool_* thpool_p, const struct timespec* deadline);
+
+static int   thpool_add_batch(thpool_* thpool_p, void (*function_p)(void*), void (**functions_p)(void*), void** arg_p, size_t n);
+static int   thpool_add_batch_bounded(thpool_* thpool_p, void (*function_p)(void*), void (**functions_p)(void*), void** arg_p, size_t n);
+static int   thpool_queue_batch(thpool_* thpool_p, void (*function_p)(void*), void (**functions_p)(void*), void** arg_p, size_t n, int slot);
+
+static thpool_future_* future_alloc(thpool_* thpool_p);
+static void  future_run(void* arg);
+static void  future_finish(thpool_future_* future_p, void* result);
+static void  future_unref(thpool_future_* future_p);
+static void  future_destroy_all(thpool_* thpool_p);
+
+static void  timerwheel_init(timerwheel* wheel_p);
+static void  timerwheel_destroy(timerwheel* wheel_p);
+static thpool_timer timer_add(thpool_* thpool_p, unsigned long long delay_ns, unsigned long long period_ns,
+                              void (*function_p)(void*), void* arg_p);
+static void  timer_insert(timerwheel* wheel_p, int index);
+static void  timer_unlink(timerwheel* wheel_p, int index);
+static void  timer_release(timerwheel* wheel_p, int index);
+static unsigned long long timer_next(timerwheel* wheel_p);
+static void  timer_update_due(timerwheel* wheel_p);
+static void  timer_advance(thpool_* thpool_p, unsigned long long target);
+static void  timer_expire(thpool_* thpool_p, unsigned long long tick);
+static void  timer_fire(thpool_* thpool_p, int index);
+static void  timer_poll(thpool_* thpool_p, int wait);
+
+static unsigned long long clock_now(void);
+static unsigned long long thpool_stamp(thpool_* thpool_p);
+static void  trace_dump_thread(thpool_* thpool_p, struct thread* thread_p, FILE* fp);
+static void  trace_record(struct thread* thread_p, unsigned long long start, unsigned long long end,
+                          unsigned long long queued, void (*function_p)(void*));
+#ifdef THPOOL_ENABLE_STATS
+static void  stats_add(unsigned long long* counter_p, unsigned long long n);
+static void  stats_submit(thpool_* thpool_p, struct thread* thread_p, unsigned long long n);
+static int   stats_bucket(unsigned long long ns);
+static void  stats_total(thpool_stats* stats, threadstats* own);
+#endif
+
+static void  group_done(thpool_group_* group_p);
+static void  group_init(thpool_group_* group_p, thpool_* thpool_p);
+
+static int   graph_acyclic(thpool_graph_* graph_p);
+static void  graph_run_node(void* arg);
+
+static int   parallel_run_loop(thpool_* thpool_p, parallel_loop* loop_p);
+static void  parallel_run(void* arg);
+static int   parallel_claim(parallel_loop* loop_p, int id, long k, long* begin_p, long* end_p);
 
-static int   jobqueue_init(jobqueue* jobqueue_p);
+static int   topology_read_int(const char* root, const char* path, int cpu);
+static int   topology_read_list(const char* root, const char* path, int* list, int max);
+static int   topology_cpus(const thpool_config* config, int** cpus_p);
+static int   topology_nodes(thpool_* thpool_p, const thpool_config* config);
+static void  topology_destroy(thpool_* thpool_p);
+
+static int   jobqueue_init(jobqueue* jobqueue_p, const thpool_config* config);
 static void  jobqueue_clear(jobqueue* jobqueue_p);
 static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
+static void  jobqueue_push_batch(jobqueue* jobqueue_p, struct job* first_p, size_t n);
+static void  jobqueue_push_prio(jobqueue* jobqueue_p, struct job* newjob_p, int prio);
 static struct job* jobqueue_pull(jobqueue* jobqueue_p);
+static struct job* jobqueue_pull_default(jobqueue* jobqueue_p);
+static struct job* jobqueue_pull_levels(jobqueue* jobqueue_p);
+static struct job* jobqueue_pull_level(jobqueue* jobqueue_p, joblevel* joblevel_p);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
-static void  bsem_init(struct bsem *bsem_p, int value);
-static void  bsem_reset(struct bsem *bsem_p);
-static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
+static int   jobslab_init(jobslab* jobslab_p, size_t prealloc);
+static struct job* jobslab_alloc(jobslab* jobslab_p, struct thread* thread_p);
+static int   jobslab_alloc_batch(jobslab* jobslab_p, struct thread* thread_p, size_t n, struct job** first_p);
+static struct job* jobslab_take(jobslab* jobslab_p);
+static struct jobchunk* jobslab_chunk(size_t n);
+static void  jobslab_free(jobslab* jobslab_p, struct thread* thread_p, struct job* job_p);
+static void  jobslab_give_back(jobslab* jobslab_p, struct job* first_p, struct job* last_p);
+static void  jobslab_destroy(jobslab* jobslab_p);
+
+static jobring* jobring_init(unsigned int capacity);
+static int   jobring_push(jobring* jobring_p, struct job* newjob_p);
+static struct job* jobring_pull(jobring* jobring_p);
+static void  jobring_destroy(jobring* jobring_p);
+
+static jobdeque* jobdeque_init(unsigned int capacity);
+static int   jobdeque_push(jobdeque* jobdeque_p, struct job* newjob_p);
+static struct job* jobdeque_pop(jobdeque* jobdeque_p);
+static struct job* jobdeque_steal(jobdeque* jobdeque_p);
+static long  jobdeque_size(jobdeque* jobdeque_p);
+static void  jobdeque_destroy(jobdeque* jobdeque_p);
+
+static void  csem_init(struct csem *csem_p);
+static void  csem_reset(struct csem *csem_p);
+static void  csem_post(struct csem *csem_p, int n);
+static void  csem_close(struct csem *csem_p);
+static void  csem_kick(struct csem *csem_p);
+static int   csem_timedwait(struct csem *csem_p, long long timeout_ns);
+static int   csem_trywait(struct csem *csem_p);
 
 
 
@@ -138,10 +657,46 @@ static void  bsem_wait(struct bsem *bsem_p);
 
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
+	thpool_config config;
+	thpool_config_defaults(&config);
+	config.num_threads = num_threads;
+	return thpool_init_config(&config);
+}
+
+
+/* Default configuration */
+void thpool_config_defaults(thpool_config* config){
+	config->num_threads   = 0;
+	config->queue_type    = THPOOL_QUEUE_LIST;
+	config->ring_capacity = THPOOL_RING_CAPACITY;
+	config->work_stealing  = 0;
+	config->deque_capacity = THPOOL_DEQUE_CAPACITY;
+	config->job_prealloc   = 0;
+	config->prio_aging     = 0;
+	config->min_threads     = 0;
+	config->max_threads     = 0;
+	config->spawn_threshold = 0;
+	config->idle_timeout_ms = THPOOL_IDLE_TIMEOUT;
+	config->affinity        = THPOOL_AFFINITY_NONE;
+	config->cpus            = NULL;
+	config->num_cpus        = 0;
+	config->sysfs_root      = NULL;
+	config->numa            = 0;
+	config->trace           = 0;
+	config->trace_events    = THPOOL_TRACE_EVENTS;
+	config->trace_path      = NULL;
+	config->queue_capacity  = 0;
+	config->full_policy     = THPOOL_FULL_BLOCK;
+	config->wait_helps      = 0;
+}
 
-	threads_on_hold   = 0;
-	threads_keepalive = 1;
 
+/* Initialise thread pool from configuration */
+struct thpool_* thpool_init_config(const thpool_config* config){
+
+	pthread_once(&thread_key_once, thread_key_init);
+
+	int num_threads = config->num_threads;
 	if (num_threads < 0){
 		num_threads = 0;
 	}
@@ -153,39 +708,139 @@ struct thpool_* thpool_init(int num_threads){
 		err("thpool_init(): Could not allocate memory for thread pool\n");
 		return NULL;
 	}
+	thpool_p->threads_keepalive   = 1;
+	thpool_p->num_threads         = num_threads;
+	thpool_p->threads_min         = num_threads;
+	thpool_p->threads_max         = num_threads;
+	thpool_p->threads_retire      = 0;
+	thpool_p->spawn_threshold     = config->spawn_threshold;
+	thpool_p->idle_timeout        = config->idle_timeout_ms;
 	thpool_p->num_threads_alive   = 0;
 	thpool_p->num_threads_working = 0;
+	thpool_p->num_callers_working = 0;
+	thpool_p->num_waiters         = 0;
+	thpool_p->wait_helps          = config->wait_helps;
+	thpool_p->work_stealing       = config->work_stealing;
+	thpool_p->deque_capacity      = config->deque_capacity;
+	thpool_p->tracing             = 0;
+	thpool_p->trace_events        = config->trace_events ? config->trace_events : THPOOL_TRACE_EVENTS;
+	thpool_p->trace_epoch         = 0;
+	thpool_p->trace_path          = NULL;
+	thpool_p->capacity            = config->queue_capacity < INT_MAX ? config->queue_capacity : INT_MAX;
+	thpool_p->full_policy         = config->full_policy;
+	csem_init(&thpool_p->space);
+	thpool_p->space.tokens        = (int)thpool_p->capacity;
+#ifdef THPOOL_ENABLE_STATS
+	thpool_p->submitted           = 0;
+	thpool_p->queue_peak          = 0;
+#endif
+
+	/* Elastic pool */
+	if (config->max_threads > num_threads){
+		thpool_p->threads_max = config->max_threads;
+		thpool_p->threads_min = config->min_threads < 0 ? 0 :
+		                        config->min_threads < num_threads ? config->min_threads : num_threads;
+	}
 
-	/* Initialise the job queue */
-	if (jobqueue_init(&thpool_p->jobqueue) == -1){
+	/* Initialise the nodes and their job queues */
+	if (topology_nodes(thpool_p, config) == -1){
 		err("thpool_init(): Could not allocate memory for job queue\n");
 		free(thpool_p);
 		return NULL;
 	}
 
+	/* Initialise the job allocator */
+	if (jobslab_init(&thpool_p->jobslab, config->job_prealloc) == -1){
+		err("thpool_init(): Could not allocate memory for jobs\n");
+		topology_destroy(thpool_p);
+		free(thpool_p);
+		return NULL;
+	}
+
+	/* CPUs to pin threads to */
+	thpool_p->cpus     = NULL;
+	thpool_p->num_cpus = 0;
+	if (config->affinity != THPOOL_AFFINITY_NONE){
+		thpool_p->num_cpus = topology_cpus(config, &thpool_p->cpus);
+		if (thpool_p->num_cpus == -1){
+			err("thpool_init(): Could not read CPU topology\n");
+			topology_destroy(thpool_p);
+			jobslab_destroy(&thpool_p->jobslab);
+			free(thpool_p);
+			return NULL;
+		}
+	}
+
 	/* Make threads in pool */
-	thpool_p->threads = (struct thread**)malloc(num_threads * sizeof(struct thread *));
+	int slots = thpool_p->threads_max > 0 ? thpool_p->threads_max : 1;
+	thpool_p->threads = (struct threadtab*)calloc(1, sizeof(struct threadtab) + slots * sizeof(struct thread *));
 	if (thpool_p->threads == NULL){
 		err("thpool_init(): Could not allocate memory for threads\n");
-		jobqueue_destroy(&thpool_p->jobqueue);
+		topology_destroy(thpool_p);
+		jobslab_destroy(&thpool_p->jobslab);
+		free(thpool_p->cpus);
 		free(thpool_p);
 		return NULL;
 	}
 
+	thpool_p->threads->old  = NULL;
+	thpool_p->threads->size = slots;
+
 	pthread_mutex_init(&(thpool_p->thcount_lock), NULL);
+	pthread_mutex_init(&(thpool_p->grow_lock), NULL);
 	pthread_cond_init(&thpool_p->threads_all_idle, NULL);
+	pthread_cond_init(&thpool_p->threads_all_alive, NULL);
+
+	thpool_p->on_hold = THREADS_RUNNING;
+	pthread_mutex_init(&(thpool_p->hold_lock), NULL);
+	pthread_cond_init(&thpool_p->threads_resumed, NULL);
+
+	pthread_mutex_init(&thpool_p->future_lock, NULL);
+	thpool_p->futures_free = NULL;
+	thpool_p->futures_all  = NULL;
+
+	pthread_mutex_init(&thpool_p->caller_lock, NULL);
+	memset(&thpool_p->caller, 0, sizeof(thpool_p->caller));
+	thpool_p->caller.id       = -1;
+	thpool_p->caller.thpool_p = thpool_p;
+
+	timerwheel_init(&thpool_p->timers);
+
+	/* Tracing */
+	if (config->trace_path != NULL){
+		thpool_p->trace_path = (char*)malloc(strlen(config->trace_path) + 1);
+		if (thpool_p->trace_path != NULL){
+			strcpy(thpool_p->trace_path, config->trace_path);
+		}
+	}
+	if (config->trace){
+		thpool_trace_start(thpool_p);
+	}
 
 	/* Thread init */
 	int n;
 	for (n=0; n<num_threads; n++){
-		thread_init(thpool_p, &thpool_p->threads[n], n);
+		if (thread_init(thpool_p, &thpool_p->threads->slots[n], n) == -1){
+			break;
+		}
 #if THPOOL_DEBUG
 			printf("THPOOL_DEBUG: Created thread %d in pool \n", n);
 #endif
 	}
 
 	/* Wait for threads to initialize */
-	while (thpool_p->num_threads_alive != num_threads) {}
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	while (thpool_p->num_threads_alive != n) {
+		pthread_cond_wait(&thpool_p->threads_all_alive, &thpool_p->thcount_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	if (n != num_threads){
+		err("thpool_init(): Could not create threads\n");
+		thpool_p->num_threads = n;
+		thpool_destroy(thpool_p);
+		return NULL;
+	}
 
 	return thpool_p;
 }
@@ -193,326 +848,3898 @@ struct thpool_* thpool_init(int num_threads){
 
 /* Add work to the thread pool */
 int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
+	return thpool_add_job(thpool_p, function_p, arg_p, NULL);
+}
+
+
+/* Add work to the thread pool unless its bounded queue is full */
+int thpool_try_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
 	job* newjob;
+	thread* thread_p = thread_self(thpool_p);
 
-	newjob=(struct job*)malloc(sizeof(struct job));
+	newjob=jobslab_alloc(&thpool_p->jobslab, thread_p);
 	if (newjob==NULL){
-		err("thpool_add_work(): Could not allocate memory for new job\n");
+		err("thpool_try_add_work(): Could not allocate memory for new job\n");
 		return -1;
 	}
 
-	/* add function and argument */
 	newjob->function=function_p;
 	newjob->arg=arg_p;
+	newjob->group=NULL;
 
-	/* add job to queue */
-	jobqueue_push(&thpool_p->jobqueue, newjob);
-
-	return 0;
+	return thpool_queue_job(thpool_p, thread_p, newjob, THPOOL_FULL_FAIL);
 }
 
 
-/* Wait until all jobs have finished */
-void thpool_wait(thpool_* thpool_p){
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	while (thpool_p->jobqueue.len || thpool_p->num_threads_working) {
-		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
+/* Add work to the thread pool
+ *
+ * @param group_p       group the job counts in, or NULL
+ * @return 0 on success, -1 otherwise.
+ */
+static int thpool_add_job(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, thpool_group_* group_p){
+	job* newjob;
+	thread* thread_p = thread_self(thpool_p);
+
+	newjob=jobslab_alloc(&thpool_p->jobslab, thread_p);
+	if (newjob==NULL){
+		err("thpool_add_work(): Could not allocate memory for new job\n");
+		return -1;
 	}
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
-}
 
+	/* add function and argument */
+	newjob->function=function_p;
+	newjob->arg=arg_p;
+	newjob->group=group_p;
 
-/* Destroy the threadpool */
-void thpool_destroy(thpool_* thpool_p){
-	/* No need to destroy if it's NULL */
-	if (thpool_p == NULL) return ;
+	return thpool_queue_job(thpool_p, thread_p, newjob, thpool_p->full_policy);
+}
 
-	volatile int threads_total = thpool_p->num_threads_alive;
 
-	/* End each thread 's infinite loop */
-	threads_keepalive = 0;
+/* Add work with a copy of its argument to the thread pool
+ *
+ * Small arguments are copied into the job node itself, bigger ones to the
+ * heap along with the function, which is freed once the job ran.
+ */
+int thpool_add_work_copy(thpool_* thpool_p, void (*function_p)(void*), const void* data, size_t len){
+	job* newjob;
+	thread* thread_p = thread_self(thpool_p);
 
-	/* Give one second to kill idle threads */
-	double TIMEOUT = 1.0;
-	time_t start, end;
-	double tpassed = 0.0;
-	time (&start);
-	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
-		time (&end);
-		tpassed = difftime(end,start);
+	newjob=jobslab_alloc(&thpool_p->jobslab, thread_p);
+	if (newjob==NULL){
+		err("thpool_add_work_copy(): Could not allocate memory for new job\n");
+		return -1;
 	}
 
-	/* Poll remaining threads */
-	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
-		sleep(1);
+	if (len <= THPOOL_JOB_INLINE){
+		memcpy(newjob->data.bytes, data, len);
+		newjob->function=function_p;
+		newjob->arg=newjob->data.bytes;
 	}
-
-	/* Job queue cleanup */
-	jobqueue_destroy(&thpool_p->jobqueue);
-	/* Deallocs */
-	int n;
-	for (n=0; n < threads_total; n++){
-		thread_destroy(thpool_p->threads[n]);
+	else {
+		jobcopy* copy = (struct jobcopy*)malloc(sizeof(struct jobcopy) + len);
+		if (copy == NULL){
+			err("thpool_add_work_copy(): Could not allocate memory for argument\n");
+			jobslab_free(&thpool_p->jobslab, thread_p, newjob);
+			return -1;
+		}
+		memcpy(copy->data, data, len);
+		copy->function=function_p;
+		newjob->function=thpool_run_copy;
+		newjob->arg=copy;
 	}
-	free(thpool_p->threads);
-	free(thpool_p);
+	newjob->group=NULL;
+
+	return thpool_queue_job(thpool_p, thread_p, newjob, thpool_p->full_policy);
 }
 
 
-/* Pause all threads in threadpool */
-void thpool_pause(thpool_* thpool_p) {
-	int n;
-	for (n=0; n < thpool_p->num_threads_alive; n++){
-		pthread_kill(thpool_p->threads[n]->pthread, SIGUSR1);
+/* Run a job whose argument was copied to the heap */
+static void thpool_run_copy(void* arg){
+	jobcopy* copy = (jobcopy*)arg;
+	copy->function(copy->data);
+	free(copy);
+}
+
+
+/* Free the heap copy of the argument of a job that won't run */
+static void thpool_discard_copy(job* job_p){
+	if (job_p->function == thpool_run_copy){
+		free(job_p->arg);
 	}
 }
 
 
-/* Resume all threads in threadpool */
-void thpool_resume(thpool_* thpool_p) {
-    // resuming a single threadpool hasn't been
-    // implemented yet, meanwhile this suppresses
-    // the warnings
-    (void)thpool_p;
+/* Queue an allocated job, on the caller's deque if that is one of ours
+ *
+ * @param policy        what to do if the bounded queue is full
+ * @return 0 on success, -1 otherwise.
+ */
+static int thpool_queue_job(thpool_* thpool_p, thread* thread_p, job* newjob, int policy){
+
+	int admitted = thpool_admit(thpool_p, thread_p, newjob, policy);
+	if (admitted != 1) return admitted;
+
+	newjob->queued_ns = thpool_stamp(thpool_p);
+
+	/* add job to the deque of the calling thread if it is ours */
+	if (thpool_p->work_stealing){
+		if (thread_p != NULL && jobdeque_push(thread_p->deque, newjob) == 0){
+			/* let a thread come and steal it. If the deque held jobs
+			 * already, the thread that stole one of them wakes the next */
+			if (jobdeque_size(thread_p->deque) == 1){
+				csem_post(thread_p->node->jobqueue.has_jobs, 1);
+			}
+#ifdef THPOOL_ENABLE_STATS
+			stats_add(&thread_p->stats.submitted, 1);
+#endif
+			return 0;
+		}
+	}
 
-	threads_on_hold = 0;
+	thpool_push_job(thpool_p, thread_p, newjob);
+	return 0;
 }
 
 
-int thpool_num_threads_working(thpool_* thpool_p){
-	return thpool_p->num_threads_working;
+/* Add a job to the job queue of the caller's node */
+static void thpool_push_job(thpool_* thpool_p, thread* thread_p, job* newjob){
+	numanode* node_p = thpool_node(thpool_p, thread_p);
+	jobqueue_push(&node_p->jobqueue, newjob);
+#ifdef THPOOL_ENABLE_STATS
+	stats_submit(thpool_p, thread_p, 1);
+#endif
+	thpool_wake_remote(thpool_p, node_p);
+	thpool_grow(thpool_p);
 }
 
 
+/* Take a slot of the bounded queue for a job, as the policy says
+ *
+ * Jobs added by the pool's own threads don't need one: a thread waiting
+ * for room that only it could make would wait forever. A job that can't
+ * be queued is freed, or run right away with THPOOL_FULL_CALLER_RUNS.
+ *
+ * @return 1 if the job is to be queued, 0 if it ran already, -1 if the
+ *         queue is full (errno EAGAIN) or the pool is being destroyed
+ */
+static int thpool_admit(thpool_* thpool_p, thread* thread_p, job* job_p, int policy){
+	job_p->slot = 0;
+	if (thpool_p->capacity == 0 || thread_p != NULL) return 1;
+
+	if (csem_trywait(&thpool_p->space) == 0 ||
+	    (policy == THPOOL_FULL_BLOCK && csem_timedwait(&thpool_p->space, -1) == 0)){
+		job_p->slot = 1;
+		return 1;
+	}
+	if (policy == THPOOL_FULL_CALLER_RUNS){
+		thpool_run_inline(thpool_p, job_p);
+		return 0;
+	}
 
+	thpool_discard_copy(job_p);
+	jobslab_free(&thpool_p->jobslab, thread_p, job_p);
+	errno = EAGAIN;
+	return -1;
+}
 
 
-/* ============================ THREAD ============================== */
+/* Run a job on a thread outside the pool and recycle it */
+static void thpool_run_inline(thpool_* thpool_p, job* job_p){
+	thpool_group_* group_p = job_p->group;
+	job_p->function(job_p->arg);
+	jobslab_free(&thpool_p->jobslab, NULL, job_p);
+	if (group_p != NULL){
+		group_done(group_p);
+	}
+}
 
 
-/* Initialize a thread in the thread pool
+/* Add work with a priority to the thread pool
  *
- * @param thread        address to the pointer of the thread to be created
- * @param id            id to be given to the thread
- * @return 0 on success, -1 otherwise.
+ * Jobs of other than the default priority always go to the job queue so
+ * that every thread sees them in order.
  */
-static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
+int thpool_add_work_prio(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, int prio){
+	job* newjob;
 
-	*thread_p = (struct thread*)malloc(sizeof(struct thread));
-	if (*thread_p == NULL){
-		err("thread_init(): Could not allocate memory for thread\n");
+	if (prio == THPOOL_PRIO_NORMAL){
+		return thpool_add_job(thpool_p, function_p, arg_p, NULL);
+	}
+	if (prio < 0 || prio >= THPOOL_PRIORITIES){
+		err("thpool_add_work_prio(): Invalid priority\n");
+		return -1;
+	}
+
+	thread* thread_p = thread_self(thpool_p);
+	newjob=jobslab_alloc(&thpool_p->jobslab, thread_p);
+	if (newjob==NULL){
+		err("thpool_add_work_prio(): Could not allocate memory for new job\n");
 		return -1;
 	}
 
-	(*thread_p)->thpool_p = thpool_p;
-	(*thread_p)->id       = id;
+	newjob->function=function_p;
+	newjob->arg=arg_p;
+	newjob->group=NULL;
+
+	int admitted = thpool_admit(thpool_p, thread_p, newjob, thpool_p->full_policy);
+	if (admitted != 1) return admitted;
+
+	newjob->queued_ns = thpool_stamp(thpool_p);
+	numanode* node_p = thpool_node(thpool_p, thread_p);
+	jobqueue_push_prio(&node_p->jobqueue, newjob, prio);
+#ifdef THPOOL_ENABLE_STATS
+	stats_submit(thpool_p, thread_p, 1);
+#endif
+	thpool_wake_remote(thpool_p, node_p);
+	thpool_grow(thpool_p);
 
-	pthread_create(&(*thread_p)->pthread, NULL, (void * (*)(void *)) thread_do, (*thread_p));
-	pthread_detach((*thread_p)->pthread);
 	return 0;
 }
 
 
-/* Sets the calling thread on hold */
-static void thread_hold(int sig_id) {
-    (void)sig_id;
-	threads_on_hold = 1;
-	while (threads_on_hold){
-		sleep(1);
+/* Add work for the threads of a NUMA node */
+int thpool_add_work_node(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, int node){
+	job* newjob;
+	numanode* node_p = NULL;
+
+	int n;
+	for (n=0; n<thpool_p->num_nodes; n++){
+		if (thpool_p->nodes[n].id == node){
+			node_p = &thpool_p->nodes[n];
+			break;
+		}
+	}
+	if (node_p == NULL){
+		err("thpool_add_work_node(): Invalid node\n");
+		return -1;
+	}
+
+	thread* thread_p = thread_self(thpool_p);
+	newjob=jobslab_alloc(&thpool_p->jobslab, thread_p);
+	if (newjob==NULL){
+		err("thpool_add_work_node(): Could not allocate memory for new job\n");
+		return -1;
 	}
+
+	newjob->function=function_p;
+	newjob->arg=arg_p;
+	newjob->group=NULL;
+
+	int admitted = thpool_admit(thpool_p, thread_p, newjob, thpool_p->full_policy);
+	if (admitted != 1) return admitted;
+
+	newjob->queued_ns = thpool_stamp(thpool_p);
+	jobqueue_push(&node_p->jobqueue, newjob);
+#ifdef THPOOL_ENABLE_STATS
+	stats_submit(thpool_p, thread_p, 1);
+#endif
+	thpool_wake_remote(thpool_p, node_p);
+	thpool_grow(thpool_p);
+
+	return 0;
 }
 
 
-/* What each thread is doing
-*
-* In principle this is an endless loop. The only time this loop gets interrupted is once
-* thpool_destroy() is invoked or the program exits.
-*
-* @param  thread        thread that will run this function
-* @return nothing
-*/
-static void* thread_do(struct thread* thread_p){
+/* Add a batch of work with one function to the thread pool */
+int thpool_add_work_batch(thpool_* thpool_p, void (*function_p)(void*), void** arg_p, size_t n){
+	return thpool_add_batch(thpool_p, function_p, NULL, arg_p, n);
+}
 
-	/* Set thread name for profiling and debugging */
-	char thread_name[16] = {0};
 
-	snprintf(thread_name, 16, TOSTRING(THPOOL_THREAD_NAME) "-%d", thread_p->id);
+/* Add a batch of work with a function per job to the thread pool */
+int thpool_add_work_batch_fns(thpool_* thpool_p, void (**function_p)(void*), void** arg_p, size_t n){
+	return thpool_add_batch(thpool_p, NULL, function_p, arg_p, n);
+}
 
-#if defined(__linux__)
-	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
-	prctl(PR_SET_NAME, thread_name);
-#elif defined(__APPLE__) && defined(__MACH__)
-	pthread_setname_np(thread_name);
-#elif defined(__FreeBSD__) || defined(__OpenBSD__)
-    pthread_set_name_np(thread_p->pthread, thread_name);
-#else
-	err("thread_do(): pthread_setname_np is not supported on this system");
-#endif
 
-	/* Assure all threads have been created before starting serving */
-	thpool_* thpool_p = thread_p->thpool_p;
+/* Add work whose completion can be waited for on its own */
+struct thpool_future_* thpool_submit(thpool_* thpool_p, void* (*function_p)(void*), void* arg_p){
+	thpool_future_* future_p = future_alloc(thpool_p);
+	if (future_p == NULL){
+		err("thpool_submit(): Could not allocate memory for new future\n");
+		return NULL;
+	}
+	future_p->function = function_p;
+	future_p->arg      = arg_p;
 
-	/* Register signal handler */
-	struct sigaction act;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = SA_ONSTACK;
-	act.sa_handler = thread_hold;
-	if (sigaction(SIGUSR1, &act, NULL) == -1) {
-		err("thread_do(): cannot handle SIGUSR1");
+	if (thpool_add_work(thpool_p, future_run, future_p) == -1){
+		future_unref(future_p);
+		future_unref(future_p);
+		return NULL;
 	}
+	return future_p;
+}
 
-	/* Mark thread as alive (initialized) */
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive += 1;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-	while(threads_keepalive){
+/* Wait until all jobs have finished */
+void thpool_wait(thpool_* thpool_p){
+	thpool_wait_until(thpool_p, NULL);
+}
 
-		bsem_wait(thpool_p->jobqueue.has_jobs);
 
-		if (threads_keepalive){
+/* Wait until all jobs have finished or the timeout passes */
+int thpool_wait_timeout(thpool_* thpool_p, unsigned long long timeout_ns){
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec  += (time_t)(timeout_ns / 1000000000ULL);
+	deadline.tv_nsec += (long)(timeout_ns % 1000000000ULL);
+	if (deadline.tv_nsec >= 1000000000L){
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	return thpool_wait_until(thpool_p, &deadline);
+}
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-			/* Read job from queue and execute it */
-			void (*func_buff)(void*);
-			void*  arg_buff;
-			job* job_p = jobqueue_pull(&thpool_p->jobqueue);
-			if (job_p) {
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				func_buff(arg_buff);
-				free(job_p);
-			}
+/* Wait until all jobs have finished or the deadline passes
+ *
+ * If the pool was configured so, a thread outside the pool runs queued
+ * jobs itself until there are none left to take, and only then sleeps.
+ * A job it started may run past the deadline.
+ *
+ * @param deadline       CLOCK_REALTIME, NULL to wait forever
+ * @return 0 if the pool drained, -1 otherwise
+ */
+static int thpool_wait_until(thpool_* thpool_p, const struct timespec* deadline){
+	int helps = thpool_p->wait_helps && thread_self(thpool_p) == NULL;
+	int timedout = 0;
 
+	/* Counted before looking, so that the last thread to go idle wakes us */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	__atomic_add_fetch(&thpool_p->num_waiters, 1, __ATOMIC_SEQ_CST);
+	while (thpool_busy(thpool_p) && !timedout) {
+		if (helps && thpool_queued(thpool_p) > 0){
+			pthread_mutex_unlock(&thpool_p->thcount_lock);
+			int ran = thpool_help(thpool_p);
 			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			if (!thpool_p->num_threads_working) {
-				pthread_cond_signal(&thpool_p->threads_all_idle);
+			if (ran){
+				if (deadline != NULL){
+					struct timespec now;
+					clock_gettime(CLOCK_REALTIME, &now);
+					timedout = now.tv_sec > deadline->tv_sec ||
+					           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+				}
+				continue;
 			}
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
-
+		}
+		if (deadline == NULL){
+			pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
+		}
+		else {
+			timedout = pthread_cond_timedwait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock,
+			                                  deadline) == ETIMEDOUT;
 		}
 	}
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive --;
+	__atomic_sub_fetch(&thpool_p->num_waiters, 1, __ATOMIC_SEQ_CST);
+	int busy = thpool_busy(thpool_p);
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
-
-	return NULL;
+	return busy ? -1 : 0;
+}
+
+
+/* Tell if jobs are queued or running
+ *
+ * The queues are looked at first: threads count themselves as working
+ * before they pull a job, so a job is always seen in one place or the
+ * other.
+ */
+static int thpool_busy(thpool_* thpool_p){
+	return thpool_queued(thpool_p) ||
+	       __atomic_load_n(&thpool_p->num_threads_working, __ATOMIC_SEQ_CST) ||
+	       __atomic_load_n(&thpool_p->num_callers_working, __ATOMIC_SEQ_CST);
+}
+
+
+/* Wake up waiters if the pool went idle
+ *
+ * Called by whoever stopped working or emptied the queues. Only the
+ * transition to idle with waiters around takes the lock, so the counters
+ * cost a single atomic operation per job otherwise.
+ */
+static void thpool_idle(thpool_* thpool_p){
+	if (__atomic_load_n(&thpool_p->num_waiters, __ATOMIC_SEQ_CST) == 0) return;
+	if (thpool_busy(thpool_p)) return;
+
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	pthread_cond_broadcast(&thpool_p->threads_all_idle);
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+}
+
+
+/* Run a queued job on a thread outside the pool and recycle it
+ *
+ * Counted and traced like thread_run() does, on the track of the caller
+ * pseudo thread. Waiters share it, so they record one at a time.
+ */
+static void thpool_run_caller(thpool_* thpool_p, job* job_p){
+	thpool_group_* group_p = job_p->group;
+	void (*function_p)(void*) = job_p->function;
+
+	/* The job left the queue, let a blocked producer add one */
+	if (job_p->slot){
+		csem_post(&thpool_p->space, 1);
+	}
+
+	unsigned long long start = thpool_stamp(thpool_p);
+	unsigned long long queued_ns = job_p->queued_ns;
+	job_p->function(job_p->arg);
+	jobslab_free(&thpool_p->jobslab, NULL, job_p);
+	unsigned long long end = thpool_stamp(thpool_p);
+
+	pthread_mutex_lock(&thpool_p->caller_lock);
+#ifdef THPOOL_ENABLE_STATS
+	thread* caller_p = &thpool_p->caller;
+	stats_add(&caller_p->stats.wait_hist[stats_bucket(start - queued_ns)], 1);
+	stats_add(&caller_p->stats.run_hist[stats_bucket(end - start)], 1);
+	stats_add(&caller_p->stats.busy_ns, end - start);
+	stats_add(&caller_p->stats.jobs, 1);
+#endif
+	if (thpool_p->tracing && start){
+		trace_record(&thpool_p->caller, start, end, queued_ns, function_p);
+	}
+	pthread_mutex_unlock(&thpool_p->caller_lock);
+
+	if (group_p != NULL){
+		group_done(group_p);
+	}
+}
+
+
+/* Run a queued job on a waiting thread outside the pool
+ *
+ * Jobs are only taken along with their token, like thread_help() does.
+ * The caller counts as working meanwhile, so that other waiters don't
+ * return before the job has finished.
+ *
+ * @return 1 if a job ran, 0 if there was none to take
+ */
+static int thpool_help(thpool_* thpool_p){
+	if (__atomic_load_n(&thpool_p->on_hold, __ATOMIC_SEQ_CST) != THREADS_RUNNING){
+		return 0;
+	}
+
+	__atomic_add_fetch(&thpool_p->num_callers_working, 1, __ATOMIC_SEQ_CST);
+
+	job* job_p = NULL;
+	int n;
+	for (n=0; n<thpool_p->num_nodes && job_p == NULL; n++){
+		jobqueue* jobqueue_p = &thpool_p->nodes[n].jobqueue;
+		if (__atomic_load_n(&jobqueue_p->len, __ATOMIC_SEQ_CST) > 0 &&
+		    csem_trywait(jobqueue_p->has_jobs) == 0){
+			job_p = jobqueue_pull(jobqueue_p);
+			if (job_p == NULL){
+				csem_post(jobqueue_p->has_jobs, 1);
+			}
+		}
+	}
+	if (job_p != NULL){
+		thpool_run_caller(thpool_p, job_p);
+	}
+
+	if (__atomic_sub_fetch(&thpool_p->num_callers_working, 1, __ATOMIC_SEQ_CST) == 0){
+		thpool_idle(thpool_p);
+	}
+	return job_p != NULL;
+}
+
+
+/* Drop the jobs that haven't started yet
+ *
+ * Jobs are pulled from the queues and deques like any thread would, so
+ * threads may keep running meanwhile. Jobs that graphs and parallel loops
+ * add for themselves are queued again on the node they were taken from,
+ * as those wait for every one of them.
+ */
+int thpool_clear(thpool_* thpool_p, void (*destructor_p)(void*)){
+	int dropped = 0;
+	int n;
+
+	for (n=0; n<thpool_p->num_nodes; n++){
+		jobqueue* jobqueue_p = &thpool_p->nodes[n].jobqueue;
+		job* keep = NULL;
+		job** keep_rear = &keep;
+		job* job_p;
+		while ((job_p = jobqueue_pull(jobqueue_p)) != NULL){
+			/* Take its token too, or a thread wakes up for nothing */
+			csem_trywait(jobqueue_p->has_jobs);
+			if (thpool_drop(thpool_p, job_p, destructor_p) == 0){
+				dropped++;
+			}
+			else {
+				job_p->prev = NULL;
+				*keep_rear = job_p;
+				keep_rear = &job_p->prev;
+			}
+		}
+		thpool_requeue(jobqueue_p, keep);
+	}
+
+	threadtab* threadtab_p = __atomic_load_n(&thpool_p->threads, __ATOMIC_ACQUIRE);
+	for (n=0; n<threadtab_p->size; n++){
+		thread* thread_p = __atomic_load_n(&threadtab_p->slots[n], __ATOMIC_ACQUIRE);
+		if (thread_p == NULL || thread_p->deque == NULL) continue;
+
+		jobdeque* deque_p = thread_p->deque;
+		job* keep = NULL;
+		job** keep_rear = &keep;
+		while (__atomic_load_n(&deque_p->bottom, __ATOMIC_ACQUIRE) >
+		       __atomic_load_n(&deque_p->top, __ATOMIC_ACQUIRE)){
+			job* job_p = jobdeque_steal(deque_p);
+			if (job_p == NULL) continue;
+			if (thpool_drop(thpool_p, job_p, destructor_p) == 0){
+				dropped++;
+			}
+			else {
+				job_p->prev = NULL;
+				*keep_rear = job_p;
+				keep_rear = &job_p->prev;
+			}
+		}
+		thpool_requeue(&thread_p->node->jobqueue, keep);
+	}
+
+	/* Waiters may have been waiting only for the dropped jobs */
+	thpool_idle(thpool_p);
+	return dropped;
+}
+
+
+/* Queue the jobs a clear kept again, in order, on the node they came from */
+static void thpool_requeue(jobqueue* jobqueue_p, job* keep){
+	while (keep != NULL){
+		job* next = keep->prev;
+		jobqueue_push(jobqueue_p, keep);
+		keep = next;
+	}
+}
+
+
+/* Recycle a job that won't run
+ *
+ * The destructor gets the argument the user passed, the copy of
+ * thpool_add_work_copy() or the argument of thpool_submit().
+ *
+ * @return 0 if the job was dropped, -1 if it must run anyway
+ */
+static int thpool_drop(thpool_* thpool_p, job* job_p, void (*destructor_p)(void*)){
+	void (*function_p)(void*) = job_p->function;
+	void* arg_p = job_p->arg;
+
+	if (function_p == graph_run_node || function_p == parallel_run){
+		return -1;
+	}
+
+	if (function_p == future_run){
+		thpool_future_* future_p = (thpool_future_*)arg_p;
+		int state = FUTURE_QUEUED;
+		int queued = __atomic_compare_exchange_n(&future_p->state, &state, FUTURE_CANCELLED, 0,
+		                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		/* Cancelled now or by thpool_cancel(), this is the only job holding it */
+		if (destructor_p != NULL){
+			pthread_mutex_lock(&future_p->mutex);
+			if (__atomic_load_n(&future_p->state, __ATOMIC_SEQ_CST) == FUTURE_CANCELLED){
+				destructor_p(future_p->arg);
+			}
+			pthread_mutex_unlock(&future_p->mutex);
+		}
+		if (queued){
+			future_finish(future_p, NULL);
+		}
+		future_unref(future_p);
+	}
+	else if (function_p == thpool_run_copy){
+		jobcopy* copy = (jobcopy*)arg_p;
+		if (destructor_p != NULL) destructor_p(copy->data);
+		free(copy);
+	}
+	else if (destructor_p != NULL){
+		destructor_p(arg_p);
+	}
+
+	if (job_p->slot){
+		csem_post(&thpool_p->space, 1);
+	}
+	thpool_group_* group_p = job_p->group;
+	jobslab_free(&thpool_p->jobslab, thread_self(thpool_p), job_p);
+	if (group_p != NULL){
+		group_done(group_p);
+	}
+	return 0;
+}
+
+
+/* Destroy the threadpool */
+void thpool_destroy(thpool_* thpool_p){
+	/* No need to destroy if it's NULL */
+	if (thpool_p == NULL) return ;
+
+	/* End each thread 's infinite loop */
+	__atomic_store_n(&thpool_p->threads_keepalive, 0, __ATOMIC_SEQ_CST);
+	int n;
+
+	/* Wake up idle and paused threads, and blocked producers */
+	csem_close(&thpool_p->space);
+	for (n=0; n < thpool_p->num_nodes; n++){
+		csem_close(thpool_p->nodes[n].jobqueue.has_jobs);
+	}
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	pthread_cond_broadcast(&thpool_p->threads_resumed);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+
+	/* Wait for running jobs to finish and threads to exit */
+	pthread_mutex_lock(&thpool_p->grow_lock);
+	threadtab* threadtab_p = thpool_p->threads;
+	for (n=0; n < threadtab_p->size; n++){
+		if (threadtab_p->slots[n] != NULL && threadtab_p->slots[n]->joinable){
+			pthread_join(threadtab_p->slots[n]->pthread, NULL);
+		}
+	}
+	pthread_mutex_unlock(&thpool_p->grow_lock);
+
+	/* Dump what was traced */
+	if (thpool_p->trace_path != NULL && thpool_p->trace_epoch != 0){
+		thpool_trace_dump(thpool_p, thpool_p->trace_path);
+	}
+	free(thpool_p->trace_path);
+
+	/* Job queue cleanup */
+	topology_destroy(thpool_p);
+	/* Deallocs */
+	for (n=0; n < threadtab_p->size; n++){
+		if (threadtab_p->slots[n] != NULL){
+			thread_destroy(threadtab_p->slots[n]);
+		}
+	}
+	while (threadtab_p != NULL){
+		threadtab* old = threadtab_p->old;
+		free(threadtab_p);
+		threadtab_p = old;
+	}
+	jobslab_destroy(&thpool_p->jobslab);
+	future_destroy_all(thpool_p);
+	timerwheel_destroy(&thpool_p->timers);
+	free(thpool_p->cpus);
+	free(thpool_p->caller.trace);
+	pthread_mutex_destroy(&thpool_p->caller_lock);
+	pthread_mutex_destroy(&thpool_p->future_lock);
+	pthread_mutex_destroy(&thpool_p->hold_lock);
+	pthread_cond_destroy(&thpool_p->threads_resumed);
+	pthread_mutex_destroy(&thpool_p->thcount_lock);
+	pthread_mutex_destroy(&thpool_p->grow_lock);
+	pthread_cond_destroy(&thpool_p->threads_all_idle);
+	pthread_cond_destroy(&thpool_p->threads_all_alive);
+	free(thpool_p);
+}
+
+
+/* Change the number of threads */
+int thpool_resize(thpool_* thpool_p, int num_threads){
+	if (num_threads < 0){
+		err("thpool_resize(): Invalid number of threads\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&thpool_p->grow_lock);
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+
+	/* Elastic pools keep adapting around the new size */
+	if (thpool_p->threads_min == thpool_p->threads_max){
+		thpool_p->threads_min = num_threads;
+		thpool_p->threads_max = num_threads;
+	}
+	else {
+		if (num_threads < thpool_p->threads_min) thpool_p->threads_min = num_threads;
+		if (num_threads > thpool_p->threads_max) thpool_p->threads_max = num_threads;
+	}
+
+	/* Shrink: idle threads are woken up to retire, busy ones retire after their job */
+	int retire = thpool_p->num_threads - num_threads;
+	int n;
+	if (retire > 0){
+		thpool_p->num_threads -= retire;
+		for (; retire > 0; retire--){
+			numanode* node_p = thpool_retire_node(thpool_p);
+			if (node_p == NULL) break;
+			node_p->threads_retire++;
+			thpool_p->threads_retire++;
+			csem_post(node_p->jobqueue.has_jobs, 1);
+		}
+		pthread_mutex_unlock(&thpool_p->thcount_lock);
+		pthread_mutex_unlock(&thpool_p->grow_lock);
+		return 0;
+	}
+
+	/* Grow: call off pending retirements first, with their tokens */
+	int spawn = -retire;
+	int kept  = spawn < thpool_p->threads_retire ? spawn : thpool_p->threads_retire;
+	thpool_p->threads_retire -= kept;
+	for (n=0, retire=kept; n < thpool_p->num_nodes && retire > 0; n++){
+		int called_off = retire < thpool_p->nodes[n].threads_retire ? retire : thpool_p->nodes[n].threads_retire;
+		thpool_p->nodes[n].threads_retire -= called_off;
+		retire -= called_off;
+		while (called_off-- > 0){
+			csem_trywait(thpool_p->nodes[n].jobqueue.has_jobs);
+		}
+	}
+	thpool_p->num_threads    += spawn;
+	spawn -= kept;
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	int ret = 0;
+	for (; spawn > 0; spawn--){
+		if (thread_spawn(thpool_p) == -1){
+			err("thpool_resize(): Could not create threads\n");
+			pthread_mutex_lock(&thpool_p->thcount_lock);
+			thpool_p->num_threads -= spawn;
+			pthread_mutex_unlock(&thpool_p->thcount_lock);
+			ret = -1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&thpool_p->grow_lock);
+	return ret;
+}
+
+
+/* Node with the most threads not asked to retire yet, NULL if there are none
+ *
+ * The caller holds thcount_lock.
+ */
+static numanode* thpool_retire_node(thpool_* thpool_p){
+	numanode* node_p = NULL;
+	int most = 0;
+	int n;
+	for (n=0; n < thpool_p->num_nodes; n++){
+		int left = thpool_p->nodes[n].num_threads - thpool_p->nodes[n].threads_retire;
+		if (left > most){
+			most   = left;
+			node_p = &thpool_p->nodes[n];
+		}
+	}
+	return node_p;
+}
+
+
+/* Pause all threads in threadpool once their current job is done */
+void thpool_pause(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	__atomic_store_n(&thpool_p->on_hold, THREADS_PAUSED, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+
+/* Pause all threads in threadpool once the job queue is empty */
+void thpool_pause_drain(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	__atomic_store_n(&thpool_p->on_hold, THREADS_DRAINING, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&thpool_p->threads_resumed);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+
+	/* Nothing to drain -> pause right away */
+	if (thpool_queued(thpool_p) == 0){
+		int draining = THREADS_DRAINING;
+		__atomic_compare_exchange_n(&thpool_p->on_hold, &draining, THREADS_PAUSED, 0,
+		                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+/* Resume all threads in threadpool */
+void thpool_resume(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	__atomic_store_n(&thpool_p->on_hold, THREADS_RUNNING, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&thpool_p->threads_resumed);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+
+/* Add n jobs at once
+ *
+ * The jobs are allocated and linked in one go and then queued under a
+ * single lock acquisition.
+ *
+ * @param function_p    function of every job, or NULL to use functions_p
+ * @param functions_p   function of each job
+ * @param arg_p         argument of each job, or NULL for no arguments
+ * @return 0 on success, -1 otherwise.
+ */
+static int thpool_add_batch(thpool_* thpool_p, void (*function_p)(void*), void (**functions_p)(void*), void** arg_p, size_t n){
+	if (n == 0) return 0;
+
+	if (thpool_p->capacity != 0 && thread_self(thpool_p) == NULL){
+		return thpool_add_batch_bounded(thpool_p, function_p, functions_p, arg_p, n);
+	}
+	return thpool_queue_batch(thpool_p, function_p, functions_p, arg_p, n, 0);
+}
+
+
+/* Add a batch to a bounded queue in parts that fit
+ *
+ * With THPOOL_FULL_FAIL nothing is added unless the whole batch fits.
+ */
+static int thpool_add_batch_bounded(thpool_* thpool_p, void (*function_p)(void*), void (**functions_p)(void*), void** arg_p, size_t n){
+	size_t done = 0;
+	while (done < n){
+		size_t k = 0;
+		while (done + k < n && csem_trywait(&thpool_p->space) == 0){
+			k++;
+		}
+
+		if (done + k < n && thpool_p->full_policy == THPOOL_FULL_FAIL){
+			if (k > 0) csem_post(&thpool_p->space, (int)k);
+			errno = EAGAIN;
+			return -1;
+		}
+		if (k == 0 && thpool_p->full_policy == THPOOL_FULL_CALLER_RUNS){
+			(function_p ? function_p : functions_p[done])(arg_p ? arg_p[done] : NULL);
+			done++;
+			continue;
+		}
+		if (k == 0){
+			if (csem_timedwait(&thpool_p->space, -1) == -1) return -1;
+			k = 1;
+		}
+
+		if (thpool_queue_batch(thpool_p, function_p, functions_p ? functions_p + done : NULL,
+		                       arg_p ? arg_p + done : NULL, k, 1) == -1){
+			csem_post(&thpool_p->space, (int)k);
+			return -1;
+		}
+		done += k;
+	}
+	return 0;
+}
+
+
+/* Queue a batch of jobs
+ *
+ * @param slot          the jobs hold slots of the bounded queue
+ */
+static int thpool_queue_batch(thpool_* thpool_p, void (*function_p)(void*), void (**functions_p)(void*), void** arg_p, size_t n, int slot){
+	job* first;
+	thread* thread_p = thread_self(thpool_p);
+
+	if (jobslab_alloc_batch(&thpool_p->jobslab, thread_p, n, &first) == -1){
+		err("thpool_add_work_batch(): Could not allocate memory for new jobs\n");
+		return -1;
+	}
+
+	/* add functions and arguments */
+	unsigned long long now = thpool_stamp(thpool_p);
+#ifdef THPOOL_ENABLE_STATS
+	size_t added = n;
+#endif
+	job* job_p = first;
+	size_t i;
+	for (i=0; i<n; i++){
+		job_p->function = function_p ? function_p : functions_p[i];
+		job_p->arg      = arg_p ? arg_p[i] : NULL;
+		job_p->group    = NULL;
+		job_p->slot     = slot;
+		job_p->queued_ns = now;
+		job_p = job_p->prev;
+	}
+
+	/* add jobs to the deque of the calling thread if it is ours */
+	if (thpool_p->work_stealing && thread_p != NULL){
+		size_t pushed = 0;
+		long before = jobdeque_size(thread_p->deque);
+		while (pushed < n){
+			job_p = first->prev;
+			if (jobdeque_push(thread_p->deque, first) == -1) break;
+			first = job_p;
+			pushed++;
+		}
+		/* let an idle thread come and steal them, each thief wakes the next */
+		if (pushed > 0 && before == 0){
+			csem_post(thread_p->node->jobqueue.has_jobs, 1);
+		}
+		n -= pushed;
+#ifdef THPOOL_ENABLE_STATS
+		if (n == 0) stats_submit(thpool_p, thread_p, added);
+#endif
+		if (n == 0) return 0;
+	}
+
+	/* add jobs to queue */
+	numanode* node_p = thpool_node(thpool_p, thread_p);
+	jobqueue_push_batch(&node_p->jobqueue, first, n);
+#ifdef THPOOL_ENABLE_STATS
+	stats_submit(thpool_p, thread_p, added);
+#endif
+	thpool_wake_remote(thpool_p, node_p);
+	thpool_grow(thpool_p);
+
+	return 0;
+}
+
+
+/* Add a thread to an elastic pool if jobs pile up beyond what idle threads
+ * can take
+ *
+ * Threads that were woken but haven't been scheduled yet still count as
+ * idle, so a burst added faster than they start grows the pool too. Fixed
+ * size pools return at the first check. Spawning is skipped if another
+ * producer is spawning already.
+ */
+static void thpool_grow(thpool_* thpool_p){
+	int num_threads = thpool_p->num_threads;
+
+	if (num_threads >= thpool_p->threads_max) return;
+	if (num_threads > 0){
+		int idle = num_threads - thpool_p->num_threads_working;
+		if (thpool_queued(thpool_p) <= thpool_p->spawn_threshold + (idle > 0 ? idle : 0)) return;
+	}
+
+	if (pthread_mutex_trylock(&thpool_p->grow_lock) != 0) return;
+
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	int spawn = thpool_p->num_threads < thpool_p->threads_max && thpool_p->threads_keepalive;
+	if (spawn){
+		thpool_p->num_threads++;
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	if (spawn && thread_spawn(thpool_p) == -1){
+		pthread_mutex_lock(&thpool_p->thcount_lock);
+		thpool_p->num_threads--;
+		pthread_mutex_unlock(&thpool_p->thcount_lock);
+	}
+
+	pthread_mutex_unlock(&thpool_p->grow_lock);
+}
+
+
+/* Node to queue a job on: the caller's own */
+static numanode* thpool_node(thpool_* thpool_p, thread* thread_p){
+	if (thpool_p->num_nodes == 1){
+		return thpool_p->nodes;
+	}
+	if (thread_p != NULL){
+		return thread_p->node;
+	}
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned int cpu;
+	if (syscall(SYS_getcpu, &cpu, NULL, NULL) == 0 && cpu < THPOOL_MAX_CPUS && thpool_p->cpu_nodes[cpu] >= 0){
+		return &thpool_p->nodes[thpool_p->cpu_nodes[cpu]];
+	}
+#endif
+	return thpool_p->nodes;
+}
+
+
+/* Let an idle node steal if the node a job was queued on has no idle thread */
+static void thpool_wake_remote(thpool_* thpool_p, numanode* node_p){
+	if (thpool_p->num_nodes == 1) return;
+	if (__atomic_load_n(&node_p->jobqueue.has_jobs->sleepers, __ATOMIC_SEQ_CST) > 0) return;
+
+	int n;
+	for (n=0; n<thpool_p->num_nodes; n++){
+		csem* has_jobs = thpool_p->nodes[n].jobqueue.has_jobs;
+		if (&thpool_p->nodes[n] != node_p && __atomic_load_n(&has_jobs->sleepers, __ATOMIC_SEQ_CST) > 0){
+			csem_post(has_jobs, 1);
+			return;
+		}
+	}
+}
+
+
+/* Number of jobs queued on all nodes */
+static int thpool_queued(thpool_* thpool_p){
+	int queued = 0;
+	int n;
+	for (n=0; n<thpool_p->num_nodes; n++){
+		queued += __atomic_load_n(&thpool_p->nodes[n].jobqueue.len, __ATOMIC_SEQ_CST);
+	}
+	return queued;
+}
+
+
+/* Node the caller runs on */
+int thpool_current_node(thpool_* thpool_p){
+	thread* thread_p = thread_self(thpool_p);
+	if (thread_p == NULL && thpool_p->num_nodes > 1){
+#if defined(__linux__) && defined(SYS_getcpu)
+		unsigned int cpu;
+		if (syscall(SYS_getcpu, &cpu, NULL, NULL) == 0 && cpu < THPOOL_MAX_CPUS && thpool_p->cpu_nodes[cpu] >= 0){
+			return thpool_p->nodes[thpool_p->cpu_nodes[cpu]].id;
+		}
+#endif
+		return -1;
+	}
+	return thread_p != NULL ? thread_p->node->id : thpool_p->nodes[0].id;
+}
+
+
+int thpool_num_nodes(thpool_* thpool_p){
+	return thpool_p->num_nodes;
+}
+
+
+/* CPU a thread was assigned to */
+int thpool_thread_cpu(thpool_* thpool_p, int thread_id){
+	threadtab* threadtab_p = __atomic_load_n(&thpool_p->threads, __ATOMIC_ACQUIRE);
+	if (thread_id < 0 || thread_id >= threadtab_p->size){
+		return -1;
+	}
+	thread* thread_p = __atomic_load_n(&threadtab_p->slots[thread_id], __ATOMIC_ACQUIRE);
+	return thread_p != NULL ? thread_p->cpu : -1;
+}
+
+
+/* CPU the caller runs on */
+int thpool_current_cpu(thpool_* thpool_p){
+	thread* thread_p = thread_self(thpool_p);
+	if (thread_p != NULL && thread_p->pinned){
+		return thread_p->cpu;
+	}
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned int cpu;
+	if (syscall(SYS_getcpu, &cpu, NULL, NULL) == 0){
+		return (int)cpu;
+	}
+#endif
+	return -1;
+}
+
+
+int thpool_num_threads(thpool_* thpool_p){
+	return thpool_p->num_threads;
+}
+
+
+int thpool_num_threads_working(thpool_* thpool_p){
+	return thpool_p->num_threads_working;
+}
+
+
+size_t thpool_slab_high_water(thpool_* thpool_p){
+	return __atomic_load_n(&thpool_p->jobslab.high_water, __ATOMIC_RELAXED);
+}
+
+
+
+
+
+/* ============================ THREAD ============================== */
+
+
+/* Initialize a thread in the thread pool
+ *
+ * @param thread        address to the pointer of the thread to be created
+ * @param id            id to be given to the thread
+ * @return 0 on success, -1 otherwise.
+ */
+static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
+
+	thread* new_thread = (struct thread*)malloc(sizeof(struct thread));
+	if (new_thread == NULL){
+		err("thread_init(): Could not allocate memory for thread\n");
+		return -1;
+	}
+
+	new_thread->thpool_p = thpool_p;
+	new_thread->id       = id;
+	new_thread->seed     = (unsigned int)id * 2654435761u + 1;
+	new_thread->deque    = NULL;
+	new_thread->cache      = NULL;
+	new_thread->cache_last = NULL;
+	new_thread->cache_len  = 0;
+	new_thread->active     = 0;
+	new_thread->joinable   = 0;
+	new_thread->cpu        = thpool_p->num_cpus > 0 ? thpool_p->cpus[id % thpool_p->num_cpus] : -1;
+	new_thread->pinned     = 0;
+	new_thread->node       = &thpool_p->nodes[id % thpool_p->num_nodes];
+	new_thread->trace      = NULL;
+	new_thread->trace_head = 0;
+#ifdef THPOOL_ENABLE_STATS
+	memset(&new_thread->stats, 0, sizeof(new_thread->stats));
+#endif
+	if (new_thread->cpu >= 0 && new_thread->cpu < THPOOL_MAX_CPUS && thpool_p->cpu_nodes != NULL &&
+	    thpool_p->cpu_nodes[new_thread->cpu] >= 0){
+		new_thread->node = &thpool_p->nodes[thpool_p->cpu_nodes[new_thread->cpu]];
+	}
+
+	if (thpool_p->work_stealing){
+		new_thread->deque = jobdeque_init(thpool_p->deque_capacity);
+		if (new_thread->deque == NULL){
+			err("thread_init(): Could not allocate memory for deque\n");
+			free(new_thread);
+			return -1;
+		}
+	}
+
+	if (thread_start(new_thread) == -1){
+		jobdeque_destroy(new_thread->deque);
+		free(new_thread);
+		return -1;
+	}
+
+	/* Running threads may already look for victims to steal from */
+	__atomic_store_n(thread_p, new_thread, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* Start the pthread of a new or retired thread
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int thread_start(thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	thread_p->node->num_threads++;
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	__atomic_store_n(&thread_p->active, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&thread_p->pthread, NULL, (void * (*)(void *)) thread_do, thread_p) != 0){
+		err("thread_init(): Could not create thread\n");
+		__atomic_store_n(&thread_p->active, 0, __ATOMIC_RELEASE);
+		thread_p->joinable = 0;
+		pthread_mutex_lock(&thpool_p->thcount_lock);
+		thread_p->node->num_threads--;
+		pthread_mutex_unlock(&thpool_p->thcount_lock);
+		return -1;
+	}
+	thread_p->joinable = 1;
+	return 0;
+}
+
+
+/* Start one more thread
+ *
+ * The slot of a retired thread is reused if there is one, otherwise the
+ * table grows. The caller holds grow_lock.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int thread_spawn(thpool_* thpool_p){
+	threadtab* threadtab_p = thpool_p->threads;
+	int n;
+	for (n=0; n<threadtab_p->size; n++){
+		thread* thread_p = threadtab_p->slots[n];
+		if (thread_p == NULL){
+			break;
+		}
+		if (!__atomic_load_n(&thread_p->active, __ATOMIC_ACQUIRE)){
+			if (thread_p->joinable){
+				pthread_join(thread_p->pthread, NULL);
+				thread_p->joinable = 0;
+			}
+			return thread_start(thread_p);
+		}
+	}
+
+	if (n == threadtab_p->size){
+		threadtab_p = threadtab_grow(thpool_p);
+		if (threadtab_p == NULL){
+			return -1;
+		}
+	}
+	return thread_init(thpool_p, &threadtab_p->slots[n], n);
+}
+
+
+/* Decide if a thread retires
+ *
+ * A thread retires if the pool was shrunk and its node was picked to give
+ * up a thread, or if it was idle and the pool has more threads than its
+ * minimum.
+ *
+ * Shrinking posted a token for every thread to retire. One that retires
+ * without having taken a token takes one now, so none is left to wake a
+ * thread in vain.
+ *
+ * @param idle          whether the thread timed out waiting for work
+ * @param token         whether the thread took a token of its node
+ * @return 1 if the thread has to exit, 0 otherwise
+ */
+static int thread_retire(thread* thread_p, int idle, int token){
+	thpool_* thpool_p = thread_p->thpool_p;
+	int retire = 0;
+
+	if (!idle && !thpool_p->threads_retire) return 0;
+
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	if (thpool_p->threads_keepalive){
+		if (thread_p->node->threads_retire > 0){
+			thread_p->node->threads_retire--;
+			thpool_p->threads_retire--;
+			retire = 1;
+			if (!token){
+				csem_trywait(thread_p->node->jobqueue.has_jobs);
+			}
+		}
+		else if (idle && thpool_p->num_threads > thpool_p->threads_min){
+			thpool_p->num_threads--;
+			retire = 1;
+		}
+	}
+	if (retire){
+		thread_p->node->num_threads--;
+		__atomic_sub_fetch(&thpool_p->num_threads_alive, 1, __ATOMIC_SEQ_CST);
+		/* The slot may be reused (after joining) from now on */
+		__atomic_store_n(&thread_p->active, 0, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	return retire;
+}
+
+
+/* Copy the thread table into one twice as big
+ *
+ * The caller holds grow_lock.
+ */
+static threadtab* threadtab_grow(thpool_* thpool_p){
+	threadtab* old = thpool_p->threads;
+	threadtab* threadtab_p = (struct threadtab*)calloc(1, sizeof(struct threadtab) + 2 * old->size * sizeof(struct thread *));
+	if (threadtab_p == NULL){
+		err("threadtab_grow(): Could not allocate memory for threads\n");
+		return NULL;
+	}
+	threadtab_p->old  = old;
+	threadtab_p->size = 2 * old->size;
+	int n;
+	for (n=0; n<old->size; n++){
+		threadtab_p->slots[n] = old->slots[n];
+	}
+	__atomic_store_n(&thpool_p->threads, threadtab_p, __ATOMIC_RELEASE);
+	return threadtab_p;
+}
+
+
+/* Sets the calling thread on hold while the pool is paused
+ *
+ * If the pool is draining and drain is set, the pool gets paused once the
+ * job queue is empty.
+ *
+ * @param thread        calling thread
+ * @param drain         whether the thread is about to pull from the queue
+ */
+static void thread_hold(thread* thread_p, int drain) {
+	thpool_* thpool_p = thread_p->thpool_p;
+	int on_hold = __atomic_load_n(&thpool_p->on_hold, __ATOMIC_SEQ_CST);
+
+	if (on_hold == THREADS_RUNNING) return;
+
+	if (on_hold == THREADS_DRAINING){
+		if (!drain || !thread_drained(thread_p)) return;
+	}
+
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	while (thpool_p->on_hold == THREADS_PAUSED && thpool_p->threads_keepalive){
+		pthread_cond_wait(&thpool_p->threads_resumed, &thpool_p->hold_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+
+/* Pause a draining pool if its job queue is empty
+ *
+ * @return 1 if the pool is (now) paused, 0 otherwise
+ */
+static int thread_drained(thread* thread_p) {
+	thpool_* thpool_p = thread_p->thpool_p;
+	int on_hold = THREADS_DRAINING;
+
+	if (thpool_queued(thpool_p) == 0){
+		__atomic_compare_exchange_n(&thpool_p->on_hold, &on_hold, THREADS_PAUSED, 0,
+		                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+	return __atomic_load_n(&thpool_p->on_hold, __ATOMIC_SEQ_CST) == THREADS_PAUSED;
+}
+
+
+/* What each thread is doing
+*
+* In principle this is an endless loop. The only time this loop gets interrupted is once
+* thpool_destroy() is invoked or the program exits.
+*
+* @param  thread        thread that will run this function
+* @return nothing
+*/
+static void* thread_do(struct thread* thread_p){
+
+	/* Set thread name for profiling and debugging */
+	char thread_name[16] = {0};
+
+	snprintf(thread_name, 16, TOSTRING(THPOOL_THREAD_NAME) "-%d", thread_p->id);
+
+#if defined(__linux__)
+	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
+	prctl(PR_SET_NAME, thread_name);
+#elif defined(__APPLE__) && defined(__MACH__)
+	pthread_setname_np(thread_name);
+#elif defined(__FreeBSD__) || defined(__OpenBSD__)
+    pthread_set_name_np(thread_p->pthread, thread_name);
+#else
+	err("thread_do(): pthread_setname_np is not supported on this system");
+#endif
+
+	/* Assure all threads have been created before starting serving */
+	thpool_* thpool_p = thread_p->thpool_p;
+
+	pthread_setspecific(thread_key, thread_p);
+
+	if (thread_p->cpu >= 0 || thread_p->node->cpus != NULL){
+		thread_pin(thread_p);
+	}
+
+	/* Mark thread as alive (initialized) */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	__atomic_add_fetch(&thpool_p->num_threads_alive, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&thpool_p->threads_all_alive);
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	int retired = 0;
+	while(thpool_p->threads_keepalive){
+
+		/* Threads above the minimum wait for work only so long */
+		long long timeout_ns = -1;
+		if (thpool_p->num_threads > thpool_p->threads_min){
+			timeout_ns = (long long)thpool_p->idle_timeout * 1000000LL;
+		}
+		/* One thread sleeps only until the next timer is due */
+		timerwheel* wheel_p = &thpool_p->timers;
+		long long wait_ns = timeout_ns;
+		int keeper = 0;
+		if (__atomic_load_n(&wheel_p->count, __ATOMIC_ACQUIRE) > 0 &&
+		    __atomic_compare_exchange_n(&wheel_p->keeper, &keeper, thread_p->id + 1, 0,
+		                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+			keeper = 1;
+			unsigned long long due = __atomic_load_n(&wheel_p->due, __ATOMIC_ACQUIRE);
+			unsigned long long now = clock_now();
+			long long left = due > now ? (long long)(due - now) : 0;
+			if (due != ULLONG_MAX && (wait_ns < 0 || left < wait_ns)){
+				wait_ns = left;
+			}
+		}
+
+		jobqueue* jobqueue_p = &thread_p->node->jobqueue;
+		unsigned long long idle_since = thpool_stamp(thpool_p);
+		int remote = thread_remote_work(thread_p);
+		int waited = remote ? 0 : csem_timedwait(jobqueue_p->has_jobs, wait_ns);
+		int token  = waited == 0;
+		unsigned long long busy_since = thpool_stamp(thpool_p);
+
+		if (keeper){
+			int self = thread_p->id + 1;
+			__atomic_compare_exchange_n(&wheel_p->keeper, &self, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		}
+		timer_poll(thpool_p, keeper);
+#ifdef THPOOL_ENABLE_STATS
+		stats_add(&thread_p->stats.idle_ns, busy_since - idle_since);
+#endif
+		if (thpool_p->tracing && idle_since){
+			trace_record(thread_p, idle_since, busy_since, 0, NULL);
+		}
+
+		if (thread_retire(thread_p, waited == -1 && wait_ns == timeout_ns, token && !remote)){
+			retired = 1;
+			break;
+		}
+		if (!token) continue;
+
+		/* Paused threads keep their token until resumed */
+		thread_hold(thread_p, 1);
+
+		if (thpool_p->threads_keepalive){
+
+			__atomic_add_fetch(&thpool_p->num_threads_working, 1, __ATOMIC_SEQ_CST);
+
+			/* Read job from queue and execute it */
+			job* job_p = thread_pull(thread_p);
+			if (job_p != NULL && thpool_p->on_hold == THREADS_DRAINING){
+				/* Pulled the last job of a draining pool */
+				thread_drained(thread_p);
+			}
+			if (job_p == NULL && jobqueue_p->len > 0){
+				/* A job is still being pushed (ring), keep its token */
+				csem_post(jobqueue_p->has_jobs, 1);
+				sched_yield();
+			}
+#ifdef THPOOL_ENABLE_STATS
+			if (job_p == NULL){
+				stats_add(&thread_p->stats.empty_wakeups, 1);
+			}
+#endif
+			while (job_p) {
+				thread_run(thread_p, job_p);
+				timer_poll(thpool_p, 0);
+
+				/* Jobs the job added to our deque must run before we idle */
+				if (thread_p->deque){
+					thread_hold(thread_p, 0);
+					job_p = jobdeque_pop(thread_p->deque);
+				}
+				else {
+					job_p = NULL;
+				}
+			}
+#ifdef THPOOL_ENABLE_STATS
+			stats_add(&thread_p->stats.busy_ns, thpool_stamp(thpool_p) - busy_since);
+#endif
+
+			if (__atomic_sub_fetch(&thpool_p->num_threads_working, 1, __ATOMIC_SEQ_CST) == 0){
+				thpool_idle(thpool_p);
+			}
+
+		}
+	}
+	if (!retired){
+		__atomic_sub_fetch(&thpool_p->num_threads_alive, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+
+/* Pin the calling thread to its CPU, or else to the CPUs of its node
+ *
+ * Uses the raw syscall, the cpu_set_t macros would need _GNU_SOURCE.
+ */
+static void thread_pin(thread* thread_p){
+	thread_p->pinned = 0;
+#if defined(__linux__)
+	unsigned long mask[THPOOL_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+	int single = thread_p->cpu;
+	int* cpus = thread_p->cpu >= 0 ? &single : thread_p->node->cpus;
+	int num_cpus = thread_p->cpu >= 0 ? 1 : thread_p->node->num_cpus;
+	int n;
+	for (n=0; n<num_cpus; n++){
+		if (cpus[n] >= 0 && cpus[n] < THPOOL_MAX_CPUS){
+			mask[cpus[n] / (8 * sizeof(unsigned long))] |= 1UL << (cpus[n] % (8 * sizeof(unsigned long)));
+		}
+	}
+	if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0){
+		thread_p->pinned = thread_p->cpu >= 0;
+		return;
+	}
+#endif
+	err("thread_pin(): Could not pin thread to its CPU\n");
 }
 
 
 /* Frees a thread  */
 static void thread_destroy (thread* thread_p){
+	jobdeque_destroy(thread_p->deque);
+	free(thread_p->trace);
 	free(thread_p);
 }
 
 
+/* Create the key telling which thread of which pool runs the caller */
+static void thread_key_init(void){
+	pthread_key_create(&thread_key, NULL);
+	pthread_key_create(&future_key, NULL);
+}
+
+
+/* Get the calling thread if it belongs to the given pool
+ *
+ * @return the thread, or NULL if the caller is not a thread of thpool_p
+ */
+static struct thread* thread_self(thpool_* thpool_p){
+	thread* thread_p = (struct thread*)pthread_getspecific(thread_key);
+	if (thread_p != NULL && thread_p->thpool_p == thpool_p){
+		return thread_p;
+	}
+	return NULL;
+}
+
+
+/* Get the next job for an idle thread
+ *
+ * The job queue of the thread's node is tried first, then the deques of
+ * other threads and, if the node has no jobs queued, the queues of other
+ * nodes.
+ */
+static struct job* thread_pull(thread* thread_p){
+	job* job_p = jobqueue_pull(&thread_p->node->jobqueue);
+	if (job_p == NULL && thread_p->deque != NULL){
+		job_p = thread_steal(thread_p);
+	}
+	if (job_p == NULL && thread_p->thpool_p->num_nodes > 1 &&
+	    __atomic_load_n(&thread_p->node->jobqueue.len, __ATOMIC_RELAXED) == 0){
+		job_p = thread_pull_remote(thread_p);
+	}
+	return job_p;
+}
+
+
+/* Get a job queued on another node */
+static struct job* thread_pull_remote(thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	int first = (int)(thread_p->node - thpool_p->nodes);
+	int n;
+	for (n=1; n<thpool_p->num_nodes; n++){
+		jobqueue* jobqueue_p = &thpool_p->nodes[(first + n) % thpool_p->num_nodes].jobqueue;
+		if (__atomic_load_n(&jobqueue_p->len, __ATOMIC_SEQ_CST) > 0){
+			job* job_p = jobqueue_pull(jobqueue_p);
+			if (job_p != NULL){
+				return job_p;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+/* Tell if a thread about to sleep should rather steal from another node
+ *
+ * That is if its own node has no jobs queued and another node has jobs
+ * queued but all its threads busy.
+ */
+static int thread_remote_work(thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	if (thpool_p->num_nodes == 1 || __atomic_load_n(&thread_p->node->jobqueue.len, __ATOMIC_RELAXED) > 0){
+		return 0;
+	}
+	int n;
+	for (n=0; n<thpool_p->num_nodes; n++){
+		jobqueue* jobqueue_p = &thpool_p->nodes[n].jobqueue;
+		if (__atomic_load_n(&jobqueue_p->len, __ATOMIC_RELAXED) > 0 &&
+		    __atomic_load_n(&jobqueue_p->has_jobs->sleepers, __ATOMIC_SEQ_CST) == 0 &&
+		    &thpool_p->nodes[n] != thread_p->node){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Steal the oldest job of some other thread
+ *
+ * Victims are visited starting from a random one. If the victim has more
+ * jobs left, another idle thread is woken up to steal them.
+ */
+static struct job* thread_steal(thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	threadtab* threadtab_p = __atomic_load_n(&thpool_p->threads, __ATOMIC_ACQUIRE);
+	int num_threads = threadtab_p->size;
+
+	/* xorshift */
+	thread_p->seed ^= thread_p->seed << 13;
+	thread_p->seed ^= thread_p->seed >> 17;
+	thread_p->seed ^= thread_p->seed << 5;
+
+	int start = (int)(thread_p->seed % (unsigned int)num_threads);
+	int n;
+	for (n=0; n<num_threads; n++){
+		thread* victim = __atomic_load_n(&threadtab_p->slots[(start + n) % num_threads], __ATOMIC_ACQUIRE);
+		if (victim == NULL || victim == thread_p) continue;
+
+		job* job_p = jobdeque_steal(victim->deque);
+		if (job_p != NULL){
+			if (jobdeque_size(victim->deque) > 0){
+				csem_post(victim->node->jobqueue.has_jobs, 1);
+			}
+			return job_p;
+		}
+	}
+	return NULL;
+}
+
+
+
+
+
+/* Get a job for a thread waiting on a group
+ *
+ * Jobs of the thread's own deque come first. Jobs of the queue are only
+ * taken along with their token, so no idle thread is woken up for nothing.
+ *
+ * @return a job, or NULL if there is none or the pool is paused
+ */
+static struct job* thread_help(thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	job* job_p = NULL;
+
+	if (__atomic_load_n(&thpool_p->on_hold, __ATOMIC_SEQ_CST) == THREADS_PAUSED){
+		return NULL;
+	}
+
+	if (thread_p->deque != NULL){
+		job_p = jobdeque_pop(thread_p->deque);
+	}
+	if (job_p == NULL && csem_trywait(thread_p->node->jobqueue.has_jobs) == 0){
+		job_p = thread_pull(thread_p);
+		if (job_p == NULL){
+			csem_post(thread_p->node->jobqueue.has_jobs, 1);
+		}
+	}
+	if (job_p == NULL && thread_p->deque != NULL){
+		job_p = thread_steal(thread_p);
+	}
+	if (job_p != NULL && thpool_p->on_hold == THREADS_DRAINING){
+		thread_drained(thread_p);
+	}
+	return job_p;
+}
+
+
+/* Run a job and recycle it */
+static void thread_run(thread* thread_p, job* job_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	thpool_group_* group_p = job_p->group;
+	void (*function_p)(void*) = job_p->function;
+
+	/* The job left the queue, let a blocked producer add one */
+	if (job_p->slot){
+		csem_post(&thpool_p->space, 1);
+	}
+
+	unsigned long long start = thpool_stamp(thpool_p);
+	unsigned long long queued_ns = job_p->queued_ns;
+	job_p->function(job_p->arg);
+	jobslab_free(&thpool_p->jobslab, thread_p, job_p);
+	unsigned long long end = thpool_stamp(thpool_p);
+
+#ifdef THPOOL_ENABLE_STATS
+	stats_add(&thread_p->stats.wait_hist[stats_bucket(start - queued_ns)], 1);
+	stats_add(&thread_p->stats.run_hist[stats_bucket(end - start)], 1);
+	stats_add(&thread_p->stats.jobs, 1);
+#endif
+	if (thpool_p->tracing && start){
+		trace_record(thread_p, start, end, queued_ns, function_p);
+	}
+
+	if (group_p != NULL){
+		group_done(group_p);
+	}
+}
+
+
+
+
+
+/* ============================ GROUPS ============================== */
+
+
+/* Create a task group */
+struct thpool_group_* thpool_group_init(thpool_* thpool_p){
+	thpool_group_* group_p = (struct thpool_group_*)malloc(sizeof(struct thpool_group_));
+	if (group_p == NULL){
+		err("thpool_group_init(): Could not allocate memory for group\n");
+		return NULL;
+	}
+	group_init(group_p, thpool_p);
+	return group_p;
+}
+
+
+static void group_init(thpool_group_* group_p, thpool_* thpool_p){
+	group_p->thpool_p = thpool_p;
+	group_p->pending  = 0;
+	pthread_mutex_init(&group_p->mutex, NULL);
+	pthread_cond_init(&group_p->cond, NULL);
+}
+
+
+/* Add work to the thread pool as part of a group */
+int thpool_group_add_work(thpool_group_* group_p, void (*function_p)(void*), void* arg_p){
+	__atomic_add_fetch(&group_p->pending, 1, __ATOMIC_SEQ_CST);
+	if (thpool_add_job(group_p->thpool_p, function_p, arg_p, group_p) == -1){
+		group_done(group_p);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Wait until all jobs of a group have finished
+ *
+ * A thread of the pool runs other jobs meanwhile instead of blocking, so
+ * jobs may wait for groups of their own without running out of threads.
+ * When there is nothing left to run, the group's jobs are running on other
+ * threads and may still add jobs, so it checks for work every millisecond.
+ *
+ * Jobs run this way nest on the thread's stack. With work stealing the
+ * thread's own (newest) jobs come first, which keeps the nesting close to
+ * the depth of the fork-join tree. The shared queue hands out the oldest
+ * jobs first, so without it the nesting can grow with the number of queued
+ * jobs.
+ */
+void thpool_group_wait(thpool_group_* group_p){
+	thread* thread_p = thread_self(group_p->thpool_p);
+
+	while (__atomic_load_n(&group_p->pending, __ATOMIC_ACQUIRE) > 0){
+
+		if (thread_p != NULL){
+			job* job_p = thread_help(thread_p);
+			if (job_p != NULL){
+				thread_run(thread_p, job_p);
+				continue;
+			}
+		}
+
+		pthread_mutex_lock(&group_p->mutex);
+		if (thread_p == NULL){
+			while (__atomic_load_n(&group_p->pending, __ATOMIC_ACQUIRE) > 0){
+				pthread_cond_wait(&group_p->cond, &group_p->mutex);
+			}
+		}
+		else if (__atomic_load_n(&group_p->pending, __ATOMIC_ACQUIRE) > 0){
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += 1000000L;
+			if (deadline.tv_nsec >= 1000000000L){
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&group_p->cond, &group_p->mutex, &deadline);
+		}
+		pthread_mutex_unlock(&group_p->mutex);
+	}
+}
+
+
+/* Destroy a task group */
+void thpool_group_destroy(thpool_group_* group_p){
+	if (group_p == NULL) return;
+
+	/* The last job may still be about to unlock */
+	pthread_mutex_lock(&group_p->mutex);
+	pthread_mutex_unlock(&group_p->mutex);
+
+	pthread_mutex_destroy(&group_p->mutex);
+	pthread_cond_destroy(&group_p->cond);
+	free(group_p);
+}
+
+
+/* Count a job of the group as finished */
+static void group_done(thpool_group_* group_p){
+	int pending = __atomic_load_n(&group_p->pending, __ATOMIC_RELAXED);
+	while (pending > 1){
+		if (__atomic_compare_exchange_n(&group_p->pending, &pending, pending - 1, 1,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+			return;
+		}
+	}
+
+	/* Last job, wake up the waiters */
+	pthread_mutex_lock(&group_p->mutex);
+	__atomic_sub_fetch(&group_p->pending, 1, __ATOMIC_ACQ_REL);
+	pthread_cond_broadcast(&group_p->cond);
+	pthread_mutex_unlock(&group_p->mutex);
+}
+
+
+
+
+
+/* ========================== TASK GRAPHS =========================== */
+
+
+/* Create an empty task graph */
+struct thpool_graph_* thpool_graph_init(thpool_* thpool_p){
+	thpool_graph_* graph_p = (struct thpool_graph_*)malloc(sizeof(struct thpool_graph_));
+	if (graph_p == NULL){
+		err("thpool_graph_init(): Could not allocate memory for graph\n");
+		return NULL;
+	}
+	graph_p->thpool_p  = thpool_p;
+	graph_p->nodes     = NULL;
+	graph_p->order     = NULL;
+	graph_p->num_nodes = 0;
+	graph_p->cap_nodes = 0;
+	graph_p->checked   = 1;
+	group_init(&graph_p->group, thpool_p);
+	return graph_p;
+}
+
+
+/* Add a job to a graph, returns its node id */
+int thpool_graph_add_node(thpool_graph_* graph_p, void (*function_p)(void*), void* arg_p){
+	if (graph_p->num_nodes == graph_p->cap_nodes){
+		int cap = graph_p->cap_nodes ? 2 * graph_p->cap_nodes : 16;
+		graphnode* nodes = (graphnode*)realloc(graph_p->nodes, cap * sizeof(graphnode));
+		if (nodes == NULL){
+			err("thpool_graph_add_node(): Could not allocate memory for node\n");
+			return -1;
+		}
+		graph_p->nodes = nodes;
+		int* order = (int*)realloc(graph_p->order, cap * sizeof(int));
+		if (order == NULL){
+			err("thpool_graph_add_node(): Could not allocate memory for node\n");
+			return -1;
+		}
+		graph_p->order = order;
+		graph_p->cap_nodes = cap;
+	}
+
+	graphnode* node_p = &graph_p->nodes[graph_p->num_nodes];
+	node_p->function  = function_p;
+	node_p->arg       = arg_p;
+	node_p->graph_p   = graph_p;
+	node_p->succs     = NULL;
+	node_p->num_succs = 0;
+	node_p->cap_succs = 0;
+	node_p->preds     = 0;
+	node_p->pending   = 0;
+	return graph_p->num_nodes++;
+}
+
+
+/* Make node to wait for node from */
+int thpool_graph_add_edge(thpool_graph_* graph_p, int from, int to){
+	if (from < 0 || from >= graph_p->num_nodes || to < 0 || to >= graph_p->num_nodes){
+		err("thpool_graph_add_edge(): Invalid node\n");
+		return -1;
+	}
+
+	graphnode* node_p = &graph_p->nodes[from];
+	if (node_p->num_succs == node_p->cap_succs){
+		int cap = node_p->cap_succs ? 2 * node_p->cap_succs : 4;
+		int* succs = (int*)realloc(node_p->succs, cap * sizeof(int));
+		if (succs == NULL){
+			err("thpool_graph_add_edge(): Could not allocate memory for edge\n");
+			return -1;
+		}
+		node_p->succs = succs;
+		node_p->cap_succs = cap;
+	}
+	node_p->succs[node_p->num_succs++] = to;
+	graph_p->nodes[to].preds++;
+	graph_p->checked = 0;
+	return 0;
+}
+
+
+/* Queue the nodes of a graph without predecessors */
+int thpool_graph_run(thpool_graph_* graph_p){
+	if (__atomic_load_n(&graph_p->group.pending, __ATOMIC_ACQUIRE) > 0){
+		err("thpool_graph_run(): Graph is still running\n");
+		return -1;
+	}
+	if (!graph_p->checked){
+		if (!graph_acyclic(graph_p)){
+			err("thpool_graph_run(): Graph has a cycle\n");
+			return -1;
+		}
+		graph_p->checked = 1;
+	}
+	if (graph_p->num_nodes == 0){
+		return 0;
+	}
+
+	int n;
+	for (n=0; n<graph_p->num_nodes; n++){
+		graph_p->nodes[n].pending = graph_p->nodes[n].preds;
+	}
+	__atomic_store_n(&graph_p->group.pending, graph_p->num_nodes, __ATOMIC_RELEASE);
+
+	for (n=0; n<graph_p->num_nodes; n++){
+		graphnode* node_p = &graph_p->nodes[n];
+		if (node_p->preds == 0 &&
+		    thpool_add_job(graph_p->thpool_p, graph_run_node, node_p, &graph_p->group) == -1){
+			/* Run it here rather than never */
+			graph_run_node(node_p);
+			group_done(&graph_p->group);
+		}
+	}
+	return 0;
+}
+
+
+/* Wait until every node of the last run has finished */
+void thpool_graph_wait(thpool_graph_* graph_p){
+	thpool_group_wait(&graph_p->group);
+}
+
+
+/* Destroy a task graph */
+void thpool_graph_destroy(thpool_graph_* graph_p){
+	if (graph_p == NULL) return;
+
+	/* The last node may still be about to unlock */
+	pthread_mutex_lock(&graph_p->group.mutex);
+	pthread_mutex_unlock(&graph_p->group.mutex);
+
+	int n;
+	for (n=0; n<graph_p->num_nodes; n++){
+		free(graph_p->nodes[n].succs);
+	}
+	pthread_mutex_destroy(&graph_p->group.mutex);
+	pthread_cond_destroy(&graph_p->group.cond);
+	free(graph_p->nodes);
+	free(graph_p->order);
+	free(graph_p);
+}
+
+
+/* Tell if every node can run, i.e. a topological order exists (Kahn) */
+static int graph_acyclic(thpool_graph_* graph_p){
+	int head = 0, tail = 0;
+	int n, s;
+	for (n=0; n<graph_p->num_nodes; n++){
+		graph_p->nodes[n].pending = graph_p->nodes[n].preds;
+		if (graph_p->nodes[n].preds == 0){
+			graph_p->order[tail++] = n;
+		}
+	}
+	while (head < tail){
+		graphnode* node_p = &graph_p->nodes[graph_p->order[head++]];
+		for (s=0; s<node_p->num_succs; s++){
+			if (--graph_p->nodes[node_p->succs[s]].pending == 0){
+				graph_p->order[tail++] = node_p->succs[s];
+			}
+		}
+	}
+	return tail == graph_p->num_nodes;
+}
+
+
+/* Run a node and queue the successors it was the last predecessor of */
+static void graph_run_node(void* arg){
+	graphnode* node_p = (graphnode*)arg;
+	thpool_graph_* graph_p = node_p->graph_p;
+
+	node_p->function(node_p->arg);
+
+	int s;
+	for (s=0; s<node_p->num_succs; s++){
+		graphnode* succ_p = &graph_p->nodes[node_p->succs[s]];
+		if (__atomic_sub_fetch(&succ_p->pending, 1, __ATOMIC_ACQ_REL) == 0 &&
+		    thpool_add_job(graph_p->thpool_p, graph_run_node, succ_p, &graph_p->group) == -1){
+			graph_run_node(succ_p);
+			group_done(&graph_p->group);
+		}
+	}
+}
+
+
+
+
+
+/* ========================= PARALLEL LOOPS ========================= */
+
+
+/* Run function_p over [begin, end) in chunks on the pool and the caller */
+int thpool_parallel_for(thpool_* thpool_p, long begin, long end, long grain, int schedule,
+                        void (*function_p)(long, long, void*), void* ctx){
+	if (function_p == NULL){
+		err("thpool_parallel_for(): No function given\n");
+		return -1;
+	}
+
+	parallel_loop loop;
+	loop.begin      = begin;
+	loop.end        = end;
+	loop.grain      = grain;
+	loop.schedule   = schedule;
+	loop.parts      = 0;
+	loop.function_p = NULL;
+	loop.for_p      = function_p;
+	loop.ctx        = ctx;
+	loop.partials   = NULL;
+	loop.size       = 0;
+
+	parallel_run_loop(thpool_p, &loop);
+	return 0;
+}
+
+
+/* Reduce [begin, end) with one partial result per participant */
+int thpool_parallel_reduce(thpool_* thpool_p, long begin, long end, long grain, int schedule,
+                           void (*function_p)(long, long, void*, void*),
+                           void (*combine_p)(void*, const void*, void*),
+                           void* ctx, void* result, size_t size){
+	if (function_p == NULL || combine_p == NULL || result == NULL){
+		err("thpool_parallel_reduce(): Missing function or result\n");
+		return -1;
+	}
+
+	parallel_loop loop;
+	loop.begin      = begin;
+	loop.end        = end;
+	loop.grain      = grain;
+	loop.schedule   = schedule;
+	loop.function_p = function_p;
+	loop.for_p      = NULL;
+	loop.ctx        = ctx;
+	loop.size       = size;
+
+	/* One allocation per call, partials start as the identity in result */
+	int parts = thpool_p->num_threads + 1;
+	loop.parts    = parts;
+	loop.partials = (char*)malloc((size_t)parts * size);
+	if (loop.partials == NULL){
+		err("thpool_parallel_reduce(): Could not allocate memory for partial results\n");
+		return -1;
+	}
+	int n;
+	for (n=0; n<parts; n++){
+		memcpy(loop.partials + (size_t)n * size, result, size);
+	}
+
+	int ran = parallel_run_loop(thpool_p, &loop);
+	for (n=0; n<ran; n++){
+		combine_p(result, loop.partials + (size_t)n * size, ctx);
+	}
+	free(loop.partials);
+	return 0;
+}
+
+
+/* Spread a loop over helper jobs and the caller, then wait for it
+ *
+ * The number of participants is fixed before any helper starts so static
+ * schedules can split the range by id, and is at most loop_p->parts if
+ * that is set. Helpers that can't be queued are run by the caller.
+ *
+ * @return the number of participants
+ */
+static int parallel_run_loop(thpool_* thpool_p, parallel_loop* loop_p){
+	long count = loop_p->end > loop_p->begin ? loop_p->end - loop_p->begin : 0;
+	int  parts = thpool_p->num_threads;
+	if (thread_self(thpool_p) == NULL || parts < 1){
+		parts++;
+	}
+	if (loop_p->parts > 0 && parts > loop_p->parts){
+		parts = loop_p->parts;
+	}
+
+	/* Default grain leaves a few chunks per participant to balance */
+	if (loop_p->grain <= 0){
+		loop_p->grain = count / ((long)parts * 8);
+		if (loop_p->schedule == THPOOL_SCHEDULE_STATIC){
+			loop_p->grain = (count + parts - 1) / parts;
+		}
+		if (loop_p->grain < 1) loop_p->grain = 1;
+	}
+	long chunks = (count + loop_p->grain - 1) / loop_p->grain;
+	if (chunks < parts){
+		parts = chunks > 0 ? (int)chunks : 1;
+	}
+
+	loop_p->parts = parts;
+	loop_p->ids   = 0;
+	loop_p->next  = loop_p->begin;
+
+	thpool_group_ group;
+	group_init(&group, thpool_p);
+
+	int helpers = 0;
+	int n;
+	for (n=1; n<parts; n++){
+		__atomic_add_fetch(&group.pending, 1, __ATOMIC_SEQ_CST);
+		if (thpool_add_job(thpool_p, parallel_run, loop_p, &group) == -1){
+			group_done(&group);
+			break;
+		}
+		helpers++;
+	}
+
+	/* The caller joins in, and stands in for helpers that weren't added */
+	for (n=helpers; n<parts; n++){
+		parallel_run(loop_p);
+	}
+
+	thpool_group_wait(&group);
+	pthread_mutex_lock(&group.mutex);
+	pthread_mutex_unlock(&group.mutex);
+	pthread_mutex_destroy(&group.mutex);
+	pthread_cond_destroy(&group.cond);
+	return parts;
+}
+
+
+/* Claim and run chunks as one participant of a loop */
+static void parallel_run(void* arg){
+	parallel_loop* loop_p = (parallel_loop*)arg;
+	int id = __atomic_fetch_add(&loop_p->ids, 1, __ATOMIC_RELAXED);
+	void* partial = loop_p->partials ? loop_p->partials + (size_t)id * loop_p->size : NULL;
+
+	long begin, end, k;
+	for (k=0; parallel_claim(loop_p, id, k, &begin, &end); k++){
+		if (loop_p->for_p != NULL)
+			loop_p->for_p(begin, end, loop_p->ctx);
+		else
+			loop_p->function_p(begin, end, loop_p->ctx, partial);
+	}
+}
+
+
+/* Find the k-th chunk of participant id
+ *
+ * Static chunks go round-robin by id. Dynamic chunks of grain indices and
+ * guided chunks of a share of what is left (but at least grain) are taken
+ * from the shared index.
+ *
+ * @return 1 if a chunk was claimed, 0 if the range is done
+ */
+static int parallel_claim(parallel_loop* loop_p, int id, long k, long* begin_p, long* end_p){
+	long begin, size = loop_p->grain;
+
+	switch (loop_p->schedule){
+	case THPOOL_SCHEDULE_STATIC:
+		if ((loop_p->end - loop_p->begin) / size < id + k * loop_p->parts){
+			return 0;
+		}
+		begin = loop_p->begin + (id + k * loop_p->parts) * size;
+		break;
+
+	case THPOOL_SCHEDULE_GUIDED:
+		begin = __atomic_load_n(&loop_p->next, __ATOMIC_RELAXED);
+		do {
+			if (begin >= loop_p->end){
+				return 0;
+			}
+			size = (loop_p->end - begin) / (2 * loop_p->parts);
+			if (size < loop_p->grain) size = loop_p->grain;
+		} while (!__atomic_compare_exchange_n(&loop_p->next, &begin, begin + size, 1,
+		                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		break;
+
+	default:
+		begin = __atomic_fetch_add(&loop_p->next, size, __ATOMIC_RELAXED);
+		break;
+	}
+
+	if (begin >= loop_p->end){
+		return 0;
+	}
+	*begin_p = begin;
+	*end_p   = loop_p->end - begin > size ? begin + size : loop_p->end;
+	return 1;
+}
+
+
+
+
+
+/* ============================= TIMERS ============================= */
+
+
+/* Add work that runs once after a delay */
+thpool_timer thpool_add_work_after(thpool_* thpool_p, unsigned long long delay_ns, void (*function_p)(void*), void* arg_p){
+	return timer_add(thpool_p, delay_ns, 0, function_p, arg_p);
+}
+
+
+/* Add work that runs every period */
+thpool_timer thpool_add_work_every(thpool_* thpool_p, unsigned long long period_ns, void (*function_p)(void*), void* arg_p){
+	if (period_ns == 0){
+		err("thpool_add_work_every(): Period must not be 0\n");
+		return 0;
+	}
+	return timer_add(thpool_p, period_ns, period_ns, function_p, arg_p);
+}
+
+
+/* Stop a timer from adding its job */
+int thpool_timer_cancel(thpool_* thpool_p, thpool_timer timer_id){
+	timerwheel* wheel_p = &thpool_p->timers;
+	int index = (int)(timer_id & 0xffffffffULL) - 1;
+	unsigned int gen = (unsigned int)(timer_id >> 32);
+	int ret = -1;
+
+	pthread_mutex_lock(&wheel_p->lock);
+	if (index >= 0 && index < wheel_p->cap &&
+	    wheel_p->timers[index].gen == gen && wheel_p->timers[index].list != -1){
+		timer_unlink(wheel_p, index);
+		timer_release(wheel_p, index);
+		timer_update_due(wheel_p);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&wheel_p->lock);
+	return ret;
+}
+
+
+static void timerwheel_init(timerwheel* wheel_p){
+	pthread_mutex_init(&wheel_p->lock, NULL);
+	wheel_p->timers = NULL;
+	wheel_p->cap    = 0;
+	wheel_p->free   = -1;
+	int n;
+	for (n=0; n<THPOOL_TIMER_LEVELS * THPOOL_TIMER_SLOTS; n++){
+		wheel_p->heads[n] = -1;
+	}
+	for (n=0; n<THPOOL_TIMER_LEVELS; n++){
+		wheel_p->busy[n] = 0;
+	}
+	wheel_p->tick   = 0;
+	wheel_p->epoch  = clock_now();
+	wheel_p->count  = 0;
+	wheel_p->due    = ULLONG_MAX;
+	wheel_p->keeper = 0;
+}
+
+
+static void timerwheel_destroy(timerwheel* wheel_p){
+	free(wheel_p->timers);
+	pthread_mutex_destroy(&wheel_p->lock);
+}
+
+
+/* Add a timer and wake a thread to sleep until it if it is due first
+ *
+ * @return handle of the timer, 0 on error
+ */
+static thpool_timer timer_add(thpool_* thpool_p, unsigned long long delay_ns, unsigned long long period_ns,
+                              void (*function_p)(void*), void* arg_p){
+	timerwheel* wheel_p = &thpool_p->timers;
+	unsigned long long now = clock_now();
+
+	pthread_mutex_lock(&wheel_p->lock);
+	if (wheel_p->free == -1){
+		int cap = wheel_p->cap ? wheel_p->cap * 2 : 64;
+		timer* timers = (struct timer*)realloc(wheel_p->timers, cap * sizeof(struct timer));
+		if (timers == NULL){
+			pthread_mutex_unlock(&wheel_p->lock);
+			err("thpool_add_work_after(): Could not allocate memory for new timer\n");
+			return 0;
+		}
+		int n;
+		for (n=wheel_p->cap; n<cap; n++){
+			timers[n].gen  = 0;
+			timers[n].list = -1;
+			timers[n].next = n + 1 < cap ? n + 1 : -1;
+		}
+		wheel_p->timers = timers;
+		wheel_p->free   = wheel_p->cap;
+		wheel_p->cap    = cap;
+	}
+	int index = wheel_p->free;
+	timer* timer_p = &wheel_p->timers[index];
+	wheel_p->free = timer_p->next;
+
+	/* Round up to whole ticks, so it never runs early. Far delays saturate,
+	 * a sum that wraps around would fire right away */
+	unsigned long long at = now - wheel_p->epoch;
+	at = delay_ns < ULLONG_MAX - THPOOL_TIMER_TICK - at ? at + delay_ns : ULLONG_MAX - THPOOL_TIMER_TICK;
+	timer_p->function = function_p;
+	timer_p->arg      = arg_p;
+	timer_p->expiry   = (at + THPOOL_TIMER_TICK - 1) / THPOOL_TIMER_TICK;
+	timer_p->period   = period_ns / THPOOL_TIMER_TICK + (period_ns % THPOOL_TIMER_TICK != 0);
+	if (timer_p->expiry <= wheel_p->tick){
+		timer_p->expiry = wheel_p->tick + 1;
+	}
+	timer_insert(wheel_p, index);
+	__atomic_add_fetch(&wheel_p->count, 1, __ATOMIC_RELEASE);
+
+	unsigned long long due = wheel_p->due;
+	timer_update_due(wheel_p);
+	int sooner = wheel_p->due < due;
+	thpool_timer timer_id = ((thpool_timer)timer_p->gen << 32) | (thpool_timer)(index + 1);
+	pthread_mutex_unlock(&wheel_p->lock);
+
+	/* The thread sleeping until due may sleep too long now, let another
+	 * one take over (or the same one, if it is the one woken). The kick
+	 * leaves no token behind that a thread would wake up for in vain */
+	if (sooner){
+		__atomic_store_n(&wheel_p->keeper, 0, __ATOMIC_SEQ_CST);
+		csem* has_jobs = thpool_node(thpool_p, thread_self(thpool_p))->jobqueue.has_jobs;
+		int n;
+		for (n=0; n < thpool_p->num_nodes; n++){
+			if (__atomic_load_n(&thpool_p->nodes[n].jobqueue.has_jobs->sleepers, __ATOMIC_SEQ_CST) > 0){
+				has_jobs = thpool_p->nodes[n].jobqueue.has_jobs;
+				break;
+			}
+		}
+		csem_kick(has_jobs);
+	}
+	return timer_id;
+}
+
+
+/* Link a timer into the slot its expiry falls in */
+static void timer_insert(timerwheel* wheel_p, int index){
+	timer* timer_p = &wheel_p->timers[index];
+	unsigned long long delta  = timer_p->expiry - wheel_p->tick;
+	unsigned long long expiry = timer_p->expiry;
+
+	int level = 0;
+	while (level < THPOOL_TIMER_LEVELS - 1 && delta >> (THPOOL_TIMER_BITS * (level + 1))){
+		level++;
+	}
+	/* Beyond the top level, come back when its last slot comes round */
+	if (delta >> (THPOOL_TIMER_BITS * THPOOL_TIMER_LEVELS)){
+		expiry = wheel_p->tick + (1ULL << (THPOOL_TIMER_BITS * THPOOL_TIMER_LEVELS)) - 1;
+	}
+	int slot = (int)(expiry >> (THPOOL_TIMER_BITS * level)) & (THPOOL_TIMER_SLOTS - 1);
+	int list = level * THPOOL_TIMER_SLOTS + slot;
+
+	timer_p->list = list;
+	timer_p->prev = -1;
+	timer_p->next = wheel_p->heads[list];
+	if (timer_p->next != -1){
+		wheel_p->timers[timer_p->next].prev = index;
+	}
+	wheel_p->heads[list] = index;
+	wheel_p->busy[level] |= 1ULL << slot;
+}
+
+
+/* Take a timer out of its slot */
+static void timer_unlink(timerwheel* wheel_p, int index){
+	timer* timer_p = &wheel_p->timers[index];
+	int list = timer_p->list;
+
+	if (timer_p->prev != -1){
+		wheel_p->timers[timer_p->prev].next = timer_p->next;
+	}
+	else {
+		wheel_p->heads[list] = timer_p->next;
+	}
+	if (timer_p->next != -1){
+		wheel_p->timers[timer_p->next].prev = timer_p->prev;
+	}
+	if (wheel_p->heads[list] == -1){
+		wheel_p->busy[list / THPOOL_TIMER_SLOTS] &= ~(1ULL << (list % THPOOL_TIMER_SLOTS));
+	}
+	timer_p->list = -1;
+}
+
+
+/* Put an unlinked timer on the free list, its handle goes stale */
+static void timer_release(timerwheel* wheel_p, int index){
+	timer* timer_p = &wheel_p->timers[index];
+	timer_p->gen++;
+	timer_p->list = -1;
+	timer_p->next = wheel_p->free;
+	wheel_p->free = index;
+	__atomic_sub_fetch(&wheel_p->count, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Next tick at which a timer expires or a slot is cascaded
+ *
+ * @return the tick, ULLONG_MAX if there are no timers
+ */
+static unsigned long long timer_next(timerwheel* wheel_p){
+	unsigned long long next = ULLONG_MAX;
+	int level;
+	for (level=0; level<THPOOL_TIMER_LEVELS; level++){
+		unsigned long long busy = wheel_p->busy[level];
+		if (busy == 0) continue;
+
+		/* Rotate so that bit 0 is the slot after the current one */
+		int shift = THPOOL_TIMER_BITS * level;
+		unsigned long long pos = wheel_p->tick >> shift;
+		int from = (int)(pos + 1) & (THPOOL_TIMER_SLOTS - 1);
+		if (from){
+			busy = (busy >> from) | (busy << (THPOOL_TIMER_SLOTS - from));
+		}
+		unsigned long long tick = (pos + __builtin_ctzll(busy) + 1) << shift;
+		if (tick < next){
+			next = tick;
+		}
+	}
+	return next;
+}
+
+
+/* Publish when the next tick is due, for threads to check without lock */
+static void timer_update_due(timerwheel* wheel_p){
+	unsigned long long next = timer_next(wheel_p);
+	__atomic_store_n(&wheel_p->due,
+	                 next == ULLONG_MAX ? ULLONG_MAX : wheel_p->epoch + next * THPOOL_TIMER_TICK,
+	                 __ATOMIC_RELEASE);
+}
+
+
+/* Do all ticks up to target, skipping those with nothing to do */
+static void timer_advance(thpool_* thpool_p, unsigned long long target){
+	timerwheel* wheel_p = &thpool_p->timers;
+	for (;;){
+		unsigned long long next = timer_next(wheel_p);
+		if (next > target) break;
+		wheel_p->tick = next;
+		timer_expire(thpool_p, next);
+	}
+	if (target > wheel_p->tick){
+		wheel_p->tick = target;
+	}
+}
+
+
+/* Cascade the slots that come round at tick, then fire what expired */
+static void timer_expire(thpool_* thpool_p, unsigned long long tick){
+	timerwheel* wheel_p = &thpool_p->timers;
+	int level;
+	for (level=THPOOL_TIMER_LEVELS - 1; level>=0; level--){
+		int shift = THPOOL_TIMER_BITS * level;
+		if (tick & ((1ULL << shift) - 1)) continue;
+
+		int slot  = (int)(tick >> shift) & (THPOOL_TIMER_SLOTS - 1);
+		int list  = level * THPOOL_TIMER_SLOTS + slot;
+		int index = wheel_p->heads[list];
+		wheel_p->heads[list] = -1;
+		wheel_p->busy[level] &= ~(1ULL << slot);
+
+		while (index != -1){
+			int next = wheel_p->timers[index].next;
+			if (wheel_p->timers[index].expiry <= tick){
+				timer_fire(thpool_p, index);
+			}
+			else {
+				timer_insert(wheel_p, index);
+			}
+			index = next;
+		}
+	}
+}
+
+
+/* Add the job of an expired timer, and queue it again if periodic */
+static void timer_fire(thpool_* thpool_p, int index){
+	timerwheel* wheel_p = &thpool_p->timers;
+	timer* timer_p = &wheel_p->timers[index];
+	void (*function_p)(void*) = timer_p->function;
+	void* arg_p = timer_p->arg;
+
+	if (timer_p->period){
+		/* Runs missed while the threads were busy are skipped */
+		timer_p->expiry += timer_p->period;
+		if (timer_p->expiry <= wheel_p->tick){
+			timer_p->expiry = wheel_p->tick + timer_p->period;
+		}
+		timer_insert(wheel_p, index);
+	}
+	else {
+		timer_release(wheel_p, index);
+	}
+
+	/* Never to the firing thread's deque, it may be about to sleep */
+	thread* thread_p = thread_self(thpool_p);
+	job* newjob = jobslab_alloc(&thpool_p->jobslab, thread_p);
+	if (newjob == NULL){
+		err("timer_fire(): Could not allocate memory for new job\n");
+		return;
+	}
+	newjob->function  = function_p;
+	newjob->arg       = arg_p;
+	newjob->group     = NULL;
+	newjob->slot      = 0;
+	newjob->queued_ns = thpool_stamp(thpool_p);
+	thpool_push_job(thpool_p, thread_p, newjob);
+}
+
+
+/* Fire the timers that are due
+ *
+ * Threads between jobs skip it if another thread is at it already. The
+ * thread that slept until due waits for the lock instead, or it would
+ * spin on a due time that only the lock holder can move on.
+ *
+ * @param wait          wait for the lock
+ */
+static void timer_poll(thpool_* thpool_p, int wait){
+	timerwheel* wheel_p = &thpool_p->timers;
+	if (__atomic_load_n(&wheel_p->count, __ATOMIC_ACQUIRE) == 0) return;
+
+	if (clock_now() < __atomic_load_n(&wheel_p->due, __ATOMIC_ACQUIRE)) return;
+	if (wait){
+		pthread_mutex_lock(&wheel_p->lock);
+	}
+	else if (pthread_mutex_trylock(&wheel_p->lock) != 0){
+		return;
+	}
+	unsigned long long now = clock_now();
+
+	timer_advance(thpool_p, (now - wheel_p->epoch) / THPOOL_TIMER_TICK);
+	timer_update_due(wheel_p);
+	pthread_mutex_unlock(&wheel_p->lock);
+}
+
+
+
+
+
+/* ============================ FUTURES ============================= */
+
+
+/* Wait for a future and return its result */
+void* thpool_future_wait(thpool_future_* future_p){
+	if (!__atomic_load_n(&future_p->done, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&future_p->mutex);
+		__atomic_add_fetch(&future_p->waiters, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&future_p->done, __ATOMIC_SEQ_CST)){
+			pthread_cond_wait(&future_p->cond, &future_p->mutex);
+		}
+		__atomic_sub_fetch(&future_p->waiters, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&future_p->mutex);
+	}
+	return future_p->result;
+}
+
+
+/* Wait for a future at most timeout_ns nanoseconds */
+int thpool_future_wait_timeout(thpool_future_* future_p, unsigned long long timeout_ns, void** result_p){
+	if (!__atomic_load_n(&future_p->done, __ATOMIC_ACQUIRE)){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec  += (time_t)(timeout_ns / 1000000000ULL);
+		deadline.tv_nsec += (long)(timeout_ns % 1000000000ULL);
+		if (deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&future_p->mutex);
+		__atomic_add_fetch(&future_p->waiters, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&future_p->done, __ATOMIC_SEQ_CST)){
+			if (pthread_cond_timedwait(&future_p->cond, &future_p->mutex, &deadline) == ETIMEDOUT){
+				break;
+			}
+		}
+		__atomic_sub_fetch(&future_p->waiters, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&future_p->mutex);
+
+		if (!__atomic_load_n(&future_p->done, __ATOMIC_ACQUIRE)){
+			return -1;
+		}
+	}
+	if (result_p != NULL){
+		*result_p = future_p->result;
+	}
+	return 0;
+}
+
+
+/* Tell if the job of a future has finished */
+int thpool_future_ready(thpool_future_* future_p){
+	return __atomic_load_n(&future_p->done, __ATOMIC_ACQUIRE);
+}
+
+
+/* Give a future back to its pool */
+void thpool_future_release(thpool_future_* future_p){
+	if (future_p == NULL) return;
+	future_unref(future_p);
+}
+
+
+/* Take a future from the free list or allocate a new one
+ *
+ * The returned future holds a reference for the job and one for the user.
+ */
+static thpool_future_* future_alloc(thpool_* thpool_p){
+	thpool_future_* future_p;
+
+	pthread_mutex_lock(&thpool_p->future_lock);
+	future_p = thpool_p->futures_free;
+	if (future_p != NULL){
+		thpool_p->futures_free = future_p->next;
+	}
+	pthread_mutex_unlock(&thpool_p->future_lock);
+
+	if (future_p == NULL){
+		future_p = (struct thpool_future_*)malloc(sizeof(struct thpool_future_));
+		if (future_p == NULL){
+			return NULL;
+		}
+		future_p->thpool_p = thpool_p;
+		future_p->waiters  = 0;
+		pthread_mutex_init(&future_p->mutex, NULL);
+		pthread_cond_init(&future_p->cond, NULL);
+
+		pthread_mutex_lock(&thpool_p->future_lock);
+		future_p->all = thpool_p->futures_all;
+		thpool_p->futures_all = future_p;
+		pthread_mutex_unlock(&thpool_p->future_lock);
+	}
+
+	future_p->next   = NULL;
+	future_p->result = NULL;
+	future_p->done   = 0;
+	future_p->state  = FUTURE_QUEUED;
+	future_p->cancel = 0;
+	future_p->refs   = 2;
+	return future_p;
+}
+
+
+/* Cancel the job of a future */
+int thpool_cancel(thpool_future_* future_p){
+	__atomic_store_n(&future_p->cancel, 1, __ATOMIC_SEQ_CST);
+
+	int state = FUTURE_QUEUED;
+	if (__atomic_compare_exchange_n(&future_p->state, &state, FUTURE_CANCELLED, 0,
+	                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+		/* The job stays queued and is skipped once pulled */
+		future_finish(future_p, NULL);
+		return 0;
+	}
+	return -1;
+}
+
+
+/* Tell the running job whether to stop early */
+int thpool_cancelled(thpool_* thpool_p){
+	if (!__atomic_load_n(&thpool_p->threads_keepalive, __ATOMIC_RELAXED)){
+		return 1;
+	}
+	/* The running job may belong to another pool */
+	thpool_future_* future_p = (thpool_future_*)pthread_getspecific(future_key);
+	return future_p != NULL && future_p->thpool_p == thpool_p &&
+	       __atomic_load_n(&future_p->cancel, __ATOMIC_RELAXED);
+}
+
+
+/* Job function of a future: run the user's function and publish the result */
+static void future_run(void* arg){
+	thpool_future_* future_p = (thpool_future_*)arg;
+
+	int state = FUTURE_QUEUED;
+	if (__atomic_compare_exchange_n(&future_p->state, &state, FUTURE_RUNNING, 0,
+	                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+		/* Futures nest when a job waits on a group */
+		void* outer = pthread_getspecific(future_key);
+		pthread_setspecific(future_key, future_p);
+		void* result = future_p->function(future_p->arg);
+		pthread_setspecific(future_key, outer);
+		future_finish(future_p, result);
+	}
+
+	future_unref(future_p);
+}
+
+
+/* Publish the result of a future and wake up its waiters */
+static void future_finish(thpool_future_* future_p, void* result){
+	future_p->result = result;
+	__atomic_store_n(&future_p->done, 1, __ATOMIC_SEQ_CST);
+
+	/* Only take the lock if someone is blocked on the future */
+	if (__atomic_load_n(&future_p->waiters, __ATOMIC_SEQ_CST) > 0){
+		pthread_mutex_lock(&future_p->mutex);
+		pthread_cond_broadcast(&future_p->cond);
+		pthread_mutex_unlock(&future_p->mutex);
+	}
+}
+
+
+/* Drop a reference and recycle the future once nobody holds it */
+static void future_unref(thpool_future_* future_p){
+	if (__atomic_sub_fetch(&future_p->refs, 1, __ATOMIC_ACQ_REL) != 0){
+		return;
+	}
+	thpool_* thpool_p = future_p->thpool_p;
+	pthread_mutex_lock(&thpool_p->future_lock);
+	future_p->next = thpool_p->futures_free;
+	thpool_p->futures_free = future_p;
+	pthread_mutex_unlock(&thpool_p->future_lock);
+}
+
+
+/* Free all futures of a pool */
+static void future_destroy_all(thpool_* thpool_p){
+	thpool_future_* future_p = thpool_p->futures_all;
+	while (future_p != NULL){
+		thpool_future_* next = future_p->all;
+		pthread_mutex_destroy(&future_p->mutex);
+		pthread_cond_destroy(&future_p->cond);
+		free(future_p);
+		future_p = next;
+	}
+	thpool_p->futures_all  = NULL;
+	thpool_p->futures_free = NULL;
+}
+
+
+
+
+
+/* ======================= STATISTICS & TRACING ===================== */
+
+
+/* Add up the statistics of a pool */
+int thpool_get_stats(thpool_* thpool_p, thpool_stats* stats){
+	thpool_thread_stats* threads = stats->threads;
+	int max_threads = stats->max_threads;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->threads     = threads;
+	stats->max_threads = max_threads;
+	stats->queue_len   = thpool_queued(thpool_p);
+
+#ifdef THPOOL_ENABLE_STATS
+	stats->submitted  = __atomic_load_n(&thpool_p->submitted, __ATOMIC_RELAXED);
+	stats->queue_peak = __atomic_load_n(&thpool_p->queue_peak, __ATOMIC_RELAXED);
+
+	threadtab* threadtab_p = __atomic_load_n(&thpool_p->threads, __ATOMIC_ACQUIRE);
+	int n;
+	for (n=0; n<threadtab_p->size; n++){
+		thread* thread_p = __atomic_load_n(&threadtab_p->slots[n], __ATOMIC_ACQUIRE);
+		if (thread_p == NULL) break;
+
+		threadstats* own = &thread_p->stats;
+		stats_total(stats, own);
+		if (threads != NULL && n < max_threads){
+			threads[n].jobs          = __atomic_load_n(&own->jobs, __ATOMIC_RELAXED);
+			threads[n].busy_ns       = __atomic_load_n(&own->busy_ns, __ATOMIC_RELAXED);
+			threads[n].idle_ns       = __atomic_load_n(&own->idle_ns, __ATOMIC_RELAXED);
+			threads[n].empty_wakeups = __atomic_load_n(&own->empty_wakeups, __ATOMIC_RELAXED);
+			stats->num_threads = n + 1;
+		}
+	}
+
+	/* Jobs that waiters ran count in the totals only */
+	pthread_mutex_lock(&thpool_p->caller_lock);
+	stats_total(stats, &thpool_p->caller.stats);
+	pthread_mutex_unlock(&thpool_p->caller_lock);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+/* Monotonic time in nanoseconds */
+static unsigned long long clock_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Time for statistics and traces, 0 if neither wants it */
+static unsigned long long thpool_stamp(thpool_* thpool_p){
+#ifdef THPOOL_ENABLE_STATS
+	(void)thpool_p;
+	return clock_now();
+#else
+	return thpool_p->tracing ? clock_now() : 0;
+#endif
+}
+
+
+#ifdef THPOOL_ENABLE_STATS
+
+
+/* Add to a counter only its owner writes */
+static void stats_add(unsigned long long* counter_p, unsigned long long n){
+	__atomic_store_n(counter_p, __atomic_load_n(counter_p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+
+/* Count added jobs and track the longest the queue got */
+static void stats_submit(thpool_* thpool_p, thread* thread_p, unsigned long long n){
+	if (thread_p != NULL)
+		stats_add(&thread_p->stats.submitted, n);
+	else
+		__atomic_add_fetch(&thpool_p->submitted, n, __ATOMIC_RELAXED);
+
+	int queued = thpool_queued(thpool_p);
+	int peak = __atomic_load_n(&thpool_p->queue_peak, __ATOMIC_RELAXED);
+	while (queued > peak){
+		if (__atomic_compare_exchange_n(&thpool_p->queue_peak, &peak, queued, 1,
+		                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+}
+
+
+/* Add the counters of a thread to the totals of the pool */
+static void stats_total(thpool_stats* stats, threadstats* own){
+	int b;
+	stats->submitted     += __atomic_load_n(&own->submitted, __ATOMIC_RELAXED);
+	stats->completed     += __atomic_load_n(&own->jobs, __ATOMIC_RELAXED);
+	stats->empty_wakeups += __atomic_load_n(&own->empty_wakeups, __ATOMIC_RELAXED);
+	for (b=0; b<THPOOL_STATS_BUCKETS; b++){
+		stats->wait_hist[b] += __atomic_load_n(&own->wait_hist[b], __ATOMIC_RELAXED);
+		stats->run_hist[b]  += __atomic_load_n(&own->run_hist[b], __ATOMIC_RELAXED);
+	}
+}
+
+
+/* Histogram bucket of a time, log2 of the nanoseconds */
+static int stats_bucket(unsigned long long ns){
+	int bucket = 63 - __builtin_clzll(ns | 1);
+	return bucket < THPOOL_STATS_BUCKETS ? bucket : THPOOL_STATS_BUCKETS - 1;
+}
+
+#endif
+
+
+
+
+
+/* Start recording trace events */
+void thpool_trace_start(thpool_* thpool_p){
+	if (!thpool_p->tracing){
+		if (thpool_p->trace_epoch == 0){
+			thpool_p->trace_epoch = clock_now();
+		}
+		__atomic_store_n(&thpool_p->tracing, 1, __ATOMIC_RELEASE);
+	}
+}
+
+
+/* Stop recording trace events, the ones recorded are kept */
+void thpool_trace_stop(thpool_* thpool_p){
+	__atomic_store_n(&thpool_p->tracing, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Write the trace events as Chrome trace event JSON
+ *
+ * Each thread is a track of job and idle slices. Events of a thread that
+ * is recording meanwhile may be torn, stop tracing first for a clean dump.
+ */
+int thpool_trace_dump(thpool_* thpool_p, const char* path){
+	FILE* fp = fopen(path, "w");
+	if (fp == NULL){
+		err("thpool_trace_dump(): Could not open file\n");
+		return -1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	int first = 1;
+	threadtab* threadtab_p = __atomic_load_n(&thpool_p->threads, __ATOMIC_ACQUIRE);
+	int n;
+	for (n=0; n<threadtab_p->size; n++){
+		thread* thread_p = __atomic_load_n(&threadtab_p->slots[n], __ATOMIC_ACQUIRE);
+		if (thread_p == NULL) break;
+
+		fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+		            "\"args\":{\"name\":\"" TOSTRING(THPOOL_THREAD_NAME) "-%d\"}}",
+		        first ? "" : ",\n", thread_p->id, thread_p->id);
+		first = 0;
+		trace_dump_thread(thpool_p, thread_p, fp);
+	}
+
+	/* Jobs that waiters ran, on a track of their own */
+	pthread_mutex_lock(&thpool_p->caller_lock);
+	if (thpool_p->caller.trace != NULL){
+		fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+		            "\"args\":{\"name\":\"callers\"}}",
+		        first ? "" : ",\n", thpool_p->caller.id);
+		trace_dump_thread(thpool_p, &thpool_p->caller, fp);
+	}
+	pthread_mutex_unlock(&thpool_p->caller_lock);
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) != 0){
+		err("thpool_trace_dump(): Could not write file\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Write the events recorded by a thread */
+static void trace_dump_thread(thpool_* thpool_p, thread* thread_p, FILE* fp){
+	traceevent* trace = __atomic_load_n(&thread_p->trace, __ATOMIC_ACQUIRE);
+	if (trace == NULL) return;
+	unsigned long long head = __atomic_load_n(&thread_p->trace_head, __ATOMIC_ACQUIRE);
+	unsigned long long i = head > thpool_p->trace_events ? head - thpool_p->trace_events : 0;
+	for (; i<head; i++){
+		traceevent* event = &trace[i % thpool_p->trace_events];
+		if (event->start_ns < thpool_p->trace_epoch) continue;
+		double ts  = (event->start_ns - thpool_p->trace_epoch) / 1e3;
+		double dur = (event->end_ns - event->start_ns) / 1e3;
+		if (event->function == NULL){
+			fprintf(fp, ",\n{\"ph\":\"X\",\"name\":\"idle\",\"cat\":\"idle\",\"pid\":1,\"tid\":%d,"
+			            "\"ts\":%.3f,\"dur\":%.3f}", thread_p->id, ts, dur);
+		}
+		else {
+			double wait = event->queued_ns && event->queued_ns <= event->start_ns ?
+			              (event->start_ns - event->queued_ns) / 1e3 : 0;
+			fprintf(fp, ",\n{\"ph\":\"X\",\"name\":\"job\",\"cat\":\"job\",\"pid\":1,\"tid\":%d,"
+			            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"function\":\"%#" PRIxPTR "\",\"wait_us\":%.3f}}",
+			        thread_p->id, ts, dur, (uintptr_t)event->function, wait);
+		}
+	}
+}
+
+
+/* Add an event to the trace ring of a thread, overwriting the oldest */
+static void trace_record(thread* thread_p, unsigned long long start, unsigned long long end,
+                         unsigned long long queued, void (*function_p)(void*)){
+	thpool_* thpool_p = thread_p->thpool_p;
+	if (thread_p->trace == NULL){
+		traceevent* trace = (traceevent*)malloc(thpool_p->trace_events * sizeof(traceevent));
+		if (trace == NULL) return;
+		__atomic_store_n(&thread_p->trace, trace, __ATOMIC_RELEASE);
+	}
+
+	unsigned long long head = thread_p->trace_head;
+	traceevent* event = &thread_p->trace[head % thpool_p->trace_events];
+	event->start_ns  = start;
+	event->end_ns    = end;
+	event->queued_ns = queued;
+	event->function  = function_p;
+	__atomic_store_n(&thread_p->trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+
+
+
+/* ============================ TOPOLOGY ============================ */
+
+
+/* Read a number from a sysfs file
+ *
+ * @param path          printf format of the path below root, taking cpu
+ * @return the number, or -1 if it could not be read
+ */
+static int topology_read_int(const char* root, const char* path, int cpu){
+	char file[256];
+	int len = snprintf(file, sizeof(file), "%s/", root);
+	snprintf(file + len, sizeof(file) - len, path, cpu);
+
+	FILE* fp = fopen(file, "r");
+	if (fp == NULL){
+		return -1;
+	}
+	int value;
+	if (fscanf(fp, "%d", &value) != 1){
+		value = -1;
+	}
+	fclose(fp);
+	return value;
+}
+
+
+/* Read a sysfs list like "0-3,8,10-11"
+ *
+ * @param list          where to store up to max numbers
+ * @return number of numbers read, or -1 if the file could not be read
+ */
+static int topology_read_list(const char* root, const char* path, int* list, int max){
+	char file[256];
+	snprintf(file, sizeof(file), "%s/%s", root, path);
+
+	FILE* fp = fopen(file, "r");
+	if (fp == NULL){
+		return -1;
+	}
+	int n = 0, first, last;
+	while (fscanf(fp, "%d", &first) == 1){
+		last = first;
+		int c = fgetc(fp);
+		if (c == '-'){
+			if (fscanf(fp, "%d", &last) != 1) break;
+			c = fgetc(fp);
+		}
+		for (; first <= last && n < max; first++){
+			list[n++] = first;
+		}
+		if (c != ',') break;
+	}
+	fclose(fp);
+	return n;
+}
+
+
+/* CPU as seen by the pinning policies */
+typedef struct topocpu{
+	int cpu;
+	int package;                         /* physical package (socket) */
+	int core;                            /* core id within package    */
+	int core_rank;                       /* index of core in package  */
+	int smt_rank;                        /* index of cpu in its core  */
+} topocpu;
+
+
+static int topocpu_compact(const void* a, const void* b){
+	const topocpu* x = (const topocpu*)a;
+	const topocpu* y = (const topocpu*)b;
+	if (x->package   != y->package)   return x->package   - y->package;
+	if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+	return x->smt_rank - y->smt_rank;
+}
+
+
+static int topocpu_scatter(const void* a, const void* b){
+	const topocpu* x = (const topocpu*)a;
+	const topocpu* y = (const topocpu*)b;
+	if (x->smt_rank  != y->smt_rank)  return x->smt_rank  - y->smt_rank;
+	if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+	return x->package - y->package;
+}
+
+
+/* Order the CPUs threads get pinned to
+ *
+ * Thread n is pinned to the (n % count)th CPU of the order:
+ *   compact  - SMT siblings next to each other, cores of a package together
+ *   scatter  - one CPU per package in turns, SMT siblings after all cores
+ *   cores    - first CPU of every physical core, like compact
+ *
+ * @param cpus_p        where to store the allocated array of CPUs
+ * @return number of CPUs, or -1 on error
+ */
+static int topology_cpus(const thpool_config* config, int** cpus_p){
+	const char* root = config->sysfs_root ? config->sysfs_root : THPOOL_SYSFS_ROOT;
+	int* cpus = (int*)malloc(THPOOL_MAX_CPUS * sizeof(int));
+	topocpu* topo = (topocpu*)malloc(THPOOL_MAX_CPUS * sizeof(topocpu));
+	if (cpus == NULL || topo == NULL){
+		free(cpus);
+		free(topo);
+		return -1;
+	}
+
+	int n, m, count;
+	if (config->cpus != NULL){
+		count = config->num_cpus < THPOOL_MAX_CPUS ? config->num_cpus : THPOOL_MAX_CPUS;
+		for (n=0; n<count; n++){
+			cpus[n] = config->cpus[n];
+		}
+	}
+	else {
+		count = topology_read_list(root, "cpu/online", cpus, THPOOL_MAX_CPUS);
+		if (count <= 0){
+			count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+			if (count > THPOOL_MAX_CPUS) count = THPOOL_MAX_CPUS;
+			for (n=0; n<count; n++){
+				cpus[n] = n;
+			}
+		}
+	}
+
+	for (n=0; n<count; n++){
+		topo[n].cpu     = cpus[n];
+		topo[n].package = topology_read_int(root, "cpu/cpu%d/topology/physical_package_id", cpus[n]);
+		topo[n].core    = topology_read_int(root, "cpu/cpu%d/topology/core_id", cpus[n]);
+		if (topo[n].package < 0) topo[n].package = 0;
+		if (topo[n].core    < 0) topo[n].core    = cpus[n];
+	}
+	for (n=0; n<count; n++){
+		topo[n].core_rank = 0;
+		topo[n].smt_rank  = 0;
+		for (m=0; m<count; m++){
+			if (topo[m].package != topo[n].package) continue;
+			if (topo[m].core == topo[n].core){
+				topo[n].smt_rank += topo[m].cpu < topo[n].cpu;
+			}
+			else if (topo[m].core < topo[n].core){
+				/* count each lower core once, by its first CPU */
+				int k, first = 1;
+				for (k=0; k<m; k++){
+					if (topo[k].package == topo[m].package && topo[k].core == topo[m].core){
+						first = 0;
+						break;
+					}
+				}
+				topo[n].core_rank += first;
+			}
+		}
+	}
+
+	if (config->affinity == THPOOL_AFFINITY_SCATTER){
+		qsort(topo, count, sizeof(topocpu), topocpu_scatter);
+	}
+	else {
+		qsort(topo, count, sizeof(topocpu), topocpu_compact);
+	}
+
+	m = 0;
+	for (n=0; n<count; n++){
+		if (config->affinity == THPOOL_AFFINITY_CORES && topo[n].smt_rank > 0) continue;
+		cpus[m++] = topo[n].cpu;
+	}
+
+	free(topo);
+	if (m == 0){
+		free(cpus);
+		return -1;
+	}
+	*cpus_p = cpus;
+	return m;
+}
+
+
+
+
+
+/* Set up the NUMA nodes of a pool and their job queues
+ *
+ * Without config->numa, or if sysfs lists no nodes, the pool gets a single
+ * node with no CPUs to pin to.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int topology_nodes(thpool_* thpool_p, const thpool_config* config){
+	const char* root = config->sysfs_root ? config->sysfs_root : THPOOL_SYSFS_ROOT;
+	int ids[THPOOL_MAX_CPUS];
+	int num_nodes = 0;
+
+	if (config->numa){
+		num_nodes = topology_read_list(root, "node/online", ids, THPOOL_MAX_CPUS);
+	}
+	if (num_nodes <= 0){
+		num_nodes = 1;
+		ids[0] = 0;
+	}
+
+	thpool_p->num_nodes = 0;
+	thpool_p->cpu_nodes = NULL;
+	thpool_p->nodes = (struct numanode*)calloc(num_nodes, sizeof(struct numanode));
+	if (thpool_p->nodes == NULL){
+		return -1;
+	}
+	if (num_nodes > 1){
+		thpool_p->cpu_nodes = (int*)malloc(THPOOL_MAX_CPUS * sizeof(int));
+		if (thpool_p->cpu_nodes == NULL){
+			free(thpool_p->nodes);
+			return -1;
+		}
+		int n;
+		for (n=0; n<THPOOL_MAX_CPUS; n++){
+			thpool_p->cpu_nodes[n] = -1;
+		}
+	}
+
+	for (; thpool_p->num_nodes < num_nodes; thpool_p->num_nodes++){
+		numanode* node_p = &thpool_p->nodes[thpool_p->num_nodes];
+		node_p->id = ids[thpool_p->num_nodes];
+
+		if (num_nodes > 1){
+			char path[64];
+			snprintf(path, sizeof(path), "node/node%d/cpulist", node_p->id);
+			node_p->cpus = (int*)malloc(THPOOL_MAX_CPUS * sizeof(int));
+			if (node_p->cpus == NULL){
+				topology_destroy(thpool_p);
+				return -1;
+			}
+			node_p->num_cpus = topology_read_list(root, path, node_p->cpus, THPOOL_MAX_CPUS);
+			if (node_p->num_cpus <= 0){
+				free(node_p->cpus);
+				node_p->cpus = NULL;
+				node_p->num_cpus = 0;
+			}
+			int n;
+			for (n=0; n<node_p->num_cpus; n++){
+				if (node_p->cpus[n] >= 0 && node_p->cpus[n] < THPOOL_MAX_CPUS){
+					thpool_p->cpu_nodes[node_p->cpus[n]] = thpool_p->num_nodes;
+				}
+			}
+		}
+
+		if (jobqueue_init(&node_p->jobqueue, config) == -1){
+			free(node_p->cpus);
+			topology_destroy(thpool_p);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* Free the nodes of a pool and their job queues */
+static void topology_destroy(thpool_* thpool_p){
+	int n;
+	for (n=0; n<thpool_p->num_nodes; n++){
+		jobqueue_destroy(&thpool_p->nodes[n].jobqueue);
+		free(thpool_p->nodes[n].cpus);
+	}
+	free(thpool_p->nodes);
+	free(thpool_p->cpu_nodes);
+}
+
+
+
+
+
+/* ============================ JOB QUEUE =========================== */
+
+
+/* Initialize queue */
+static int jobqueue_init(jobqueue* jobqueue_p, const thpool_config* config){
+	jobqueue_p->len = 0;
+	jobqueue_p->front = NULL;
+	jobqueue_p->rear  = NULL;
+	jobqueue_p->ring  = NULL;
+	jobqueue_p->levels_len = 0;
+	jobqueue_p->aging      = config->prio_aging;
+	jobqueue_p->pulls      = 0;
+
+	if (config->queue_type == THPOOL_QUEUE_RING){
+		jobqueue_p->ring = jobring_init(config->ring_capacity);
+		if (jobqueue_p->ring == NULL){
+			return -1;
+		}
+	}
+
+	jobqueue_p->has_jobs = (struct csem*)malloc(sizeof(struct csem));
+	if (jobqueue_p->has_jobs == NULL){
+		jobring_destroy(jobqueue_p->ring);
+		return -1;
+	}
+
+	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
+	csem_init(jobqueue_p->has_jobs);
+
+	int prio;
+	for (prio=0; prio<THPOOL_PRIORITIES; prio++){
+		pthread_mutex_init(&jobqueue_p->levels[prio].mutex, NULL);
+		jobqueue_p->levels[prio].front = NULL;
+		jobqueue_p->levels[prio].rear  = NULL;
+		jobqueue_p->levels[prio].len   = 0;
+	}
+
+	return 0;
+}
+
+
+/* Clear the queue
+ *
+ * The jobs themselves belong to the pool's job allocator, only arguments
+ * copied to the heap are freed.
+ */
+static void jobqueue_clear(jobqueue* jobqueue_p){
+
+	while(jobqueue_p->len){
+		job* job_p = jobqueue_pull(jobqueue_p);
+		if (job_p != NULL){
+			thpool_discard_copy(job_p);
+		}
+	}
+
+	jobqueue_p->front = NULL;
+	jobqueue_p->rear  = NULL;
+	csem_reset(jobqueue_p->has_jobs);
+	jobqueue_p->len = 0;
+
+}
+
+
+/* Add (allocated) job to queue
+ *
+ * The job goes to the ring if there is one and it has room, otherwise
+ * to the linked list. Once jobs spilled to the list, later ones follow
+ * them there until the list is drained, so that none overtakes them
+ * through the ring.
+ *
+ * The length is raised before the job becomes visible so that it never
+ * reads less than the jobs a worker can find.
+ */
+static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
+
+	__atomic_add_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST);
+
+	if (jobqueue_p->ring == NULL || __atomic_load_n(&jobqueue_p->front, __ATOMIC_ACQUIRE) != NULL ||
+	    jobring_push(jobqueue_p->ring, newjob) == -1){
+
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+		newjob->prev = NULL;
+
+		if (jobqueue_p->rear == NULL){    /* if no jobs in list */
+			__atomic_store_n(&jobqueue_p->front, newjob, __ATOMIC_RELEASE);
+			jobqueue_p->rear = newjob;
+		}
+		else {                            /* if jobs in list */
+			jobqueue_p->rear->prev = newjob;
+			jobqueue_p->rear = newjob;
+		}
+
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	}
+
+	csem_post(jobqueue_p->has_jobs, 1);
+}
+
+
+/* Add a list of n (allocated) jobs linked through prev to queue
+ *
+ * Jobs that don't fit in the ring are appended to the linked list under
+ * one lock acquisition, all of them while the list holds jobs (see
+ * jobqueue_push()). Up to n idle threads are woken up.
+ */
+static void jobqueue_push_batch(jobqueue* jobqueue_p, struct job* first, size_t n){
+
+	int posted = (int)n;
+	__atomic_add_fetch(&jobqueue_p->len, posted, __ATOMIC_SEQ_CST);
+
+	if (jobqueue_p->ring != NULL && __atomic_load_n(&jobqueue_p->front, __ATOMIC_ACQUIRE) == NULL){
+		while (n > 0){
+			job* next = first->prev;
+			if (jobring_push(jobqueue_p->ring, first) == -1) break;
+			first = next;
+			n--;
+		}
+	}
+
+	if (n > 0){
+		job* last = first;
+		size_t i;
+		for (i=1; i<n; i++){
+			last = last->prev;
+		}
+		last->prev = NULL;
+
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+		if (jobqueue_p->rear == NULL){    /* if no jobs in list */
+			__atomic_store_n(&jobqueue_p->front, first, __ATOMIC_RELEASE);
+		}
+		else {                            /* if jobs in list */
+			jobqueue_p->rear->prev = first;
+		}
+		jobqueue_p->rear = last;
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	}
+
+	csem_post(jobqueue_p->has_jobs, posted);
+}
+
+
+/* Add (allocated) job to the level of its priority
+ *
+ * Like jobqueue_push() the lengths are raised before the job becomes
+ * visible.
+ */
+static void jobqueue_push_prio(jobqueue* jobqueue_p, struct job* newjob, int prio){
+
+	joblevel* joblevel_p = &jobqueue_p->levels[prio];
+
+	__atomic_add_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&jobqueue_p->levels_len, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&joblevel_p->len, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&joblevel_p->mutex);
+	newjob->prev = NULL;
+	if (joblevel_p->rear == NULL){    /* if no jobs in level */
+		joblevel_p->front = newjob;
+	}
+	else {                            /* if jobs in level */
+		joblevel_p->rear->prev = newjob;
+	}
+	joblevel_p->rear = newjob;
+	pthread_mutex_unlock(&joblevel_p->mutex);
+
+	csem_post(jobqueue_p->has_jobs, 1);
+}
+
+
+/* Get the job to run next (removes it from queue)
+ *
+ * Unless jobs of other priorities are queued this is a plain pull of the
+ * default priority. NULL is returned if no job could be found.
+ */
+static struct job* jobqueue_pull(jobqueue* jobqueue_p){
+	if (__atomic_load_n(&jobqueue_p->levels_len, __ATOMIC_ACQUIRE) > 0){
+		return jobqueue_pull_levels(jobqueue_p);
+	}
+	return jobqueue_pull_default(jobqueue_p);
+}
+
+
+/* Get the first job of the highest priority that has one
+ *
+ * With aging on, every aging-th pull goes from the lowest priority up
+ * instead, so low priority jobs wait for a bounded number of others.
+ */
+static struct job* jobqueue_pull_levels(jobqueue* jobqueue_p){
+
+	int lowest_first = jobqueue_p->aging > 0 &&
+		__atomic_add_fetch(&jobqueue_p->pulls, 1, __ATOMIC_RELAXED) % jobqueue_p->aging == 0;
+
+	int n;
+	for (n=0; n<THPOOL_PRIORITIES; n++){
+		int prio = lowest_first ? n : THPOOL_PRIORITIES - 1 - n;
+		job* job_p;
+		if (prio == THPOOL_PRIO_NORMAL){
+			job_p = jobqueue_pull_default(jobqueue_p);
+		}
+		else {
+			job_p = jobqueue_pull_level(jobqueue_p, &jobqueue_p->levels[prio]);
+		}
+		if (job_p != NULL){
+			return job_p;
+		}
+	}
+	return NULL;
+}
+
+
+/* Get first job of a priority level (removes it from queue) */
+static struct job* jobqueue_pull_level(jobqueue* jobqueue_p, joblevel* joblevel_p){
+
+	if (__atomic_load_n(&joblevel_p->len, __ATOMIC_ACQUIRE) == 0){
+		return NULL;
+	}
+
+	pthread_mutex_lock(&joblevel_p->mutex);
+	job* job_p = joblevel_p->front;
+	if (job_p != NULL){
+		joblevel_p->front = job_p->prev;
+		if (joblevel_p->front == NULL){
+			joblevel_p->rear = NULL;
+		}
+	}
+	pthread_mutex_unlock(&joblevel_p->mutex);
+
+	if (job_p != NULL){
+		__atomic_sub_fetch(&joblevel_p->len, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&jobqueue_p->levels_len, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST);
+	}
+	return job_p;
+}
+
+
+/* Get first job of the default priority (removes it from queue)
+ *
+ * The ring is tried first, then the linked list. NULL is returned if no
+ * job could be found.
+ */
+static struct job* jobqueue_pull_default(jobqueue* jobqueue_p){
 
+	job* job_p = NULL;
 
+	if (jobqueue_p->ring != NULL){
+		job_p = jobring_pull(jobqueue_p->ring);
+	}
 
-/* ============================ JOB QUEUE =========================== */
+	if (job_p == NULL && __atomic_load_n(&jobqueue_p->front, __ATOMIC_ACQUIRE) != NULL){
 
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+		job_p = jobqueue_p->front;
+		if (job_p != NULL){
+			__atomic_store_n(&jobqueue_p->front, job_p->prev, __ATOMIC_RELAXED);
+			if (jobqueue_p->front == NULL){
+				jobqueue_p->rear = NULL;
+			}
+		}
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	}
 
-/* Initialize queue */
-static int jobqueue_init(jobqueue* jobqueue_p){
-	jobqueue_p->len = 0;
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
+	if (job_p != NULL){
+		__atomic_sub_fetch(&jobqueue_p->len, 1, __ATOMIC_SEQ_CST);
+	}
 
-	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (jobqueue_p->has_jobs == NULL){
-		return -1;
+	return job_p;
+}
+
+
+/* Free all queue resources back to the system */
+static void jobqueue_destroy(jobqueue* jobqueue_p){
+	jobqueue_clear(jobqueue_p);
+	jobring_destroy(jobqueue_p->ring);
+	free(jobqueue_p->has_jobs);
+
+	int prio;
+	for (prio=0; prio<THPOOL_PRIORITIES; prio++){
+		pthread_mutex_destroy(&jobqueue_p->levels[prio].mutex);
 	}
+}
 
-	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
-	bsem_init(jobqueue_p->has_jobs, 0);
 
+
+
+
+/* ============================ JOB SLAB ============================ */
+
+
+/* Initialize job allocator
+ *
+ * @param prealloc      jobs to allocate upfront
+ * @return 0 on success, -1 otherwise.
+ */
+static int jobslab_init(jobslab* jobslab_p, size_t prealloc){
+	jobslab_p->free       = NULL;
+	jobslab_p->returned   = NULL;
+	jobslab_p->chunks     = NULL;
+	jobslab_p->chunk_used = 0;
+	jobslab_p->high_water = 0;
+
+	if (prealloc > 0){
+		jobslab_p->chunks = jobslab_chunk(prealloc);
+		if (jobslab_p->chunks == NULL){
+			return -1;
+		}
+		jobslab_p->chunks->next = NULL;
+		jobslab_p->chunks->size = prealloc;
+	}
+
+	pthread_mutex_init(&(jobslab_p->lock), NULL);
 	return 0;
 }
 
 
-/* Clear the queue */
-static void jobqueue_clear(jobqueue* jobqueue_p){
+/* Allocate a chunk of n job nodes, aligned to cache lines */
+static struct jobchunk* jobslab_chunk(size_t n){
+	void* chunk_p;
+	if (posix_memalign(&chunk_p, THPOOL_CACHE_LINE, sizeof(struct jobchunk) + n * sizeof(struct job)) != 0){
+		return NULL;
+	}
+	return (struct jobchunk*)chunk_p;
+}
 
-	while(jobqueue_p->len){
-		free(jobqueue_pull(jobqueue_p));
+
+/* Get a job node
+ *
+ * Threads of the pool first use their own cache. Everyone else takes a
+ * recycled job under the lock, or carves a new one out of a chunk.
+ *
+ * @param thread_p      calling thread of the pool or NULL
+ * @return the job, or NULL if no memory could be allocated
+ */
+static struct job* jobslab_alloc(jobslab* jobslab_p, thread* thread_p){
+
+	job* job_p;
+
+	if (thread_p != NULL && thread_p->cache != NULL){
+		job_p = thread_p->cache;
+		thread_p->cache = job_p->prev;
+		thread_p->cache_len--;
+		return job_p;
 	}
 
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-	bsem_reset(jobqueue_p->has_jobs);
-	jobqueue_p->len = 0;
+	pthread_mutex_lock(&jobslab_p->lock);
+	job_p = jobslab_take(jobslab_p);
+	pthread_mutex_unlock(&jobslab_p->lock);
+	return job_p;
+}
+
+
+/* Get n job nodes linked through prev
+ *
+ * Same as jobslab_alloc() but takes the lock at most once.
+ *
+ * @param first_p       set to the first job of the list
+ * @return 0 on success, -1 if no memory could be allocated
+ */
+static int jobslab_alloc_batch(jobslab* jobslab_p, thread* thread_p, size_t n, job** first_p){
+
+	job* first = NULL;
+	job* job_p;
+
+	while (n > 0 && thread_p != NULL && thread_p->cache != NULL){
+		job_p = thread_p->cache;
+		thread_p->cache = job_p->prev;
+		thread_p->cache_len--;
+		job_p->prev = first;
+		first = job_p;
+		n--;
+	}
+
+	if (n > 0){
+		pthread_mutex_lock(&jobslab_p->lock);
+		while (n > 0 && (job_p = jobslab_take(jobslab_p)) != NULL){
+			job_p->prev = first;
+			first = job_p;
+			n--;
+		}
+		pthread_mutex_unlock(&jobslab_p->lock);
+	}
 
+	if (n > 0){
+		/* out of memory -> give back what we got */
+		if (first != NULL){
+			job_p = first;
+			while (job_p->prev != NULL){
+				job_p = job_p->prev;
+			}
+			jobslab_give_back(jobslab_p, first, job_p);
+		}
+		return -1;
+	}
+
+	*first_p = first;
+	return 0;
 }
 
 
-/* Add (allocated) job to queue
+/* Get a recycled job or carve a new one out of a chunk
+ * Notice: Caller MUST hold the lock
  */
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
+static struct job* jobslab_take(jobslab* jobslab_p){
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	newjob->prev = NULL;
+	if (jobslab_p->free == NULL){
+		jobslab_p->free = __atomic_exchange_n(&jobslab_p->returned, NULL, __ATOMIC_ACQUIRE);
+	}
+
+	job* job_p = jobslab_p->free;
+	if (job_p != NULL){
+		jobslab_p->free = job_p->prev;
+		return job_p;
+	}
+
+	jobchunk* chunk_p = jobslab_p->chunks;
+	if (chunk_p == NULL || jobslab_p->chunk_used == chunk_p->size){
+		chunk_p = jobslab_chunk(THPOOL_SLAB_CHUNK);
+		if (chunk_p == NULL){
+			return NULL;
+		}
+		chunk_p->next = jobslab_p->chunks;
+		chunk_p->size = THPOOL_SLAB_CHUNK;
+		jobslab_p->chunks     = chunk_p;
+		jobslab_p->chunk_used = 0;
+	}
+
+	__atomic_store_n(&jobslab_p->high_water, jobslab_p->high_water + 1, __ATOMIC_RELAXED);
+	return &chunk_p->jobs[jobslab_p->chunk_used++];
+}
+
+
+/* Give a job node back
+ *
+ * Threads of the pool keep it in their cache and give the whole cache back
+ * once it is full. Everyone else gives it back right away.
+ *
+ * @param thread_p      calling thread of the pool or NULL
+ */
+static void jobslab_free(jobslab* jobslab_p, thread* thread_p, job* job_p){
+
+	if (thread_p == NULL){
+		jobslab_give_back(jobslab_p, job_p, job_p);
+		return;
+	}
+
+	job_p->prev = thread_p->cache;
+	if (thread_p->cache == NULL){
+		thread_p->cache_last = job_p;
+	}
+	thread_p->cache = job_p;
+
+	if (++thread_p->cache_len >= THPOOL_SLAB_CACHE){
+		jobslab_give_back(jobslab_p, thread_p->cache, thread_p->cache_last);
+		thread_p->cache     = NULL;
+		thread_p->cache_len = 0;
+	}
+}
+
+
+/* Push a list of jobs linked through prev to the returned list */
+static void jobslab_give_back(jobslab* jobslab_p, job* first_p, job* last_p){
+	job* head = __atomic_load_n(&jobslab_p->returned, __ATOMIC_RELAXED);
+	do {
+		last_p->prev = head;
+	} while (!__atomic_compare_exchange_n(&jobslab_p->returned, &head, first_p, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-	switch(jobqueue_p->len){
 
-		case 0:  /* if no jobs in queue */
-					jobqueue_p->front = newjob;
-					jobqueue_p->rear  = newjob;
-					break;
+/* Free all chunks back to the system */
+static void jobslab_destroy(jobslab* jobslab_p){
+	while (jobslab_p->chunks != NULL){
+		jobchunk* chunk_p = jobslab_p->chunks;
+		jobslab_p->chunks = chunk_p->next;
+		free(chunk_p);
+	}
+	pthread_mutex_destroy(&jobslab_p->lock);
+}
+
+
+
+
+
+/* ============================ JOB RING ============================ */
+
+
+/* Initialize ring with capacity rounded up to a power of two */
+static jobring* jobring_init(unsigned int capacity){
+
+	size_t size = 2;
+	while (size < capacity){
+		size <<= 1;
+	}
+
+	jobring* jobring_p = (struct jobring*)malloc(sizeof(struct jobring));
+	if (jobring_p == NULL){
+		return NULL;
+	}
+	jobring_p->slots = (struct ringslot*)malloc(size * sizeof(struct ringslot));
+	if (jobring_p->slots == NULL){
+		free(jobring_p);
+		return NULL;
+	}
 
-		default: /* if jobs in queue */
-					jobqueue_p->rear->prev = newjob;
-					jobqueue_p->rear = newjob;
+	size_t n;
+	for (n=0; n<size; n++){
+		jobring_p->slots[n].seq = n;
+		jobring_p->slots[n].job = NULL;
+	}
+	jobring_p->mask        = size - 1;
+	jobring_p->enqueue_pos = 0;
+	jobring_p->dequeue_pos = 0;
+
+	return jobring_p;
+}
+
+
+/* Add job to ring
+ *
+ * @return 0 on success, -1 if the ring is full
+ */
+static int jobring_push(jobring* jobring_p, struct job* newjob){
+
+	ringslot* slot;
+	size_t pos = __atomic_load_n(&jobring_p->enqueue_pos, __ATOMIC_RELAXED);
 
+	for (;;){
+		slot = &jobring_p->slots[pos & jobring_p->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)seq - (long)pos;
+
+		if (dif == 0){                    /* slot is free, claim it */
+			if (__atomic_compare_exchange_n(&jobring_p->enqueue_pos, &pos, pos + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if (dif < 0){                /* slot still holds a job */
+			return -1;
+		}
+		else {                            /* another producer got it */
+			pos = __atomic_load_n(&jobring_p->enqueue_pos, __ATOMIC_RELAXED);
+		}
 	}
-	jobqueue_p->len++;
 
-	bsem_post(jobqueue_p->has_jobs);
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	slot->job = newjob;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
 }
 
 
-/* Get first job from queue(removes it from queue)
- * Notice: Caller MUST hold a mutex
+/* Get first job from ring (removes it from ring)
+ *
+ * @return the job, or NULL if the ring is empty
  */
-static struct job* jobqueue_pull(jobqueue* jobqueue_p){
+static struct job* jobring_pull(jobring* jobring_p){
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	job* job_p = jobqueue_p->front;
+	ringslot* slot;
+	size_t pos = __atomic_load_n(&jobring_p->dequeue_pos, __ATOMIC_RELAXED);
 
-	switch(jobqueue_p->len){
+	for (;;){
+		slot = &jobring_p->slots[pos & jobring_p->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)seq - (long)(pos + 1);
 
-		case 0:  /* if no jobs in queue */
-		  			break;
+		if (dif == 0){                    /* slot has a job, claim it */
+			if (__atomic_compare_exchange_n(&jobring_p->dequeue_pos, &pos, pos + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if (dif < 0){                /* slot is still empty */
+			return NULL;
+		}
+		else {                            /* another consumer got it */
+			pos = __atomic_load_n(&jobring_p->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct job* job_p = slot->job;
+	__atomic_store_n(&slot->seq, pos + jobring_p->mask + 1, __ATOMIC_RELEASE);
+	return job_p;
+}
+
+
+/* Free ring resources back to the system */
+static void jobring_destroy(jobring* jobring_p){
+	if (jobring_p == NULL) return;
+	free(jobring_p->slots);
+	free(jobring_p);
+}
+
+
+
+
+
+/* ========================== JOB DEQUE ============================= */
 
-		case 1:  /* if one job in queue */
-					jobqueue_p->front = NULL;
-					jobqueue_p->rear  = NULL;
-					jobqueue_p->len = 0;
-					break;
 
-		default: /* if >1 jobs in queue */
-					jobqueue_p->front = job_p->prev;
-					jobqueue_p->len--;
-					/* more than one job in queue -> post it */
-					bsem_post(jobqueue_p->has_jobs);
+/* Initialize deque with capacity rounded up to a power of two */
+static jobdeque* jobdeque_init(unsigned int capacity){
 
+	long size = 2;
+	while (size < (long)capacity){
+		size <<= 1;
 	}
 
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	jobdeque* jobdeque_p = (struct jobdeque*)malloc(sizeof(struct jobdeque));
+	if (jobdeque_p == NULL){
+		return NULL;
+	}
+	jobdeque_p->slots = (struct job**)calloc(size, sizeof(struct job*));
+	if (jobdeque_p->slots == NULL){
+		free(jobdeque_p);
+		return NULL;
+	}
+	jobdeque_p->mask   = size - 1;
+	jobdeque_p->top    = 0;
+	jobdeque_p->bottom = 0;
+
+	return jobdeque_p;
+}
+
+
+/* Add job at the bottom (owner only)
+ *
+ * @return 0 on success, -1 if the deque is full
+ */
+static int jobdeque_push(jobdeque* jobdeque_p, struct job* newjob){
+
+	long bottom = __atomic_load_n(&jobdeque_p->bottom, __ATOMIC_RELAXED);
+	long top    = __atomic_load_n(&jobdeque_p->top, __ATOMIC_ACQUIRE);
+
+	if (bottom - top > jobdeque_p->mask){
+		return -1;
+	}
+
+	__atomic_store_n(&jobdeque_p->slots[bottom & jobdeque_p->mask], newjob, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&jobdeque_p->bottom, bottom + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+/* Get newest job from the bottom (owner only)
+ *
+ * @return the job, or NULL if the deque is empty
+ */
+static struct job* jobdeque_pop(jobdeque* jobdeque_p){
+
+	long bottom = __atomic_load_n(&jobdeque_p->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&jobdeque_p->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long top = __atomic_load_n(&jobdeque_p->top, __ATOMIC_RELAXED);
+
+	job* job_p = NULL;
+	if (top <= bottom){
+		job_p = __atomic_load_n(&jobdeque_p->slots[bottom & jobdeque_p->mask], __ATOMIC_RELAXED);
+		if (top == bottom){
+			/* last job, race against thieves */
+			if (!__atomic_compare_exchange_n(&jobdeque_p->top, &top, top + 1, 0,
+			                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+				job_p = NULL;
+			}
+			__atomic_store_n(&jobdeque_p->bottom, bottom + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else {
+		__atomic_store_n(&jobdeque_p->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
 	return job_p;
 }
 
 
-/* Free all queue resources back to the system */
-static void jobqueue_destroy(jobqueue* jobqueue_p){
-	jobqueue_clear(jobqueue_p);
-	free(jobqueue_p->has_jobs);
+/* Get oldest job from the top (any thread)
+ *
+ * @return the job, or NULL if the deque is empty or another thread won
+ */
+static struct job* jobdeque_steal(jobdeque* jobdeque_p){
+
+	long top = __atomic_load_n(&jobdeque_p->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long bottom = __atomic_load_n(&jobdeque_p->bottom, __ATOMIC_ACQUIRE);
+
+	if (top < bottom){
+		job* job_p = __atomic_load_n(&jobdeque_p->slots[top & jobdeque_p->mask], __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&jobdeque_p->top, &top, top + 1, 0,
+		                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+			return job_p;
+		}
+	}
+	return NULL;
+}
+
+
+/* Number of jobs in the deque
+ *
+ * The fence orders it after a push or steal of the caller, so that of a
+ * push and a steal racing for the last job at least one sees the other.
+ */
+static long jobdeque_size(jobdeque* jobdeque_p){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long top    = __atomic_load_n(&jobdeque_p->top, __ATOMIC_ACQUIRE);
+	long bottom = __atomic_load_n(&jobdeque_p->bottom, __ATOMIC_ACQUIRE);
+	return bottom - top;
+}
+
+
+/* Free deque resources back to the system */
+static void jobdeque_destroy(jobdeque* jobdeque_p){
+	if (jobdeque_p == NULL) return;
+	job* job_p;
+	while ((job_p = jobdeque_pop(jobdeque_p)) != NULL){
+		thpool_discard_copy(job_p);
+	}
+	free(jobdeque_p->slots);
+	free(jobdeque_p);
 }
 
 
@@ -522,50 +4749,245 @@ static void jobqueue_destroy(jobqueue* jobqueue_p){
 /* ======================== SYNCHRONISATION ========================= */
 
 
-/* Init semaphore to 1 or 0 */
-static void bsem_init(bsem *bsem_p, int value) {
-	if (value < 0 || value > 1) {
-		err("bsem_init(): Binary semaphore can take only values 1 or 0");
-		exit(1);
+#if defined(__linux__)
+/* Sleep while *addr holds val, at most timeout (forever if NULL) */
+static void futex_wait(volatile int* addr, int val, const struct timespec* timeout) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+
+/* Wake up to n threads sleeping on addr */
+static void futex_wake(volatile int* addr, int n) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+#endif
+
+
+/* Init semaphore with no tokens */
+static void csem_init(csem *csem_p) {
+	pthread_mutex_init(&(csem_p->mutex), NULL);
+	pthread_cond_init(&(csem_p->cond), NULL);
+	csem_p->tokens   = 0;
+	csem_p->sleepers = 0;
+	csem_p->seq      = 0;
+	csem_p->closed   = 0;
+	csem_p->kicked   = 0;
+}
+
+
+/* Reset semaphore to no tokens */
+static void csem_reset(csem *csem_p) {
+	pthread_mutex_destroy(&(csem_p->mutex));
+	pthread_cond_destroy(&(csem_p->cond));
+	csem_init(csem_p);
+}
+
+
+/* Add n tokens and wake up a thread
+ *
+ * Sleepers stay counted until they run again, so tokens already there are
+ * taken to be on their way to as many of them. One more is woken only if
+ * there are more sleepers, which saves a syscall per job while the threads
+ * keep up. Woken threads wake the others as long as tokens are left (see
+ * csem_timedwait()).
+ */
+static void csem_post(csem *csem_p, int n) {
+#if defined(__linux__)
+	int tokens = __atomic_fetch_add(&csem_p->tokens, n, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&csem_p->sleepers, __ATOMIC_SEQ_CST) > tokens){
+		__atomic_add_fetch(&csem_p->seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&csem_p->seq, 1);
+	}
+#else
+	pthread_mutex_lock(&csem_p->mutex);
+	csem_p->tokens += n;
+	if (csem_p->sleepers > 0){
+		pthread_cond_signal(&csem_p->cond);
 	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
+	pthread_mutex_unlock(&csem_p->mutex);
+#endif
 }
 
 
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) {
-	pthread_mutex_destroy(&(bsem_p->mutex));
-	pthread_cond_destroy(&(bsem_p->cond));
-	bsem_init(bsem_p, 0);
+/* Wake up all threads for good */
+static void csem_close(csem *csem_p) {
+	pthread_mutex_lock(&csem_p->mutex);
+	__atomic_store_n(&csem_p->closed, 1, __ATOMIC_SEQ_CST);
+#if defined(__linux__)
+	__atomic_add_fetch(&csem_p->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&csem_p->seq, INT_MAX);
+#else
+	pthread_cond_broadcast(&csem_p->cond);
+#endif
+	pthread_mutex_unlock(&csem_p->mutex);
 }
 
 
-/* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Make one wait return without a token, so it looks again at what it
+ * waits for
+ *
+ * Unlike a token the kick is not counted: kicks that come before a wait
+ * takes it make the one wait return. If no thread sleeps, the next one
+ * about to takes it instead of sleeping.
+ */
+static void csem_kick(csem* csem_p) {
+#if defined(__linux__)
+	__atomic_store_n(&csem_p->kicked, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&csem_p->sleepers, __ATOMIC_SEQ_CST) > 0){
+		__atomic_add_fetch(&csem_p->seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&csem_p->seq, 1);
+	}
+#else
+	pthread_mutex_lock(&csem_p->mutex);
+	csem_p->kicked = 1;
+	if (csem_p->sleepers > 0){
+		pthread_cond_signal(&csem_p->cond);
+	}
+	pthread_mutex_unlock(&csem_p->mutex);
+#endif
 }
 
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Wait until a token can be taken, at most timeout_ns (forever if < 0)
+ *
+ * A sleeper announces itself before checking the tokens one last time, and
+ * posters bump seq after adding tokens if they see a sleeper. So either the
+ * sleeper sees the token or its futex wait fails/gets woken. A thread that
+ * was woken and took a token passes the wakeup on while tokens and
+ * sleepers are left.
+ *
+ * @return 0 if a token was taken, 1 if kicked (see csem_kick()), -1 if
+ *         the semaphore was closed or the time ran out
+ */
+static int csem_timedwait(csem* csem_p, long long timeout_ns) {
+	struct timespec deadline;
+	if (timeout_ns >= 0){
+#if defined(__linux__)
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+#else
+		clock_gettime(CLOCK_REALTIME, &deadline);
+#endif
+		deadline.tv_sec  += (time_t)(timeout_ns / 1000000000LL);
+		deadline.tv_nsec += (long)(timeout_ns % 1000000000LL);
+		if (deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+#if defined(__linux__)
+	int yielded = 0;
+	int slept   = 0;
+	for (;;){
+		int tokens = __atomic_load_n(&csem_p->tokens, __ATOMIC_SEQ_CST);
+		while (tokens > 0){
+			if (__atomic_compare_exchange_n(&csem_p->tokens, &tokens, tokens - 1, 1,
+			                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+				if (slept && tokens > 1 && __atomic_load_n(&csem_p->sleepers, __ATOMIC_SEQ_CST) > 0){
+					__atomic_add_fetch(&csem_p->seq, 1, __ATOMIC_SEQ_CST);
+					futex_wake(&csem_p->seq, 1);
+				}
+				return 0;
+			}
+		}
+		if (__atomic_load_n(&csem_p->closed, __ATOMIC_SEQ_CST)){
+			return -1;
+		}
+		int kicked = 1;
+		if (__atomic_load_n(&csem_p->kicked, __ATOMIC_SEQ_CST) &&
+		    __atomic_compare_exchange_n(&csem_p->kicked, &kicked, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+			return 1;
+		}
+
+		struct timespec left, *left_p = NULL;
+		if (timeout_ns >= 0){
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left.tv_sec  = deadline.tv_sec - now.tv_sec;
+			left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0){
+				left.tv_sec--;
+				left.tv_nsec += 1000000000L;
+			}
+			if (left.tv_sec < 0){
+				return -1;
+			}
+			left_p = &left;
+		}
+
+		/* Give the producer one slice to post before going to sleep. A token
+		 * taken here saves the poster a futex wake and us the wait */
+		if (timeout_ns != 0 && !yielded){
+			yielded = 1;
+			sched_yield();
+			continue;
+		}
+
+		int seq = __atomic_load_n(&csem_p->seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&csem_p->sleepers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&csem_p->tokens, __ATOMIC_SEQ_CST) == 0 &&
+		    !__atomic_load_n(&csem_p->closed, __ATOMIC_SEQ_CST) &&
+		    !__atomic_load_n(&csem_p->kicked, __ATOMIC_SEQ_CST)){
+			futex_wait(&csem_p->seq, seq, left_p);
+			slept = 1;
+		}
+		__atomic_sub_fetch(&csem_p->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+#else
+	int ret = -1;
+	int slept = 0;
+	pthread_mutex_lock(&csem_p->mutex);
+	while (csem_p->tokens == 0 && !csem_p->closed && !csem_p->kicked) {
+		slept = 1;
+		csem_p->sleepers++;
+		int timedout = 0;
+		if (timeout_ns < 0){
+			pthread_cond_wait(&csem_p->cond, &csem_p->mutex);
+		}
+		else {
+			timedout = pthread_cond_timedwait(&csem_p->cond, &csem_p->mutex, &deadline) == ETIMEDOUT;
+		}
+		csem_p->sleepers--;
+		if (timedout) break;
+	}
+	if (csem_p->kicked && csem_p->tokens == 0 && !csem_p->closed){
+		csem_p->kicked = 0;
+		ret = 1;
+	}
+	if (csem_p->tokens > 0) {
+		csem_p->tokens--;
+		ret = 0;
+		if (slept && csem_p->tokens > 0 && csem_p->sleepers > 0){
+			pthread_cond_signal(&csem_p->cond);
+		}
+	}
+	pthread_mutex_unlock(&csem_p->mutex);
+	return ret;
+#endif
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+/* Take a token if there is one, without waiting
+ *
+ * @return 0 if a token was taken, -1 otherwise
+ */
+static int csem_trywait(csem* csem_p) {
+#if defined(__linux__)
+	int tokens = __atomic_load_n(&csem_p->tokens, __ATOMIC_SEQ_CST);
+	while (tokens > 0){
+		if (__atomic_compare_exchange_n(&csem_p->tokens, &tokens, tokens - 1, 1,
+		                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+			return 0;
+		}
+	}
+	return -1;
+#else
+	int ret = -1;
+	pthread_mutex_lock(&csem_p->mutex);
+	if (csem_p->tokens > 0) {
+		csem_p->tokens--;
+		ret = 0;
 	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
+	pthread_mutex_unlock(&csem_p->mutex);
+	return ret;
+#endif
 }
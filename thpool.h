@@ -7,6 +7,8 @@
 #ifndef _THPOOL_
 #define _THPOOL_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,6 +17,108 @@ extern "C" {
 
 
 typedef struct thpool_* threadpool;
+typedef struct thpool_future_* thpool_future;
+typedef struct thpool_group_* thpool_group;
+typedef struct thpool_graph_* thpool_graph;
+typedef unsigned long long thpool_timer;
+
+
+/* Job queue backends */
+typedef enum {
+	THPOOL_QUEUE_LIST = 0,               /* mutex protected linked list   */
+	THPOOL_QUEUE_RING                    /* bounded lock-free MPMC ring   */
+} thpool_queue_type;
+
+
+/* Policies for pinning threads to CPUs */
+typedef enum {
+	THPOOL_AFFINITY_NONE = 0,            /* threads float across CPUs     */
+	THPOOL_AFFINITY_COMPACT,             /* fill a core, then the next    */
+	THPOOL_AFFINITY_SCATTER,             /* spread over packages & cores  */
+	THPOOL_AFFINITY_CORES                /* one thread per physical core  */
+} thpool_affinity;
+
+
+/* What adding work to a full bounded job queue does */
+typedef enum {
+	THPOOL_FULL_BLOCK = 0,               /* wait until a job leaves       */
+	THPOOL_FULL_FAIL,                    /* return -1 with errno EAGAIN   */
+	THPOOL_FULL_CALLER_RUNS              /* run the job in the caller     */
+} thpool_full_policy;
+
+
+/* Ways to split a parallel loop into chunks */
+typedef enum {
+	THPOOL_SCHEDULE_STATIC = 0,          /* chunks dealt out round-robin  */
+	THPOOL_SCHEDULE_DYNAMIC,             /* grain sized chunks on demand  */
+	THPOOL_SCHEDULE_GUIDED               /* shrinking chunks on demand    */
+} thpool_schedule;
+
+
+/* Job priorities, jobs of higher ones are run first */
+typedef enum {
+	THPOOL_PRIO_LOW = 0,                 /* background work               */
+	THPOOL_PRIO_NORMAL,                  /* thpool_add_work()             */
+	THPOOL_PRIO_HIGH,
+	THPOOL_PRIO_URGENT,
+	THPOOL_PRIORITIES                    /* number of priorities          */
+} thpool_priority;
+
+
+/* Buckets of the time histograms in thpool_stats, bucket b counts times
+ * from 2^b to 2^(b+1) nanoseconds (the last one counts anything longer) */
+#define THPOOL_STATS_BUCKETS 32
+
+
+/* Counters of a single thread, see thpool_get_stats() */
+typedef struct thpool_thread_stats {
+	unsigned long long jobs;             /* jobs run                      */
+	unsigned long long busy_ns;          /* time spent running jobs       */
+	unsigned long long idle_ns;          /* time spent waiting for jobs   */
+	unsigned long long empty_wakeups;    /* woke up but found no job      */
+} thpool_thread_stats;
+
+
+/* Pool statistics, filled by thpool_get_stats() */
+typedef struct thpool_stats {
+	unsigned long long submitted;        /* jobs added                    */
+	unsigned long long completed;        /* jobs that finished            */
+	int queue_len;                       /* jobs queued right now         */
+	int queue_peak;                      /* most jobs ever queued         */
+	unsigned long long empty_wakeups;    /* of all threads                */
+	unsigned long long wait_hist[THPOOL_STATS_BUCKETS]; /* added to run   */
+	unsigned long long run_hist[THPOOL_STATS_BUCKETS];  /* run to return  */
+	thpool_thread_stats* threads;        /* in: array or NULL             */
+	int max_threads;                     /* in: entries in threads        */
+	int num_threads;                     /* out: entries filled           */
+} thpool_stats;
+
+
+/* Threadpool configuration, used by thpool_init_config() */
+typedef struct thpool_config {
+	int num_threads;                     /* number of threads in the pool */
+	thpool_queue_type queue_type;        /* job queue backend             */
+	unsigned int ring_capacity;          /* slots in the ring backend     */
+	int work_stealing;                   /* per-thread deques if non-zero */
+	unsigned int deque_capacity;         /* slots in each thread's deque  */
+	size_t job_prealloc;                 /* job nodes to allocate upfront */
+	unsigned int prio_aging;             /* see thpool_add_work_prio()    */
+	int min_threads;                     /* elastic: fewest threads kept  */
+	int max_threads;                     /* elastic: most threads, 0 off  */
+	int spawn_threshold;                 /* elastic: queued jobs to grow  */
+	unsigned int idle_timeout_ms;        /* elastic: idle time to retire  */
+	thpool_affinity affinity;            /* pinning of threads to CPUs    */
+	const int* cpus;                     /* CPUs to pin to, NULL for all  */
+	int num_cpus;                        /* number of CPUs in cpus        */
+	const char* sysfs_root;              /* NULL for /sys/devices/system  */
+	int numa;                            /* job queue per NUMA node       */
+	int trace;                           /* record a trace from the start */
+	unsigned int trace_events;           /* trace events kept per thread  */
+	const char* trace_path;              /* dump the trace at destroy     */
+	unsigned int queue_capacity;         /* most jobs queued, 0 unbounded */
+	thpool_full_policy full_policy;      /* when queue_capacity is hit    */
+	int wait_helps;                      /* thpool_wait() runs jobs too   */
+} thpool_config;
 
 
 /**
@@ -37,6 +141,104 @@ typedef struct thpool_* threadpool;
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief  Fill a configuration with the default values
+ *
+ * The defaults give the same threadpool as thpool_init(). Always call this
+ * before changing any fields so that new fields get sane values.
+ *
+ * @example
+ *
+ *    ..
+ *    thpool_config config;
+ *    thpool_config_defaults(&config);
+ *    config.num_threads = 8;
+ *    config.queue_type  = THPOOL_QUEUE_RING;
+ *    threadpool thpool = thpool_init_config(&config);
+ *    ..
+ *
+ * @param  config        configuration to fill
+ * @return nothing
+ */
+void thpool_config_defaults(thpool_config* config);
+
+
+/**
+ * @brief  Initialize threadpool from a configuration
+ *
+ * Same as thpool_init() but lets you pick the job queue backend.
+ *
+ * THPOOL_QUEUE_LIST is the classic linked list guarded by a mutex. It is
+ * unbounded and strictly FIFO.
+ *
+ * THPOOL_QUEUE_RING is a fixed size lock-free ring with ring_capacity slots
+ * (rounded up to a power of two). Adding and pulling a job are a couple of
+ * atomic operations, so many producers and workers don't serialise on one
+ * mutex. If the ring is full, jobs spill over to a linked list so adding
+ * work never fails; jobs in the ring are served before spilled ones.
+ *
+ * If work_stealing is set, every thread gets its own deque of
+ * deque_capacity slots (rounded up to a power of two). Work added from
+ * inside a job goes to the deque of the thread running that job, which
+ * runs it next (last in, first out) while the data is still in its cache.
+ * Idle threads steal the oldest jobs from the deques of random threads.
+ * Work added from outside the pool still goes through the job queue. This
+ * suits jobs that fan out more jobs, like recursive tree walks.
+ *
+ * Job nodes come from a pool-owned allocator and are recycled, so once the
+ * pool has warmed up adding work doesn't touch the heap. job_prealloc nodes
+ * are allocated upfront; size it with thpool_slab_high_water().
+ *
+ * prio_aging keeps low priority jobs from starving, see
+ * thpool_add_work_prio().
+ *
+ * If max_threads is above num_threads the pool is elastic. It starts with
+ * num_threads threads. When a job is added while more than spawn_threshold
+ * jobs are queued on top of one for every idle thread, a thread is added,
+ * up to max_threads. Threads that found no work for idle_timeout_ms
+ * retire, down to min_threads (at most num_threads). Otherwise the pool
+ * keeps num_threads threads until thpool_resize() is called.
+ *
+ * affinity pins every thread to one CPU of cpus (all online CPUs if NULL),
+ * ordered by the CPU topology found under sysfs_root:
+ *   THPOOL_AFFINITY_COMPACT  fills the SMT siblings of a core, then the
+ *                            next core of the same package
+ *   THPOOL_AFFINITY_SCATTER  one CPU per package in turns, SMT siblings
+ *                            only once every core has a thread
+ *   THPOOL_AFFINITY_CORES    only the first CPU of each physical core
+ * Thread n gets the (n % number of CPUs)th CPU of that order. Point
+ * sysfs_root to a copy of /sys/devices/system to try other topologies.
+ *
+ * If numa is set and sysfs_root lists more than one NUMA node, every node
+ * gets its own job queue and threads are spread over the nodes (or follow
+ * the node of their CPU with affinity). Threads only run on the CPUs of
+ * their node and pull from its queue. Work is queued on the node the
+ * caller runs on, see thpool_add_work_node() to pick one. A thread whose
+ * node has no jobs queued takes jobs from another node only when that
+ * node has no idle thread.
+ *
+ * trace starts recording a trace right away, see thpool_trace_start().
+ * Every thread keeps its last trace_events events. If trace_path is set,
+ * the trace is written there by thpool_destroy().
+ *
+ * If queue_capacity is set, at most that many jobs added from outside the
+ * pool wait in the queues. A job frees its slot once a thread starts it.
+ * When the queue is full, adding work does as full_policy says:
+ *   THPOOL_FULL_BLOCK        waits until a slot is free
+ *   THPOOL_FULL_FAIL         returns -1 and sets errno to EAGAIN, batches
+ *                            are only added if they fit as a whole
+ *   THPOOL_FULL_CALLER_RUNS  runs the job on the calling thread
+ * thpool_try_add_work() never waits, whatever the policy. Jobs added by
+ * the pool's own threads (from inside jobs) are always queued, so threads
+ * never wait on themselves.
+ *
+ * @param  config        configuration of the threadpool
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_config(const thpool_config* config);
+
+
 /**
  * @brief Add work to the job queue
  *
@@ -46,6 +248,9 @@ threadpool thpool_init(int num_threads);
  *
  * NOTICE: You have to cast both the function and argument to not get warnings.
  *
+ * If the job queue is bounded and full, this waits, fails or runs the job
+ * right away, see queue_capacity in thpool_init_config().
+ *
  * @example
  *
  *    void print_num(int num){
@@ -67,6 +272,580 @@ threadpool thpool_init(int num_threads);
 int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
 
 
+/**
+ * @brief Add work to the job queue unless it is full
+ *
+ * Same as thpool_add_work() but if the bounded queue (see queue_capacity
+ * in thpool_init_config()) is full it fails right away with errno set to
+ * EAGAIN, like THPOOL_FULL_FAIL does, instead of following full_policy.
+ * Without a queue_capacity it never fails that way.
+ *
+ * @example
+ *
+ *    if (thpool_try_add_work(thpool, (void*)handle, (void*)request) == -1 && errno == EAGAIN){
+ *       reject(request);
+ *    }
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return 0 on success, -1 otherwise (errno EAGAIN if the queue is full).
+ */
+int thpool_try_add_work(threadpool, void (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Add work with a copy of its argument to the job queue
+ *
+ * Same as thpool_add_work() but the job gets a pointer to a copy of len
+ * bytes of data, so the caller can pass a struct from its stack instead of
+ * allocating one per job. Up to 80 bytes (THPOOL_JOB_INLINE when compiling
+ * thpool.c) are stored in the job itself, bigger arguments are copied to
+ * the heap. The copy lives until the job returns and is aligned for any
+ * basic type.
+ *
+ * @example
+ *
+ *    struct range { float* v; size_t begin, end; };
+ *
+ *    void scale(void* arg){
+ *       struct range* r = arg;
+ *       ..
+ *    }
+ *
+ *    struct range r = { v, 0, 1024 };
+ *    thpool_add_work_copy(thpool, scale, &r, sizeof(r));
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  data          argument to copy
+ * @param  len           size of the argument in bytes
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_copy(threadpool, void (*function_p)(void*), const void* data, size_t len);
+
+
+/**
+ * @brief Add work with a priority to the job queue
+ *
+ * Same as thpool_add_work() but queued jobs of higher priority run before
+ * any job of lower priority, and jobs of the same priority run in the order
+ * they were added. thpool_add_work() uses THPOOL_PRIO_NORMAL.
+ *
+ * Strict priorities can starve low priority jobs. If config.prio_aging is
+ * n > 0, every n-th job is picked from the lowest priority that has jobs.
+ *
+ * With work_stealing on, a thread runs the jobs its own jobs added before
+ * looking at the job queue again.
+ *
+ * @example
+ *
+ *    thpool_add_work_prio(thpool, compact, table, THPOOL_PRIO_LOW);
+ *    thpool_add_work_prio(thpool, serve, request, THPOOL_PRIO_HIGH);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  prio          priority, one of thpool_priority
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_prio(threadpool, void (*function_p)(void*), void* arg_p, int prio);
+
+
+/**
+ * @brief Add work for the threads of a NUMA node
+ *
+ * Same as thpool_add_work() but the job is queued on the given node, so it
+ * runs near memory allocated there unless the node's threads are all busy
+ * and another node is idle. See config.numa.
+ *
+ * @example
+ *
+ *    thpool_add_work_node(thpool, sum_rows, rows_on_node1, 1);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  node          NUMA node id as in /sys/devices/system/node
+ * @return 0 on success, -1 otherwise (e.g. unknown node).
+ */
+int thpool_add_work_node(threadpool, void (*function_p)(void*), void* arg_p, int node);
+
+
+/**
+ * @brief Add many jobs to the job queue at once
+ *
+ * Same as calling thpool_add_work() for every argument but the jobs are
+ * queued in one go, under a single lock acquisition, and only as many
+ * threads as needed are woken up. Use it when adding bursts of work.
+ *
+ * @example
+ *
+ *    void print_num(void* num){
+ *       printf("%d\n", *(int*)num);
+ *    }
+ *
+ *    int main() {
+ *       ..
+ *       int nums[100];
+ *       void* args[100];
+ *       for (i=0; i<100; i++){
+ *          nums[i] = i;
+ *          args[i] = &nums[i];
+ *       }
+ *       thpool_add_work_batch(thpool, print_num, args, 100);
+ *       ..
+ *    }
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function every job runs
+ * @param  arg_p         array of n arguments, one per job (or NULL)
+ * @param  n             number of jobs to add
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_batch(threadpool, void (*function_p)(void*), void** arg_p, size_t n);
+
+
+/**
+ * @brief Add many jobs with their own functions to the job queue at once
+ *
+ * Same as thpool_add_work_batch() but job i runs function_p[i] with
+ * argument arg_p[i].
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    array of n function pointers, one per job
+ * @param  arg_p         array of n arguments, one per job (or NULL)
+ * @param  n             number of jobs to add
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_batch_fns(threadpool, void (**function_p)(void*), void** arg_p, size_t n);
+
+
+/**
+ * @brief Add work to the job queue after a delay
+ *
+ * The job is added once delay_ns have passed, rounded up to the timer tick
+ * of 100us, so it never runs early. There is no timer thread: an idle
+ * thread of the pool sleeps until the next timer is due, and busy threads
+ * check for due timers between jobs. So a timer fires late only while all
+ * threads are inside long jobs (or the pool is paused).
+ *
+ * Timers are kept in a hierarchical timing wheel, adding and cancelling
+ * one takes constant time. thpool_wait() doesn't wait for timers that
+ * haven't fired yet; thpool_destroy() drops them.
+ *
+ * @example
+ *
+ *    thpool_timer t = thpool_add_work_after(thpool, 500000000ULL, (void*)expire, (void*)session);
+ *    ..
+ *    thpool_timer_cancel(thpool, t);        //session is still active
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  delay_ns      nanoseconds from now until the job is added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return handle of the timer, 0 on error
+ */
+thpool_timer thpool_add_work_after(threadpool, unsigned long long delay_ns, void (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Add work to the job queue every period
+ *
+ * Same as thpool_add_work_after() but the job is added again every
+ * period_ns until the timer is cancelled, first after one period. Runs
+ * that are missed because all threads were busy are skipped, not bunched
+ * up. The next run may start while the last one is still running.
+ *
+ * @example
+ *
+ *    thpool_timer t = thpool_add_work_every(thpool, 1000000000ULL, (void*)flush, (void*)log);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  period_ns     nanoseconds between runs, not 0
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return handle of the timer, 0 on error
+ */
+thpool_timer thpool_add_work_every(threadpool, unsigned long long period_ns, void (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Cancel a timer
+ *
+ * The timer's job won't be added anymore. A job that was added already
+ * still runs. Handles of timers that fired (or were cancelled) go stale,
+ * they are never mistaken for a newer timer.
+ *
+ * @param  threadpool    threadpool of the timer
+ * @param  timer         handle from thpool_add_work_after() or
+ *                       thpool_add_work_every()
+ * @return 0 if the timer was cancelled, -1 if it fired or is unknown
+ */
+int thpool_timer_cancel(threadpool, thpool_timer timer);
+
+
+/**
+ * @brief Add work and get a handle to wait for just that job
+ *
+ * Same as thpool_add_work() but the function returns a result and a future
+ * is handed back. The future tells when the job has finished and holds its
+ * result, so the caller doesn't have to wait for the whole pool to go idle.
+ *
+ * Futures are recycled by the threadpool. Give every future back with
+ * thpool_future_release() once done with it and before thpool_destroy().
+ *
+ * @example
+ *
+ *    void* square(void* num){
+ *       return (void*)((long)num * (long)num);
+ *    }
+ *
+ *    int main() {
+ *       ..
+ *       thpool_future f = thpool_submit(thpool, square, (void*)7);
+ *       printf("%ld\n", (long)thpool_future_wait(f));
+ *       thpool_future_release(f);
+ *       ..
+ *    }
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return thpool_future handle of the job on success,
+ *                       NULL on error
+ */
+thpool_future thpool_submit(threadpool, void* (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Wait for the job of a future to finish
+ *
+ * @param  future        future returned by thpool_submit()
+ * @return void*         what the job's function returned
+ */
+void* thpool_future_wait(thpool_future future);
+
+
+/**
+ * @brief Wait for the job of a future to finish, for a limited time
+ *
+ * @param  future        future returned by thpool_submit()
+ * @param  timeout_ns    nanoseconds to wait at most
+ * @param  result_p      where to store the job's result (or NULL)
+ * @return 0 if the job finished, -1 on timeout.
+ */
+int thpool_future_wait_timeout(thpool_future future, unsigned long long timeout_ns, void** result_p);
+
+
+/**
+ * @brief Tell if the job of a future has finished, without blocking
+ *
+ * @param  future        future returned by thpool_submit()
+ * @return 1 if the job finished, 0 otherwise.
+ */
+int thpool_future_ready(thpool_future future);
+
+
+/**
+ * @brief Give a future back to the threadpool
+ *
+ * The future may be released before its job has finished; it is recycled
+ * once the job is done. The handle must not be used afterwards.
+ *
+ * @param  future        future returned by thpool_submit()
+ * @return nothing
+ */
+void thpool_future_release(thpool_future future);
+
+
+/**
+ * @brief Cancel the job of a future
+ *
+ * A job that hasn't started yet won't run: it is skipped once a thread
+ * pulls it, which takes constant time however long the queue is. Its
+ * future is finished right away and waits on it return NULL. The job's
+ * argument is not freed, that is up to the caller, unless thpool_clear()
+ * drops the job before a thread skips it and hands it to its destructor.
+ *
+ * A job that is running already keeps running, but thpool_cancelled()
+ * returns 1 in it from now on so it can stop early.
+ *
+ * @example
+ *
+ *    void on_disconnect(client* c){
+ *       thpool_cancel(c->pending);
+ *       thpool_future_release(c->pending);
+ *    }
+ *
+ * @param  future        future returned by thpool_submit()
+ * @return 0 if the job won't run, -1 if it started (or finished) already
+ */
+int thpool_cancel(thpool_future future);
+
+
+/**
+ * @brief Tell a running job whether it should stop early
+ *
+ * Long jobs can poll this and return early. It is 1 if the job was added
+ * with thpool_submit() to this threadpool and cancelled since, or if the
+ * threadpool is being destroyed. It is always 0 outside of jobs.
+ *
+ * @example
+ *
+ *    void* crunch(void* data){
+ *       while (more(data) && !thpool_cancelled(thpool)){
+ *          step(data);
+ *       }
+ *       ..
+ *    }
+ *
+ * @param  threadpool    threadpool running the calling job
+ * @return 1 if the job should stop, 0 otherwise.
+ */
+int thpool_cancelled(threadpool);
+
+
+/**
+ * @brief Create a task group
+ *
+ * A task group collects jobs so that they can be waited for together,
+ * without waiting for the rest of the threadpool. Groups may be waited for
+ * from inside jobs, which allows nested fork-join parallelism.
+ *
+ * @example
+ *
+ *    void sum_half(void* range){
+ *       ..
+ *       thpool_group group = thpool_group_init(thpool);
+ *       thpool_group_add_work(group, sum_half, lower);
+ *       thpool_group_add_work(group, sum_half, upper);
+ *       thpool_group_wait(group);   // runs other jobs meanwhile
+ *       thpool_group_destroy(group);
+ *       ..
+ *    }
+ *
+ * @param  threadpool    threadpool the jobs of the group are added to
+ * @return thpool_group  created group on success,
+ *                       NULL on error
+ */
+thpool_group thpool_group_init(threadpool);
+
+
+/**
+ * @brief Add work to the job queue as part of a group
+ *
+ * Same as thpool_add_work() but the job counts in the given group.
+ *
+ * @param  group         group the job is part of
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_group_add_work(thpool_group group, void (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Wait for all jobs of a group to finish
+ *
+ * Jobs added to the group while waiting, e.g. by the group's own jobs, are
+ * waited for as well. When called from a thread of the group's threadpool,
+ * the thread runs queued jobs while waiting instead of blocking, so unlike
+ * thpool_wait() this may be called from inside a job.
+ *
+ * Jobs run while waiting nest on the caller's stack. Enable work_stealing
+ * for deep fork-join trees: threads then run the jobs they added first,
+ * so the nesting stays as deep as the tree.
+ *
+ * @param  group         group to wait for
+ * @return nothing
+ */
+void thpool_group_wait(thpool_group group);
+
+
+/**
+ * @brief Destroy a task group
+ *
+ * The group must have no unfinished jobs, i.e. wait for it first.
+ *
+ * @param  group         group to destroy
+ * @return nothing
+ */
+void thpool_group_destroy(thpool_group group);
+
+
+/**
+ * @brief Create a task graph
+ *
+ * A task graph is a set of jobs (nodes) with dependencies (edges) between
+ * them. When the graph runs, a job is queued the moment the last job it
+ * depends on finishes, so independent branches keep the pool busy instead
+ * of waiting at a barrier. A graph can be run again once it has finished
+ * without allocating anything.
+ *
+ * @example
+ *
+ *    thpool_graph graph = thpool_graph_init(thpool);
+ *    int decode = thpool_graph_add_node(graph, decode_frame, frame);
+ *    int merge  = thpool_graph_add_node(graph, merge_tiles, frame);
+ *    for (i=0; i<4; i++){
+ *       int tile = thpool_graph_add_node(graph, transform_tile, &tiles[i]);
+ *       thpool_graph_add_edge(graph, decode, tile);
+ *       thpool_graph_add_edge(graph, tile, merge);
+ *    }
+ *    while (next_frame(frame)){
+ *       thpool_graph_run(graph);
+ *       thpool_graph_wait(graph);
+ *    }
+ *    thpool_graph_destroy(graph);
+ *
+ * @param  threadpool    the threadpool the graph runs on
+ * @return thpool_graph  the graph on success, NULL on error
+ */
+thpool_graph thpool_graph_init(threadpool);
+
+
+/**
+ * @brief Add a job to a task graph
+ *
+ * @param  graph         the graph
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return the id of the new node, -1 on error
+ */
+int thpool_graph_add_node(thpool_graph graph, void (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Make a job of a task graph wait for another
+ *
+ * Don't change a graph while it runs.
+ *
+ * @param  graph         the graph
+ * @param  from          id of the node that must finish first
+ * @param  to            id of the node that waits for it
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_graph_add_edge(thpool_graph graph, int from, int to);
+
+
+/**
+ * @brief Run a task graph
+ *
+ * Queues the jobs that depend on nothing and returns. Every other job is
+ * queued by the last job it depends on.
+ *
+ * @param  graph         the graph
+ * @return 0 on success, -1 if the graph has a cycle or is still running.
+ */
+int thpool_graph_run(thpool_graph graph);
+
+
+/**
+ * @brief Wait until every job of a task graph has finished
+ *
+ * Like thpool_group_wait(), a thread of the pool runs other jobs meanwhile.
+ *
+ * @param  graph         the graph
+ * @return nothing
+ */
+void thpool_graph_wait(thpool_graph graph);
+
+
+/**
+ * @brief Destroy a task graph
+ *
+ * The graph must not be running.
+ *
+ * @param  graph         the graph
+ * @return nothing
+ */
+void thpool_graph_destroy(thpool_graph graph);
+
+
+/**
+ * @brief Run a function over a range of indices in parallel
+ *
+ * Splits [begin, end) into chunks and calls function_p(chunk_begin,
+ * chunk_end, ctx) for each of them on the threads of the pool and on the
+ * calling thread, which takes part instead of just waiting. Returns once
+ * every chunk has run. Chunks are claimed by at most one job per thread,
+ * so nothing is allocated per chunk.
+ *
+ * schedule picks how the range is split:
+ *   THPOOL_SCHEDULE_STATIC   chunks of grain indices dealt out in turns,
+ *                            or one equal block each if grain is 0. Least
+ *                            overhead when every index costs the same
+ *   THPOOL_SCHEDULE_DYNAMIC  the next grain indices go to whoever is free
+ *   THPOOL_SCHEDULE_GUIDED   like dynamic but chunks start large and
+ *                            shrink down to grain as the range runs out
+ * A grain of 0 picks a few chunks per thread.
+ *
+ * Can be called from a job; the thread runs other jobs while it waits.
+ *
+ * @example
+ *
+ *    void scale(long begin, long end, void* ctx){
+ *       float* v = ctx;
+ *       for (long i=begin; i<end; i++) v[i] *= 2;
+ *    }
+ *
+ *    thpool_parallel_for(thpool, 0, n, 4096, THPOOL_SCHEDULE_DYNAMIC, scale, v);
+ *
+ * @param  threadpool    the threadpool to run on
+ * @param  begin         first index
+ * @param  end           one past the last index
+ * @param  grain         smallest chunk, 0 for a default
+ * @param  schedule      one of thpool_schedule
+ * @param  function_p    called for every chunk
+ * @param  ctx           passed to function_p
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_parallel_for(threadpool, long begin, long end, long grain, int schedule,
+                        void (*function_p)(long, long, void*), void* ctx);
+
+
+/**
+ * @brief Reduce a range of indices in parallel
+ *
+ * Same as thpool_parallel_for() but function_p(chunk_begin, chunk_end,
+ * ctx, partial) accumulates into a partial result of size bytes owned by
+ * the participant running it. Partials start as a copy of *result, which
+ * must hold the identity (e.g. 0 for a sum). At the end each partial is
+ * merged into result with combine_p(result, partial, ctx) on the calling
+ * thread. Partials are allocated once per call.
+ *
+ * @example
+ *
+ *    void sum(long begin, long end, void* ctx, void* partial){
+ *       for (long i=begin; i<end; i++) *(double*)partial += ((double*)ctx)[i];
+ *    }
+ *    void add(void* result, const void* partial, void* ctx){
+ *       *(double*)result += *(const double*)partial;
+ *    }
+ *
+ *    double total = 0;
+ *    thpool_parallel_reduce(thpool, 0, n, 0, THPOOL_SCHEDULE_STATIC,
+ *                           sum, add, values, &total, sizeof(total));
+ *
+ * @param  threadpool    the threadpool to run on
+ * @param  begin         first index
+ * @param  end           one past the last index
+ * @param  grain         smallest chunk, 0 for a default
+ * @param  schedule      one of thpool_schedule
+ * @param  function_p    called for every chunk with a partial result
+ * @param  combine_p     merges a partial result into result
+ * @param  ctx           passed to function_p and combine_p
+ * @param  result        identity on input, the reduction on return
+ * @param  size          size of result in bytes
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_parallel_reduce(threadpool, long begin, long end, long grain, int schedule,
+                           void (*function_p)(long, long, void*, void*),
+                           void (*combine_p)(void*, const void*, void*),
+                           void* ctx, void* result, size_t size);
+
+
 /**
  * @brief Wait for all queued jobs to finish
  *
@@ -74,11 +853,11 @@ int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
  * Once the queue is empty and all work has completed, the calling thread
  * (probably the main program) will continue.
  *
- * Smart polling is used in wait. The polling is initially 0 - meaning that
- * there is virtually no polling at all. If after 1 seconds the threads
- * haven't finished, the polling interval starts growing exponentially
- * until it reaches max_secs seconds. Then it jumps down to a maximum polling
- * interval assuming that heavy processing is being used in the threadpool.
+ * There is no polling: the caller sleeps until the thread finishing the
+ * last job (or thpool_clear() emptying the queue) finds the pool idle and
+ * wakes it up. Jobs added while waiting are waited for too. With
+ * wait_helps set (see thpool_init_config()) the caller runs queued jobs
+ * itself and only sleeps once none are left to take.
  *
  * @example
  *
@@ -98,13 +877,66 @@ void thpool_wait(threadpool);
 
 
 /**
- * @brief Pauses all threads immediately
+ * @brief Wait for all queued jobs to finish, but only so long
+ *
+ * Like thpool_wait() but gives up once timeout_ns nanoseconds have passed.
+ *
+ * If config.wait_helps is set, a thread outside the pool that waits with
+ * thpool_wait() or thpool_wait_timeout() pulls queued jobs and runs them
+ * itself until there are none left to take, and only then sleeps until the
+ * running ones have finished. A job it started may take it past the
+ * timeout. Paused pools are left alone.
+ *
+ * @example
+ *
+ *    ..
+ *    thpool_config config;
+ *    thpool_config_defaults(&config);
+ *    config.wait_helps = 1;
+ *    threadpool thpool = thpool_init_config(&config);
+ *    ..
+ *    while (thpool_wait_timeout(thpool, 100000000) == -1){
+ *       puts("Still working..");
+ *    }
+ *    ..
+ *
+ * @param threadpool     the threadpool to wait for
+ * @param timeout_ns     longest time to wait, in nanoseconds
+ * @return 0 if all jobs have finished, -1 if the timeout passed first
+ */
+int thpool_wait_timeout(threadpool, unsigned long long timeout_ns);
+
+
+/**
+ * @brief Drop all jobs that haven't started yet
+ *
+ * Running jobs keep running and threads keep pulling jobs while the queue
+ * is cleared; jobs added meanwhile may or may not be dropped. If given,
+ * destructor is called with the argument of every dropped job so it can
+ * be freed, cancelled jobs still queued included. Futures of dropped jobs
+ * are finished as if cancelled. Jobs of
+ * task graphs and parallel loops are never dropped, and timers that
+ * haven't fired are left alone (see thpool_timer_cancel()).
  *
- * The threads will be paused no matter if they are idle or working.
- * The threads return to their previous states once thpool_resume
- * is called.
+ * @example
  *
- * While the thread is being paused, new work can be added.
+ *    thpool_clear(thpool, free);            //args were malloc'ed
+ *
+ * @param  threadpool    threadpool to clear
+ * @param  destructor_p  function to free a job's argument, or NULL
+ * @return number of jobs dropped
+ */
+int thpool_clear(threadpool, void (*destructor_p)(void*));
+
+
+/**
+ * @brief Pauses all threads once their current job is done
+ *
+ * Idle threads stay idle and working threads stop after the job they are
+ * running, without being interrupted. No more jobs are started until
+ * thpool_resume is called. Only the given threadpool is affected.
+ *
+ * While the threadpool is paused, new work can be added.
  *
  * @example
  *
@@ -121,9 +953,32 @@ void thpool_wait(threadpool);
 void thpool_pause(threadpool);
 
 
+/**
+ * @brief Pauses all threads once the job queue is empty
+ *
+ * Same as thpool_pause but the threads first run all jobs in the queue,
+ * including ones added while draining. Once the queue is empty the
+ * threadpool is paused until thpool_resume is called.
+ *
+ * @example
+ *
+ *    thpool_pause_drain(thpool);
+ *    ..
+ *    // Work added from here on waits for thpool_resume
+ *    ..
+ *    thpool_resume(thpool);
+ *
+ * @param threadpool    the threadpool where the threads should be paused
+ * @return nothing
+ */
+void thpool_pause_drain(threadpool);
+
+
 /**
  * @brief Unpauses all threads if they are paused
  *
+ * Paused threads are woken up right away instead of polling.
+ *
  * @example
  *    ..
  *    thpool_pause(thpool);
@@ -159,6 +1014,94 @@ void thpool_resume(threadpool);
 void thpool_destroy(threadpool);
 
 
+/**
+ * @brief Change the number of threads
+ *
+ * Threads are added right away. If there are too many, idle threads exit
+ * right away and busy ones once their current job is done. Queued jobs
+ * stay queued; a pool resized to 0 threads runs them once it gets threads
+ * again.
+ *
+ * An elastic pool keeps adapting afterwards, with min_threads and
+ * max_threads widened to include num_threads if needed.
+ *
+ * @example
+ *
+ *    threadpool thpool = thpool_init(4);
+ *    ..
+ *    thpool_resize(thpool, 16);   // batch window
+ *    ..
+ *    thpool_resize(thpool, 4);
+ *
+ * @param threadpool     the threadpool to resize
+ * @param num_threads    the new number of threads
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_resize(threadpool, int num_threads);
+
+
+/**
+ * @brief Show the CPU a thread is pinned to
+ *
+ * @param threadpool     the threadpool of interest
+ * @param thread_id      id of the thread, from 0 to the number of threads
+ * @return integer       the CPU given to the thread by config.affinity,
+ *                       -1 if the thread is not pinned
+ */
+int thpool_thread_cpu(threadpool, int thread_id);
+
+
+/**
+ * @brief Show the CPU the caller runs on
+ *
+ * Meant to be called from jobs. For a pinned thread of the threadpool this
+ * is its CPU, for other threads the CPU they happen to run on right now.
+ *
+ * @example
+ *
+ *    void job(void* thpool){
+ *       int cpu = thpool_current_cpu(thpool);
+ *       ..
+ *    }
+ *
+ * @param threadpool     the threadpool of interest
+ * @return integer       the CPU, -1 if unknown
+ */
+int thpool_current_cpu(threadpool);
+
+
+/**
+ * @brief Show the NUMA node the caller runs on
+ *
+ * For threads of the threadpool this is the node whose queue they pull
+ * from. A pool without config.numa has a single node 0.
+ *
+ * @param threadpool     the threadpool of interest
+ * @return integer       the node id, -1 if unknown
+ */
+int thpool_current_node(threadpool);
+
+
+/**
+ * @brief Show the number of NUMA nodes with a job queue
+ *
+ * @param threadpool     the threadpool of interest
+ * @return integer       number of nodes, 1 without config.numa
+ */
+int thpool_num_nodes(threadpool);
+
+
+/**
+ * @brief Show the number of threads
+ *
+ * Threads that are asked to exit are no longer counted.
+ *
+ * @param threadpool     the threadpool of interest
+ * @return integer       number of threads
+ */
+int thpool_num_threads(threadpool);
+
+
 /**
  * @brief Show currently working threads
  *
@@ -180,6 +1123,105 @@ void thpool_destroy(threadpool);
 int thpool_num_threads_working(threadpool);
 
 
+/**
+ * @brief Show how many job nodes the pool ever needed
+ *
+ * Job nodes are recycled, so this is the most jobs that were queued or
+ * running at the same time (plus the few kept in per-thread caches). Use
+ * it to pick config.job_prealloc.
+ *
+ * @example
+ * int main() {
+ *    threadpool thpool = thpool_init(4);
+ *    ..
+ *    printf("Job nodes: %zu\n", thpool_slab_high_water(thpool));
+ *    ..
+ *    return 0;
+ * }
+ *
+ * @param threadpool     the threadpool of interest
+ * @return size_t        number of job nodes allocated so far
+ */
+size_t thpool_slab_high_water(threadpool);
+
+
+/**
+ * @brief Read the statistics of a threadpool
+ *
+ * Threads count their own jobs and times without locks or shared writes;
+ * this adds them up. The sums are read while threads keep running, so they
+ * are only consistent with each other once the pool is idle.
+ *
+ * Threads are listed by id, including threads that retired, so an elastic
+ * pool can report more threads than it runs. Set threads and max_threads
+ * to receive up to max_threads of them.
+ *
+ * Statistics are off by default, as the times they need cost a few clock
+ * readings per job. Compile thpool.c with -DTHPOOL_ENABLE_STATS to collect
+ * them; otherwise this returns -1.
+ *
+ * @example
+ *
+ *    thpool_thread_stats threads[8];
+ *    thpool_stats stats;
+ *    stats.threads     = threads;
+ *    stats.max_threads = 8;
+ *    thpool_get_stats(thpool, &stats);
+ *    printf("%llu jobs, peak queue %d\n", stats.completed, stats.queue_peak);
+ *
+ * @param threadpool     the threadpool of interest
+ * @param stats          filled with the statistics
+ * @return 0 on success, -1 if statistics were compiled out
+ */
+int thpool_get_stats(threadpool, thpool_stats* stats);
+
+
+/**
+ * @brief Start recording a trace of the threadpool
+ *
+ * Every thread records when it ran which job and how long it waited for
+ * work in a ring buffer of its own (config.trace_events events, the oldest
+ * get overwritten). Jobs also record how long they were queued. Recording
+ * an event takes a couple of clock reads and stores.
+ *
+ * @example
+ *
+ *    thpool_trace_start(thpool);
+ *    run_slow_batch(thpool);
+ *    thpool_wait(thpool);
+ *    thpool_trace_stop(thpool);
+ *    thpool_trace_dump(thpool, "batch.json");   // open in ui.perfetto.dev
+ *
+ * @param threadpool     the threadpool of interest
+ * @return nothing
+ */
+void thpool_trace_start(threadpool);
+
+
+/**
+ * @brief Stop recording a trace, the events recorded so far are kept
+ *
+ * @param threadpool     the threadpool of interest
+ * @return nothing
+ */
+void thpool_trace_stop(threadpool);
+
+
+/**
+ * @brief Write the trace to a file
+ *
+ * Writes Chrome trace event JSON, which chrome://tracing and Perfetto can
+ * show: one track per thread with a slice for every job (its function and
+ * queue wait as arguments) and every idle interval. Events recorded while
+ * dumping may come out garbled, stop tracing first.
+ *
+ * @param threadpool     the threadpool of interest
+ * @param path           file to write
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_trace_dump(threadpool, const char* path);
+
+
 #ifdef __cplusplus
 }
 #endif